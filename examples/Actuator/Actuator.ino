@@ -10,6 +10,8 @@
 #include <pIoT_Energy.h>
 #include <pIoT_JSON.h>
 #include <pIoT_Protocol.h>
+#include <pIoT_Scheduler.h>
+#include <pIoT_Messages.h> //hello and switch messages
 
 
 /** Address of this node.
@@ -20,107 +22,84 @@ long nodeAddress = 4321;
  */
 int helloPeriod = 10;
 
-/** The last time an hello message was sent.
- */
-unsigned long lastHelloSent = 0;
-
 /** If true puts the MCU in sleep mode.
  * This allows saving some power, but the radio
  * module will be kept on receving.
  */
 boolean sleep = true;
 
-/** Definition of a "hello message"
- * that contains internal values of the
- * node. Hello message is recommended to
- * be used on all nodes.
- */
-unsigned int helloMsgType = 1;
-struct helloMessage {
-  float internalTemp;
-  float internalVcc;
-  unsigned long operationTime;
-  unsigned long sentMsgs;
-  unsigned long unsentMsgs;
-  unsigned long receivedMsgs;
-};
-
-/** Definition of the message that contains
- * the information about the status of a switch.
- */
-unsigned int switchMsgType = 101;
-struct switchMessage {
-  boolean on;
-};
 
+void handleSwitchMessage(boolean broadcast, long sender, switchMessage& msg);
+void handleUnknownMessage(boolean broadcast, long sender, unsigned int msgType, byte* data, int len);
+void sendHello();
+void handleRadio();
 
 void setup() {
   Serial.begin(57600);
 
   Serial.println("pIoT example, acting as Actuator");
 
-  if (!startRadio(9, 10, 8, nodeAddress)) Serial.println("Cannot start radio");
+  if (!startRadio(9, 10, 8, nodeAddress, 2)) Serial.println("Cannot start radio"); //2 is the used IRQ pin
+  //a node identifier from the base makes packet headers shorter
+  requestNodeId(BASE_ADDR);
+  //switch messages may come directly or within the acks of the messages sent to the base
+  onMessage<switchMessage, handleSwitchMessage>();
+
+  //hello messages are sent now and every helloPeriod seconds
+  addTimer(0, helloPeriod * 1000UL, sendHello);
+  //incoming messages wake the node up through the IRQ pin
+  onRadioEvent(2, handleRadio);
+  setSchedulerSleep(sleep);
 }
 
-/** Handles incoming messages from the network.
- * Parses the switch messages, actuates
- * accordingly and sends a status message back for
+/** Handles incoming switch messages from the network.
+ * Actuates accordingly and sends a status message back for
  * confirmation.
  */
-void handleSwitchMessage(boolean broadcast, long sender, unsigned int msgType, byte* data, int len) {
-  if ((msgType == switchMsgType) &&
-      (len == sizeof(switchMessage))) {
-    Serial.print("Received a switch message, status: ");
-    switchMessage pkt = *((switchMessage*)data);
-    digitalWrite(5, pkt.on);
-    Serial.println(pkt.on);
-    if (!send(false, BASE_ADDR, switchMsgType, (byte*)&pkt, sizeof(switchMessage))) {
-      Serial.println("- Cannot send confirmation message");
-    }
-  } else {
-    Serial.println("Received something that I cannot interpret");
+void handleSwitchMessage(boolean broadcast, long sender, switchMessage& msg) {
+  Serial.print("Received a switch message, status: ");
+  digitalWrite(5, msg.on);
+  Serial.println(msg.on);
+  if (!sendMessage(false, BASE_ADDR, msg)) {
+    Serial.println("- Cannot send confirmation message");
   }
 }
 
-void loop() {
-  //The loop sends a Hello message every helloPeriod secs
-  //and waits for incoming switch messages
-
-  //seconds passed since start
-  unsigned long time = (millis() / 1000) + getTotalSleepSeconds();
-
-  if ((time - lastHelloSent) > helloPeriod) {
-    //Time to send a hello message
-    Serial.println("Sending hello");
-    helloMessage hm;
-    hm.internalTemp = getInternalTemperature();
-    hm.internalVcc = getInternalVcc();
-    hm.operationTime = time;
-    hm.sentMsgs = getSentCounter();
-    hm.unsentMsgs = getUnsentCounter();
-    hm.receivedMsgs = getReceivedCounter();
-    if (!send(false, BASE_ADDR, helloMsgType, (byte*) &hm, sizeof(helloMessage))) {
-      Serial.println("- Cannot send hello message");
-    }
-    lastHelloSent = time;
-  }
-
-  if (sleep) {
-    //leave the radio in receive mode before going to sleep
-    receive(0, handleSwitchMessage);
-
-    Serial.println("Going to sleep...");
-    delay(50); //this delay it's only for allowing the serial complete the message
-    
-    sleepUntil(helloPeriod, 1, 2); //2 is the used IRQ pin
+/** Called for messages whose type is not registered.
+ */
+void handleUnknownMessage(boolean broadcast, long sender, unsigned int msgType, byte* data, int len) {
+  Serial.println("Received something that I cannot interpret");
+}
 
-    //after the sleep a message may have just come, handle it
-    receive(0, handleSwitchMessage);
+/** Sends a Hello message and the charge used, called every helloPeriod secs.
+ */
+void sendHello() {
+  Serial.println("Sending hello");
+  helloMessage hm;
+  hm.internalTemp = getInternalTemperature();
+  hm.internalVcc = getInternalVcc();
+  hm.operationTime = schedulerMillis() / 1000;
+  hm.sentMsgs = getSentCounter();
+  hm.unsentMsgs = getUnsentCounter();
+  hm.receivedMsgs = getReceivedCounter();
+  if (!sendMessage(false, BASE_ADDR, hm)) {
+    Serial.println("- Cannot send hello message");
   }
-  else {
-    //just wait until a message comes or there's a timeout
-    receive(helloPeriod, handleSwitchMessage);
+  chargeMessage cm;
+  cm.charge = getEstimatedCharge();
+  if (!sendMessage(false, BASE_ADDR, cm)) {
+    Serial.println("- Cannot send charge message");
   }
 }
 
+/** Called when the radio has received something.
+ */
+void handleRadio() {
+  receive(0, handleUnknownMessage);
+}
 
+void loop() {
+  //The scheduler sends the hello messages and handles incoming switch messages,
+  //in between the node sleeps, if enabled, while the radio keeps receiving
+  runScheduler();
+}
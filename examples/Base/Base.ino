@@ -6,6 +6,8 @@
  * To send a message to the switch actuator try writing
  * { "SwitchSet": { "destAddress": 4321, "on": TRUE }}
  * on the serial monitor.
+ * With binarySerial set to true, the base exchanges binary frames
+ * (see pIoT_Binary.h) with the server instead of JSON.
  */
 #include <Arduino.h>
 #include <SPI.h>
@@ -13,48 +15,36 @@
 #include <pIoT_Energy.h>
 #include <pIoT_JSON.h>
 #include <pIoT_Protocol.h>
+#include <pIoT_Messages.h> //hello, light and switch messages
+#include <pIoT_Binary.h>
 
 
-/** Definition of a "hello message"
- * that contains internal values of the
- * node. Hello message is recommended to
- * be used on all nodes.
- */
-unsigned int helloMsgType = 1;
-struct helloMessage {
-  float internalTemp;
-  float internalVcc;
-  unsigned long operationTime;
-  unsigned long sentMsgs;
-  unsigned long unsentMsgs;
-  unsigned long receivedMsgs;
-};
-//Note: in total this message takes 24 bytes, almost the max supported by the library (26)
-
-/** Definition of the message that contains
- * the value of measured light intensity.
- */
-unsigned int lightMsgType = 100;
-struct lightMessage {
-  int intensity;
-};
+//Milliseconds after which an undelivered switch message is dropped
+unsigned long switchSetTTL = 60000;
 
-/** Definition of the message that contains
- * the information about the status of a switch.
- */
-unsigned int switchMsgType = 101;
-struct switchMessage {
-  boolean on;
-};
+//If true the serial port carries binary frames instead of JSON
+boolean binarySerial = false;
 
 
+void handleHello(boolean broadcast, long sender, helloMessage& hm);
+void printError(byte severity, PGM_P message, const char* detail);
+void handleBinaryMessage(boolean broadcast, long sender, unsigned int msgType, byte* data, int len);
+
 void setup() {
   Serial.begin(57600);
-  Serial.println("pIoT example, acting as Base");
+  if (!binarySerial) Serial.println("pIoT example, acting as Base");
 
-  if (!startRadio(9, 10, -1, BASE_ADDR)) {
-    Serial.println("{\"Error\": { \"severity\": 2, \"message\": \"Base cannot start radio\"}}");
+  //with the IRQ pin connected, packets are buffered while the serial is being read
+  if (!startRadio(9, 10, -1, BASE_ADDR, 2)) {
+    printError(2, PSTR("Base cannot start radio"), "");
   }
+  //in binary mode all the messages are forwarded by handleBinaryMessage()
+  if (binarySerial) return;
+  onMessage<helloMessage, handleHello>();
+  //charge, light and switch messages are simply forwarded as JSON
+  onMessageToJSON<chargeMessage>();
+  onMessageToJSON<lightMessage>();
+  onMessageToJSON<switchMessage>();
 }
 
 /** Function that manages json messages coming to the base from
@@ -66,76 +56,84 @@ void setup() {
 void handleJson(char* dataname, char* message) {
   if (strcasecmp(dataname, "SwitchSet") == 0) { //use strcasecmp to compare strings ignoring their cases
     Serial.print("Going to send a switch set command to ");
-    long address = JSONtoLong(message, "destAddress");
+    //the message is scanned once, then values are looked up in the index
+    JSONIndex index;
+    JSONindex(message, &index);
+    long address = JSONindexToLong(&index, "destAddress");
     Serial.print(address);
     switchMessage sm;
+    sm.on = false;
+    sm.parseJSON(&index);
     Serial.print(" on? ");
-    sm.on = JSONtoBoolean(message, "on");
     Serial.println(sm.on);
-    if (!send(false, address, switchMsgType, (byte*) &sm, sizeof(switchMessage))) {
-      Serial.print("{\"Error\": { \"severity\": 1, \"message\": \"Base cannot send switch message to ");
-      Serial.print(address);
-      Serial.println(" \"}}");
+    //the node may be sleeping, the message waits in the mailbox until the node is heard from
+    //a newer switch message for the same node replaces the old one
+    if (!postMessage(address, sm, switchSetTTL)) {
+      char num[12];
+      printError(1, PSTR("Base cannot post switch message to "), ltoa(address, num, 10));
     }
   } else {
-    Serial.println("{\"Error\": { \"severity\": 1, \"message\": \"Base Received a JSON messages with incomprehensible dataname ");
-    Serial.print(dataname);
-    Serial.println(" \"}}");
+    printError(1, PSTR("Base received a JSON message with incomprehensible dataname "), dataname);
   }
 }
 
-/** Function tht manages the messages coming from the other nodes.
- * Two types of messages are supported, light and switch.
- * The function parses the message and generates a corresponding JSON
- * and sends it to the server.
+/** Function that manages the hello messages coming from the other nodes.
+ * It sends the message as JSON to the server, charge, light and switch
+ * messages are sent as JSON by the library.
  */
-void handleMessage(boolean broadcast, long sender, unsigned int msgType, byte* data, int len) {
-  Serial.print("Received a mesage of type ");
-  Serial.print(msgType);
-  Serial.print(" from node ");
-  Serial.println(sender);
-  if ((msgType == helloMsgType) &&
-      (len == sizeof(helloMessage))) {
-    helloMessage hm = *((helloMessage*) data);
-    Serial.print("{ \"Hello\": { \"sourceAddress\":");
-    Serial.print(sender);
-    Serial.print(", \"temperature\":");
-    Serial.print(hm.internalTemp);
-    Serial.print(", \"vcc\":");
-    Serial.print(hm.internalVcc);
-    Serial.print(", \"operationTime\":");
-    Serial.print(hm.operationTime);
-    Serial.print(", \"sentMessages\":");
-    Serial.print(hm.sentMsgs);
-    Serial.print(", \"unsentMessages\":");
-    Serial.print(hm.unsentMsgs);
-    Serial.print(", \"receivedMessages\":");
-    Serial.print(hm.receivedMsgs);
-    Serial.println(" }}");
-  }
-  else if ((msgType == lightMsgType) &&
-           (len == sizeof(lightMessage))) {
-    lightMessage lm = *((lightMessage*) data);
-    Serial.print("{ \"LightState\": { \"sourceAddress\":");
-    Serial.print(sender);
-    Serial.print(", \"intensity\":");
-    Serial.print(lm.intensity);
-    Serial.println(" }}");
+void handleHello(boolean broadcast, long sender, helloMessage& hm) {
+  if (!hm.printJSON(Serial, sender)) {
+    printError(1, PSTR("Base cannot print hello message, too long"), "");
   }
-  else if ((msgType == switchMsgType) &&
-           (len == sizeof(switchMessage))) {
-    switchMessage sm = *((switchMessage*) data);
-    Serial.print("{ \"SwitchState\": { \"sourceAddress\":");
-    Serial.print(sender);
-    Serial.print(", \"on\":");
-    if(sm.on) Serial.print("TRUE"); else Serial.print("FALSE"); 
-    Serial.println(" }}");
+  //the node has just sent, it may be listening: give it its messages
+  flushMailbox(sender);
+}
 
-  } else {
-    Serial.println("{\"Error\": { \"severity\": 1, \"message\": \"Base cannot interpret message type ");
-    Serial.print(msgType);
-    Serial.println(" \"}}");
-  }
+/** Forwards messages from the nodes to the server as binary frames.
+ */
+void handleBinaryMessage(boolean broadcast, long sender, unsigned int msgType, byte* data, int len) {
+  byte flags = broadcast ? BINARY_FLAG_BROADCAST : 0;
+  //the average of the samples taken in the loop, reading the RPD here would block the gateway
+  if (nRF24.getCarrierLevel() >= 128) flags |= BINARY_FLAG_STRONG;
+  writeBinarySerial(sender, msgType, flags, data, len);
+  //the node has just sent, it may be listening: give it its messages
+  if (msgType == helloMessage::msgType) flushMailbox(sender);
+}
+
+/** Handles binary frames coming from the server.
+ * The payload is passed as it is to the destination node.
+ */
+void handleBinaryFrame(long address, unsigned int msgType, byte flags, byte* data, int len) {
+  if (flags & BINARY_FLAG_BROADCAST) send(true, BROADCAST_ADDR, msgType, data, len);
+  //messages too long for the mailbox are sent directly
+  else if (!postMessage(address, msgType, data, len, switchSetTTL)) send(false, address, msgType, data, len);
+}
+
+/** Sends an error to the server as JSON, with a single write.
+ * The text of the error is message followed by detail.
+ */
+void printError(byte severity, PGM_P message, const char* detail) {
+  char text[80];
+  strncpy_P(text, message, sizeof(text) - 1);
+  text[sizeof(text) - 1] = '\0';
+  strncat(text, detail, sizeof(text) - 1 - strlen(text));
+  char buf[JSON_WRITER_LEN];
+  JSONWriter writer;
+  JSONwriterInit(&writer, buf, sizeof(buf));
+  JSONwriteObjectStart(&writer, NULL);
+  JSONwriteObjectStart(&writer, PSTR("Error"));
+  JSONwriteLong(&writer, PSTR("severity"), severity);
+  JSONwriteString(&writer, PSTR("message"), text);
+  JSONwriteObjectEnd(&writer);
+  JSONwriteObjectEnd(&writer);
+  JSONwriteLine(&writer, Serial);
+}
+
+/** Called for messages whose type is not registered.
+ */
+void handleUnknown(boolean broadcast, long sender, unsigned int msgType, byte* data, int len) {
+  char num[12];
+  printError(1, PSTR("Base cannot interpret message type "), ultoa(msgType, num, 10));
 }
 
 
@@ -144,7 +142,13 @@ void loop() {
   //and receives data continuously
   //make sure to put no wait seconds, otherwise
   //data will be lost !
-  readSerial(0, handleJson);
-  receive(0, handleMessage);
+  if (binarySerial) {
+    readBinarySerial(0, handleBinaryFrame);
+    nRF24.sampleRPD();
+    receive(0, handleBinaryMessage);
+  } else {
+    readSerial(0, handleJson);
+    receive(0, handleUnknown);
+  }
 }
 
@@ -0,0 +1,248 @@
+/**
+ * Benchmark of the protocol stack.
+ * Two nodes are needed: a tester and an echo, comment the TESTER definition
+ * to act as echo. The tester runs a fixed sequence of scenarios and prints
+ * one CSV line per scenario, so that results can be collected from the serial
+ * port and compared over time:
+ * scenario,count,ok,packets_per_s,p50_us,p99_us,spi_per_packet,radio_on_us,lost
+ * - roundtrip: send() to the echo, which sends the message back, latency is the full round trip,
+ *   lost counts the messages acknowledged by the echo but not sent back, because it was busy
+ * - broadcast: send() in broadcast, latency is the time spent in send()
+ * - stream: sendAsync() back to back, latency is the time between two completions, taken
+ *   for each packet by the send callback (without the IRQ pin, packets completed in the same
+ *   poll get the same time), the echo only counts these messages
+ * radio_on_us is an estimate of the time on air of the packets and their acks.
+ * The formatting of the messages is measured on the host, see tests/host_bench.cpp.
+ * To measure the saturation of a base, load this sketch on more testers with
+ * different addresses: the echo prints the number of messages received per second.
+ * The sequence is repeated every RUN_INTERVAL_MS.
+ */
+#include <Arduino.h>
+#include <SPI.h>
+#include <nRF24.h>
+#include <pIoT_Protocol.h>
+
+//Comment this to act as echo
+#define TESTER
+
+//Addresses of the two nodes
+#define TESTER_ADDR 1001
+#define ECHO_ADDR 1000
+
+//Type of the messages sent back by the echo, and of those it only counts
+#define BENCH_MSG_TYPE 1000
+#define STREAM_MSG_TYPE 1001
+
+//Number of messages per scenario, also the number of latency samples kept
+#define BENCH_COUNT 64
+
+//Time between two runs
+#define RUN_INTERVAL_MS 10000
+
+//Length of the payload of the messages
+#define BENCH_LEN 8
+
+unsigned long samples[BENCH_COUNT];
+volatile unsigned int echoSeq;
+volatile boolean echoed;
+unsigned long received = 0;
+//replies of the echo that could not be sent
+unsigned long replyFailed = 0;
+
+void handleBench(boolean broadcast, long sender, unsigned int msgType, byte* data, int len);
+void handleStream(boolean broadcast, long sender, unsigned int msgType, byte* data, int len);
+
+void setup() {
+  Serial.begin(57600);
+#ifdef TESTER
+  if (!startRadio(9, 10, 8, TESTER_ADDR)) Serial.println("Cannot start radio");
+  Serial.println("pIoT benchmark, acting as tester");
+  Serial.println("scenario,count,ok,packets_per_s,p50_us,p99_us,spi_per_packet,radio_on_us,lost");
+#else
+  if (!startRadio(9, 10, 8, ECHO_ADDR)) Serial.println("Cannot start radio");
+  Serial.println("pIoT benchmark, acting as echo");
+#endif
+  onMessage(BENCH_MSG_TYPE, BENCH_LEN, handleBench);
+#ifndef TESTER
+  onMessage(STREAM_MSG_TYPE, BENCH_LEN, handleStream);
+#endif
+}
+
+/** Estimates the time on air of a packet, in microseconds.
+ * Preamble, 4 bytes address, 9 bits of packet control, payload and 2 bytes CRC.
+ */
+unsigned long airTime(int payloadLen) {
+  unsigned long bits = 8UL * (1 + 4 + payloadLen + 2) + 9;
+  switch (nRF24.getDatarate()) {
+    case NRF24::NRF24DataRate250kbps: return bits * 4;
+    case NRF24::NRF24DataRate1Mbps: return bits;
+    default: return bits / 2;
+  }
+}
+
+/** Sorts the samples, insertion sort is fine for few of them.
+ */
+void sortSamples(int n) {
+  for (int i = 1; i < n; i++) {
+    unsigned long v = samples[i];
+    int j = i - 1;
+    while ((j >= 0) && (samples[j] > v)) {
+      samples[j + 1] = samples[j];
+      j--;
+    }
+    samples[j + 1] = v;
+  }
+}
+
+/** Prints a line of results.
+ * @param scenario the name of the scenario
+ * @param ok the number of successful messages, whose latencies are in samples
+ * @param packets the number of packets sent and received
+ * @param elapsedUS the duration of the scenario
+ * @param spi the number of SPI transactions
+ * @param radioUS the estimated time on air
+ * @param lost the number of messages received by the echo and not sent back
+ */
+void report(const __FlashStringHelper* scenario, int ok, unsigned long packets, unsigned long elapsedUS,
+            unsigned long spi, unsigned long radioUS, int lost) {
+  sortSamples(ok);
+  Serial.print(scenario);
+  Serial.print(',');
+  Serial.print(BENCH_COUNT);
+  Serial.print(',');
+  Serial.print(ok);
+  Serial.print(',');
+  Serial.print(elapsedUS > 0 ? (packets * 1000000.0) / elapsedUS : 0);
+  Serial.print(',');
+  Serial.print(ok > 0 ? samples[ok / 2] : 0);
+  Serial.print(',');
+  Serial.print(ok > 0 ? samples[(ok * 99) / 100] : 0);
+  Serial.print(',');
+  Serial.print(packets > 0 ? (float)spi / packets : 0);
+  Serial.print(',');
+  Serial.print(radioUS);
+  Serial.print(',');
+  Serial.println(lost);
+}
+
+/** On the echo sends the message back, on the tester checks the sequence number.
+ * Late replies, of messages already given up, are ignored.
+ */
+void handleBench(boolean broadcast, long sender, unsigned int msgType, byte* data, int len) {
+#ifdef TESTER
+  if ((data[0] | (data[1] << 8)) == echoSeq) echoed = true;
+#else
+  received++;
+  if (!broadcast && !send(false, sender, BENCH_MSG_TYPE, data, len)) replyFailed++;
+#endif
+}
+
+/** On the echo counts the messages of the stream and of the broadcast scenarios.
+ */
+void handleStream(boolean broadcast, long sender, unsigned int msgType, byte* data, int len) {
+  received++;
+}
+
+#ifdef TESTER
+
+/** Receives what is left from the echo, so that it does not get in the way of the next scenario.
+ */
+void drainEcho() {
+  while (receive(20, NULL));
+}
+
+void benchRoundTrip() {
+  byte data[BENCH_LEN] = {0};
+  int ok = 0;
+  int lost = 0;
+  nRF24.resetSPICounter();
+  unsigned long start = micros();
+  for (unsigned int i = 0; i < BENCH_COUNT; i++) {
+    data[0] = i & 0xFF;
+    data[1] = (i >> 8) & 0xFF;
+    echoSeq = i;
+    echoed = false;
+    unsigned long t = micros();
+    if (!send(false, ECHO_ADDR, BENCH_MSG_TYPE, data, BENCH_LEN)) continue;
+    unsigned long waitStart = millis();
+    while (!echoed && (millis() - waitStart < 50))
+      receive(50, NULL);
+    if (echoed) samples[ok++] = micros() - t;
+    //acknowledged, so received, but not sent back: the echo was busy
+    else lost++;
+  }
+  unsigned long elapsed = micros() - start;
+  //each round trip is 2 packets, each with its ack
+  report(F("roundtrip"), ok, 2UL * ok, elapsed, nRF24.getSPICounter(),
+         2UL * ok * (airTime(6 + BENCH_LEN) + airTime(0)), lost);
+  drainEcho();
+}
+
+void benchBroadcast() {
+  byte data[BENCH_LEN] = {0};
+  int ok = 0;
+  nRF24.resetSPICounter();
+  unsigned long start = micros();
+  for (unsigned int i = 0; i < BENCH_COUNT; i++) {
+    unsigned long t = micros();
+    if (send(true, BROADCAST_ADDR, STREAM_MSG_TYPE, data, BENCH_LEN)) samples[ok++] = micros() - t;
+  }
+  unsigned long elapsed = micros() - start;
+  report(F("broadcast"), ok, ok, elapsed, nRF24.getSPICounter(), ok * airTime(6 + BENCH_LEN), 0);
+}
+
+//Completions of the stream scenario, counted by streamDone()
+volatile int streamOk;
+volatile unsigned long lastCompletion;
+
+/** Called on each completed transmission of the stream scenario,
+ * takes one sample per packet sent.
+ */
+void streamDone(boolean sent) {
+  unsigned long now = micros();
+  if (sent && (streamOk < BENCH_COUNT)) samples[streamOk++] = now - lastCompletion;
+  lastCompletion = now;
+}
+
+void benchStream() {
+  byte data[BENCH_LEN] = {0};
+  unsigned int queued = 0;
+  streamOk = 0;
+  nRF24.resetSPICounter();
+  unsigned long start = micros();
+  lastCompletion = start;
+  setSendCallback(streamDone);
+  while (queued < BENCH_COUNT) {
+    if (sendAsync(false, ECHO_ADDR, STREAM_MSG_TYPE, data, BENCH_LEN)) queued++;
+    pollSend();
+  }
+  while (pollSend() == NRF24::NRF24TxPending);
+  unsigned long elapsed = micros() - start;
+  setSendCallback(NULL);
+  int ok = streamOk;
+  report(F("stream"), ok, ok, elapsed, nRF24.getSPICounter(), ok * (airTime(6 + BENCH_LEN) + airTime(0)), 0);
+  drainEcho();
+}
+
+#endif
+
+void loop() {
+#ifdef TESTER
+  benchRoundTrip();
+  benchBroadcast();
+  benchStream();
+  delay(RUN_INTERVAL_MS);
+#else
+  unsigned long start = millis();
+  received = 0;
+  unsigned long elapsed;
+  while ((elapsed = millis() - start) < 1000) receive(1000 - elapsed, NULL);
+  if (received > 0) {
+    Serial.print("received/s,");
+    Serial.print(received);
+    Serial.print(",reply_failed,");
+    Serial.println(replyFailed);
+    replyFailed = 0;
+  }
+#endif
+}
@@ -9,6 +9,7 @@
 #include <nRF24.h>
 #include <pIoT_Energy.h>
 #include <pIoT_Protocol.h>
+#include <pIoT_Messages.h> //hello and light messages
 
 /** Address of this node.
  */
@@ -19,28 +20,10 @@ long nodeAddress = 1234;
  */
 int sleepTime = 5;
 
-/** Definition of a "hello message"
- * that contains internal values of the
- * node. Hello message is recommended to
- * be used on all nodes.
+/** The charge changes slowly, it is sent once every chargeCycles loops.
  */
-unsigned int helloMsgType = 1;
-struct helloMessage {
-  float internalTemp;
-  float internalVcc;
-  unsigned long operationTime;
-  unsigned long sentMsgs;
-  unsigned long unsentMsgs;
-  unsigned long receivedMsgs;
-};
-
-/** Definition of a message that contains
- * the value of measured light intensity.
- */
-unsigned int lightMsgType = 100;
-struct lightMessage {
-  int intensity;
-};
+int chargeCycles = 12;
+int cycle = 0;
 
 
 void setup() {
@@ -49,6 +32,8 @@ void setup() {
   Serial.println("pIoT example, acting as Sensor");
 
   if (!startRadio(9, 10, 8, nodeAddress)) Serial.println("Cannot start radio");
+  //a node identifier from the base makes packet headers shorter
+  requestNodeId(BASE_ADDR);
 }
 
 void loop() {
@@ -56,24 +41,43 @@ void loop() {
   //then reads an analog value and sends it as light
   //intensity in a light message, then goes to sleep for
   //a certain time
-  Serial.println("Sending hello");
+  //Messages are sent in a batch, so that they share packets when they fit:
+  //with the compact header hello and light fill exactly one packet
+  beginBatch(false, BASE_ADDR);
+
+  //The ADC is read for the light and Vcc first, the temperature last:
+  //its reference has been settling since the board woke up
+  int intensity = readAnalogOversampled(0);
   helloMessage hm;
-  hm.internalTemp = getInternalTemperature();
   hm.internalVcc = getInternalVcc();
   hm.operationTime = (millis() / 1000) + getTotalSleepSeconds();
   hm.sentMsgs = getSentCounter();
   hm.unsentMsgs = getUnsentCounter();
   hm.receivedMsgs = getReceivedCounter();
-  if (!send(false, BASE_ADDR, helloMsgType, (byte*) &hm, sizeof(helloMessage))) {
+  hm.internalTemp = getInternalTemperature();
+
+  Serial.println("Sending hello");
+  if (!addToBatch(hm)) {
     Serial.println("- Cannot send message");
   }
 
   Serial.print("Sending light intensity ");
-  int intensity = analogRead(0);
   Serial.println(intensity);
   lightMessage lm;
   lm.intensity = intensity;
-  if (!send(false, BASE_ADDR, lightMsgType, (byte*) &lm, sizeof(lightMessage))) {
+  if (!addToBatch(lm)) {
+    Serial.println("- Cannot send message");
+  }
+
+  if (cycle++ % chargeCycles == 0) {
+    Serial.println("Sending charge");
+    chargeMessage cm;
+    cm.charge = getEstimatedCharge();
+    if (!addToBatch(cm)) {
+      Serial.println("- Cannot send message");
+    }
+  }
+  if (!flushBatch()) {
     Serial.println("- Cannot send message");
   }
 
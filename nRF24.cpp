@@ -13,8 +13,7 @@
  * - adds reliability: almost every command is checked after being executed
  * - supports all pipes (not only 0 and 1)
  * - adds several functionalities that were missing in the original version
- * Still unsupported:
- * - acks with payload
+ * - supports acks with payload
  *
  * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
  */
@@ -25,19 +24,65 @@
 uint8_t NRF24::_chipEnablePin = 9;
 uint8_t NRF24::_chipSelectPin = 10;
 uint8_t NRF24::_powerPin = -1;
-uint8_t * NRF24::pipe0Address = NULL;
+uint8_t NRF24::_irqPin = NRF24_NO_PIN;
+uint8_t NRF24::pipe0Address[5];
+boolean NRF24::pipe0Stored = false;
+boolean NRF24::fastTurnaround = false;
 NRF24::NRF24PowerStatus NRF24::powerstatus = NRF24PowerDown;
-
-
-void NRF24::configure(uint8_t chipEnablePin, uint8_t chipSelectPin, uint8_t powerPin)
+unsigned long NRF24::stateTime[NRF24PowerUpTX + 1];
+unsigned int NRF24::stateMicros[NRF24PowerUpTX + 1];
+unsigned long NRF24::stateStartMillis = 0;
+unsigned long NRF24::stateStartMicros = 0;
+volatile unsigned long NRF24::txAttempts = 0;
+volatile uint8_t NRF24::lastRetries = 0;
+uint16_t NRF24::carrierLevel = 0;
+NRF24::NRF24RxRecord NRF24::rxRing[NRF24_RX_RING_LEN];
+volatile uint8_t NRF24::rxHead = 0;
+volatile uint8_t NRF24::rxTail = 0;
+volatile uint8_t NRF24::rxCount = 0;
+volatile unsigned long NRF24::rxOverflow = 0;
+NRF24::NRF24TxRecord NRF24::txQueue[NRF24_TX_FIFO_LEN];
+volatile uint8_t NRF24::txHead = 0;
+volatile uint8_t NRF24::txCount = 0;
+volatile NRF24::NRF24TxStatus NRF24::txStatus = NRF24TxIdle;
+unsigned long NRF24::txStart = 0;
+void (*NRF24::txCallback)(boolean sent) = NULL;
+boolean NRF24::shadowEnabled = false;
+uint16_t NRF24::shadowValid = 0;
+uint8_t NRF24::shadowRegs[NRF24_REG_06_RF_SETUP + 1];
+uint8_t NRF24::shadowTxAddress[5];
+uint8_t NRF24::shadowPipe0Address[5];
+volatile unsigned long NRF24::spiCounter = 0;
+boolean NRF24::ackPayloadEnabled = false;
+volatile uint8_t NRF24::ackPayloadsPending = 0;
+volatile unsigned long NRF24::ackPayloadsSent = 0;
+uint8_t NRF24::ackPayload[NRF24_MAX_MESSAGE_LEN];
+volatile uint8_t NRF24::ackPayloadLen = 0;
+volatile boolean NRF24::ackPayloadAvailable = false;
+
+//Bits of shadowValid used for the addresses, the others are the registers
+#define SHADOW_TX_ADDR 0x0100
+#define SHADOW_P0_ADDR 0x0200
+
+
+void NRF24::configure(uint8_t chipEnablePin, uint8_t chipSelectPin, uint8_t powerPin, uint8_t irqPin)
 {
     _chipEnablePin = chipEnablePin;
     _chipSelectPin = chipSelectPin;
     _powerPin = powerPin;
+    _irqPin = irqPin;
 
 	pinMode(_chipEnablePin, OUTPUT);
 	pinMode(_chipSelectPin, OUTPUT);
 
+    if(_irqPin != NRF24_NO_PIN){
+        pinMode(_irqPin, INPUT);
+        //The IRQ line is active low
+        //if the pin has no external interrupt, available() still checks the line before using SPI
+        if(digitalPinToInterrupt(_irqPin) != NOT_AN_INTERRUPT)
+            attachInterrupt(digitalPinToInterrupt(_irqPin), handleIRQ, FALLING);
+    }
+
 	pinMode(SCK, OUTPUT);
 	pinMode(MOSI, OUTPUT);
 
@@ -57,7 +102,7 @@ boolean NRF24::powerUpIdle(){
 		digitalWrite(_chipEnablePin, LOW);
 		digitalWrite(_chipSelectPin, HIGH);
 
-    if(_powerPin >=0){
+    if(_powerPin != NRF24_NO_PIN){
       digitalWrite(_powerPin, HIGH);
       delay(300);//additional delay for bringing up the chip
     }
@@ -67,19 +112,21 @@ boolean NRF24::powerUpIdle(){
 		SPI.begin();
 
 		//Enables dynamic payloads and dynamic acks always
-		spiWriteRegister(NRF24_REG_1D_FEATURE, NRF24_EN_DPL | NRF24_EN_DYN_ACK);
+		spiWriteRegister(NRF24_REG_1D_FEATURE, NRF24_EN_DPL | NRF24_EN_DYN_ACK | (ackPayloadEnabled ? NRF24_EN_ACK_PAY : 0));
 	}
 	//Clear interrupts here
     spiWriteRegister(NRF24_REG_07_STATUS, NRF24_RX_DR | NRF24_TX_DS | NRF24_MAX_RT);
 
-	uint8_t reg = spiReadRegister(NRF24_REG_00_CONFIG);
+	uint8_t reg = readRegister(NRF24_REG_00_CONFIG);
     reg = reg &  ~NRF24_PWR_UP; //set the power up bit to 0
-    spiWriteRegister(NRF24_REG_00_CONFIG, reg);
+    if(_irqPin != NRF24_NO_PIN) //received packets and completed transmissions are signalled on the IRQ line
+        reg = reg & ~(NRF24_MASK_RX_DR | NRF24_MASK_TX_DS | NRF24_MASK_MAX_RT);
+    writeRegister(NRF24_REG_00_CONFIG, reg);
 
-	if((spiReadRegister(NRF24_REG_00_CONFIG) & NRF24_PWR_UP) != 0)
+	if((readRegister(NRF24_REG_00_CONFIG) & NRF24_PWR_UP) != 0)
 		return false;
 
-	powerstatus = NRF24PowerUpIdle;
+	setPowerStatus(NRF24PowerUpIdle);
 	return true;
 }
 
@@ -87,114 +134,240 @@ boolean NRF24::powerDown()
 {
   if (powerstatus == NRF24PowerDown)
 	  return true;
-  uint8_t reg = spiReadRegister(NRF24_REG_00_CONFIG);
+  uint8_t reg = readRegister(NRF24_REG_00_CONFIG);
   reg = reg &  ~NRF24_PWR_UP; //set the power up bit to 0
-  spiWriteRegister(NRF24_REG_00_CONFIG, reg);
+  writeRegister(NRF24_REG_00_CONFIG, reg);
 
   digitalWrite(_chipEnablePin, LOW);
   digitalWrite(_chipSelectPin, LOW);
 
   SPI.end();
 
-  if(_powerPin >=0)
+  if(_powerPin != NRF24_NO_PIN){
     digitalWrite(_powerPin, LOW);
+    shadowValid = 0; //registers are lost
+    ackPayloadsPending = 0; //and so are the ack payloads in the TX FIFO
+  }
 
   digitalWrite(SCK, LOW);
   digitalWrite(MOSI, LOW);
 
-  powerstatus = NRF24PowerDown;
+  setPowerStatus(NRF24PowerDown);
   return true;
 }
 
 boolean NRF24::powerUpRx()
 {
 	if(powerstatus == NRF24PowerUpRX) return true;
+    //switching from TX the chip is already up, only PRIM_RX has to change
+    boolean fastSwitch = fastTurnaround && (powerstatus == NRF24PowerUpTX);
 	if(powerstatus == NRF24PowerDown) powerUpIdle();
 
-	uint8_t reg = spiReadRegister(NRF24_REG_00_CONFIG);
+    //packets still queued would be sent at the next switch to TX
+    abortTx();
+
+    digitalWrite(_chipEnablePin, LOW);
+	uint8_t reg = readRegister(NRF24_REG_00_CONFIG);
     reg = (reg | NRF24_PWR_UP) | NRF24_PRIM_RX;
-    spiWriteRegister(NRF24_REG_00_CONFIG, reg);
+    writeRegister(NRF24_REG_00_CONFIG, reg);
 
     //restore pipe 0 if any
-    if(pipe0Address != NULL)
-        if(!setPipeAddress(0, pipe0Address))
+    if(pipe0Stored)
+        if(!writePipeAddress(0, pipe0Address))
             return false;
-    //If coming from Tx or power down clean queues
-    flushTx();
-    flushRx();
+    if(!fastTurnaround)
+    {
+        //If coming from Tx or power down clean queues
+        flushTx();
+        flushRx();
+    }
 
     digitalWrite(_chipEnablePin, HIGH);
 
     //wait the radio to come up
-    delayMicroseconds(130);
+    if(!fastSwitch)
+        delayMicroseconds(130);
 
-	reg = spiReadRegister(NRF24_REG_00_CONFIG);
+	reg = readRegister(NRF24_REG_00_CONFIG);
     if(((reg & NRF24_PWR_UP) == 0) || ((reg & NRF24_PRIM_RX) == 0))
         return false;
 
-	powerstatus = NRF24PowerUpRX;
+	setPowerStatus(NRF24PowerUpRX);
     return true;
 }
 
 boolean NRF24::powerUpTx()
 {
 	if(powerstatus == NRF24PowerUpTX) return true;
+    //switching from RX the chip is already up and settles by itself before transmitting
+    boolean fastSwitch = fastTurnaround && (powerstatus == NRF24PowerUpRX);
 	if(powerstatus == NRF24PowerDown) powerUpIdle();
 
-	uint8_t reg = spiReadRegister(NRF24_REG_00_CONFIG);
+    digitalWrite(_chipEnablePin, LOW);
+	uint8_t reg = readRegister(NRF24_REG_00_CONFIG);
     reg = (reg | NRF24_PWR_UP) & ~NRF24_PRIM_RX;
-    spiWriteRegister(NRF24_REG_00_CONFIG, reg);
+    writeRegister(NRF24_REG_00_CONFIG, reg);
 
-    //If coming from Rx or power down clean queues
-    flushTx();
-    flushRx();
+    //ack payloads share the TX FIFO, they would be transmitted as normal packets
+    if(ackPayloadsPending > 0)
+    {
+        uint8_t sreg = SREG;
+        cli();
+        flushTx();
+        ackPayloadsPending = 0;
+        SREG = sreg;
+    }
+
+    if(!fastTurnaround)
+    {
+        //If coming from Rx or power down clean queues
+        flushTx();
+        flushRx();
+    }
+    else
+    {
+        //packets received are moved to the ring buffer, left in the chip they would
+        //be taken for ack payloads, those that do not fit are dropped
+        uint8_t sreg = SREG;
+        cli();
+        drainRx(0);
+        if(!(spiReadRegister(NRF24_REG_17_FIFO_STATUS) & NRF24_RX_EMPTY))
+        {
+            flushRx();
+            spiWriteRegister(NRF24_REG_07_STATUS, NRF24_RX_DR);
+            rxOverflow++;
+        }
+        SREG = sreg;
+    }
 
     digitalWrite(_chipEnablePin, HIGH);
     //wait the radio to come up
-    delayMicroseconds(130);
+    if(!fastSwitch)
+        delayMicroseconds(130);
 
-	reg = spiReadRegister(NRF24_REG_00_CONFIG);
+	reg = readRegister(NRF24_REG_00_CONFIG);
     if(((reg & NRF24_PWR_UP) == 0) || ((reg & NRF24_PRIM_RX) != 0))
         return true;//already in TX
 
-	powerstatus = NRF24PowerUpTX;
+	setPowerStatus(NRF24PowerUpTX);
     return true;
 }
 
+void NRF24::accountStateTime()
+{
+    unsigned long nowMillis = millis();
+    unsigned long nowMicros = micros();
+    //micros() overflows after about 70 minutes, long periods are measured in milliseconds
+    if(nowMillis - stateStartMillis > 1000)
+        stateTime[powerstatus] += nowMillis - stateStartMillis;
+    else
+    {
+        unsigned long us = stateMicros[powerstatus] + (nowMicros - stateStartMicros);
+        stateTime[powerstatus] += us / 1000;
+        stateMicros[powerstatus] = us % 1000;
+    }
+    stateStartMillis = nowMillis;
+    stateStartMicros = nowMicros;
+}
+
+void NRF24::setPowerStatus(NRF24PowerStatus status)
+{
+    accountStateTime();
+    powerstatus = status;
+}
+
+unsigned long NRF24::getStateTime(NRF24PowerStatus status)
+{
+    accountStateTime();
+    return stateTime[status];
+}
+
+uint8_t NRF24::getLastRetries()
+{
+    return lastRetries;
+}
+
+unsigned long NRF24::getTxAttempts()
+{
+    uint8_t sreg = SREG;
+    cli();
+    unsigned long attempts = txAttempts;
+    SREG = sreg;
+    return attempts;
+}
+
+void NRF24::resetEnergyCounters()
+{
+    accountStateTime();
+    uint8_t sreg = SREG;
+    cli();
+    for(uint8_t i = 0; i <= NRF24PowerUpTX; i++)
+    {
+        stateTime[i] = 0;
+        stateMicros[i] = 0;
+    }
+    txAttempts = 0;
+    SREG = sreg;
+}
+
+void NRF24::setFastTurnaround(boolean enable)
+{
+    fastTurnaround = enable;
+    if(enable && !shadowEnabled)
+        setShadowRegisters(true);
+}
+
 NRF24::NRF24PowerStatus NRF24::getPowerStatus() {
     return powerstatus;
 }
 
 // Low level commands for interfacing with the device
+// Interrupts are masked during each transaction so that handleIRQ() cannot interleave its own,
+// the transaction counter is updated in the same critical section
 uint8_t NRF24::spiCommand(uint8_t command)
 {
+    uint8_t sreg = SREG;
+    cli();
+    spiCounter++;
     digitalWrite(_chipSelectPin, LOW);
     uint8_t status = SPI.transfer(command);
     digitalWrite(_chipSelectPin, HIGH);
+    SREG = sreg;
     return status;
 }
 
 // Read and write commands
 uint8_t NRF24::spiRead(uint8_t command)
 {
+    uint8_t sreg = SREG;
+    cli();
+    spiCounter++;
     digitalWrite(_chipSelectPin, LOW);
     SPI.transfer(command); // Send the address, discard status
     uint8_t val = SPI.transfer(0); // The MOSI value is ignored, value is read
     digitalWrite(_chipSelectPin, HIGH);
+    SREG = sreg;
     return val;
 }
 
 uint8_t NRF24::spiWrite(uint8_t command, uint8_t val)
 {
+    uint8_t sreg = SREG;
+    cli();
+    spiCounter++;
     digitalWrite(_chipSelectPin, LOW);
     uint8_t status = SPI.transfer(command);
     SPI.transfer(val); // New register value follows
     digitalWrite(_chipSelectPin, HIGH);
+    SREG = sreg;
     return status;
 }
 
 void NRF24::spiBurstRead(uint8_t command, uint8_t* dest, uint8_t len)
 {
+    uint8_t sreg = SREG;
+    cli();
+    spiCounter++;
     digitalWrite(_chipSelectPin, LOW);
     SPI.transfer(command); // Send the start address, discard status
     while (len--)
@@ -202,16 +375,21 @@ void NRF24::spiBurstRead(uint8_t command, uint8_t* dest, uint8_t len)
         *dest++ = SPI.transfer(0); // The MOSI value is ignored, value is read
     }
     digitalWrite(_chipSelectPin, HIGH);
+    SREG = sreg;
     // 300 microsecs for 32 octet payload
 }
 
 uint8_t NRF24::spiBurstWrite(uint8_t command, uint8_t* src, uint8_t len)
 {
+    uint8_t sreg = SREG;
+    cli();
+    spiCounter++;
     digitalWrite(_chipSelectPin, LOW);
     uint8_t status = SPI.transfer(command);
     while (len--)
         SPI.transfer(*src++);
     digitalWrite(_chipSelectPin, HIGH);
+    SREG = sreg;
     return status;
 }
 
@@ -236,6 +414,94 @@ uint8_t NRF24::spiBurstWriteRegister(uint8_t reg, uint8_t* src, uint8_t len)
     return spiBurstWrite((reg & NRF24_REGISTER_MASK) | NRF24_COMMAND_W_REGISTER, src, len);
 }
 
+uint8_t NRF24::readRegister(uint8_t reg)
+{
+    if(!shadowEnabled || (reg > NRF24_REG_06_RF_SETUP))
+        return spiReadRegister(reg);
+    if(!(shadowValid & (1 << reg)))
+    {
+        shadowRegs[reg] = spiReadRegister(reg);
+        shadowValid |= (1 << reg);
+    }
+    return shadowRegs[reg];
+}
+
+void NRF24::writeRegister(uint8_t reg, uint8_t val)
+{
+    if(!shadowEnabled || (reg > NRF24_REG_06_RF_SETUP))
+    {
+        spiWriteRegister(reg, val);
+        return;
+    }
+    if((shadowValid & (1 << reg)) && (shadowRegs[reg] == val))
+        return;
+    spiWriteRegister(reg, val);
+    shadowRegs[reg] = val;
+    shadowValid |= (1 << reg);
+}
+
+void NRF24::setShadowRegisters(boolean enable)
+{
+    shadowEnabled = enable;
+    if(enable)
+        resyncRegisters();
+}
+
+void NRF24::resyncRegisters()
+{
+    shadowValid = 0;
+    if(!shadowEnabled || (powerstatus == NRF24PowerDown))
+        return; //will be loaded at first use
+    for(uint8_t reg = 0; reg <= NRF24_REG_06_RF_SETUP; reg++)
+        readRegister(reg);
+    uint8_t addr[5];
+    getTransmitAddress(addr);
+    getPipeAddress(0, addr);
+}
+
+boolean NRF24::verifyRegisters()
+{
+    if(!shadowEnabled)
+        return true;
+    for(uint8_t reg = 0; reg <= NRF24_REG_06_RF_SETUP; reg++)
+    {
+        if((shadowValid & (1 << reg)) && (spiReadRegister(reg) != shadowRegs[reg]))
+            return false;
+    }
+    uint8_t len = getAddressSize() + 2;
+    uint8_t addr[5];
+    if(shadowValid & SHADOW_TX_ADDR)
+    {
+        spiBurstReadRegister(NRF24_REG_10_TX_ADDR, addr, len);
+        if(!areAddressesEquals(addr, shadowTxAddress, len))
+            return false;
+    }
+    if(shadowValid & SHADOW_P0_ADDR)
+    {
+        spiBurstReadRegister(NRF24_REG_0A_RX_ADDR_P0, addr, len);
+        if(!areAddressesEquals(addr, shadowPipe0Address, len))
+            return false;
+    }
+    return true;
+}
+
+unsigned long NRF24::getSPICounter()
+{
+    uint8_t sreg = SREG;
+    cli();
+    unsigned long counter = spiCounter;
+    SREG = sreg;
+    return counter;
+}
+
+void NRF24::resetSPICounter()
+{
+    uint8_t sreg = SREG;
+    cli();
+    spiCounter = 0;
+    SREG = sreg;
+}
+
 uint8_t NRF24::statusRead()
 {
     return spiReadRegister(NRF24_REG_07_STATUS);
@@ -254,14 +520,14 @@ uint8_t NRF24::flushRx()
 
 boolean NRF24::setChannel(uint8_t channel)
 {
-    spiWriteRegister(NRF24_REG_05_RF_CH, channel & NRF24_RF_CH);
+    writeRegister(NRF24_REG_05_RF_CH, channel & NRF24_RF_CH);
     uint8_t actch = getChannel();
     return (actch == channel);
 }
 
 uint8_t NRF24::getChannel()
 {
-    uint8_t reg = spiReadRegister(NRF24_REG_05_RF_CH);
+    uint8_t reg = readRegister(NRF24_REG_05_RF_CH);
     return reg;
 }
 
@@ -288,9 +554,24 @@ uint8_t NRF24::getRSSI()
     return rssi;
 }
 
+boolean NRF24::sampleRPD()
+{
+    if(powerstatus != NRF24PowerUpRX)
+        return false;
+    uint16_t sample = (spiReadRegister(NRF24_REG_09_RPD) > 0) ? 0xFF00 : 0;
+    //moving average with weight 1/16
+    carrierLevel = carrierLevel - (carrierLevel >> 4) + (sample >> 4);
+    return true;
+}
+
+uint8_t NRF24::getCarrierLevel()
+{
+    return carrierLevel >> 8;
+}
+
 NRF24::NRF24CRC NRF24::getCRC()
 {
-    uint8_t reg = spiReadRegister(0);
+    uint8_t reg = readRegister(0);
     if((reg & NRF24_EN_CRC) == 0)
         return NRF24CRCNO;
     else
@@ -303,7 +584,7 @@ NRF24::NRF24CRC NRF24::getCRC()
 
 boolean NRF24::setCRC(NRF24CRC crc)
 {
-    uint8_t reg = spiReadRegister(0);
+    uint8_t reg = readRegister(0);
     if(crc == NRF24CRCNO)
     {
         reg = reg & ~NRF24_EN_CRC;
@@ -316,7 +597,7 @@ boolean NRF24::setCRC(NRF24CRC crc)
     {
         reg = reg | NRF24_EN_CRC | NRF24_CRCO;
     }
-    spiWriteRegister(NRF24_REG_00_CONFIG, reg);
+    writeRegister(NRF24_REG_00_CONFIG, reg);
     NRF24CRC actcrc = getCRC();
     if(actcrc == crc) return true;
     else return false;
@@ -324,7 +605,7 @@ boolean NRF24::setCRC(NRF24CRC crc)
 
 boolean NRF24::setTXRetries(uint8_t delay, uint8_t count)
 {
-    spiWriteRegister(NRF24_REG_04_SETUP_RETR, ((delay << 4) & NRF24_ARD) | (count & NRF24_ARC));
+    writeRegister(NRF24_REG_04_SETUP_RETR, ((delay << 4) & NRF24_ARD) | (count & NRF24_ARC));
     return true;
 }
 
@@ -334,7 +615,8 @@ boolean NRF24::setAddressSize(NRF24AddressSize size)
             && (size != NRF24AddressSize4Bytes)
             && (size != NRF24AddressSize5Bytes))
         return false;
-    spiWriteRegister(NRF24_REG_03_SETUP_AW, size);
+    writeRegister(NRF24_REG_03_SETUP_AW, size);
+    shadowValid &= ~(SHADOW_TX_ADDR | SHADOW_P0_ADDR); //the addresses change length
     delay(100); //just in case..
     NRF24AddressSize actsize = getAddressSize();
     if(size != actsize)
@@ -344,7 +626,7 @@ boolean NRF24::setAddressSize(NRF24AddressSize size)
 
 NRF24::NRF24AddressSize NRF24::getAddressSize()
 {
-    uint8_t reg = spiReadRegister(3);
+    uint8_t reg = readRegister(3);
     reg = (reg & NRF24_AW);
     if(reg == 1)
         return NRF24AddressSize3Bytes;
@@ -368,7 +650,14 @@ boolean NRF24::areAddressesEquals(uint8_t *addr1, uint8_t* addr2, uint8_t len)
 boolean NRF24::setTransmitAddress(uint8_t* address)
 {
     int len = getAddressSize()+2;
+    if(shadowEnabled && (shadowValid & SHADOW_TX_ADDR) && areAddressesEquals(address, shadowTxAddress, len))
+        return true;
     spiBurstWriteRegister(NRF24_REG_10_TX_ADDR, address, len);
+    if(shadowEnabled)
+    {
+        memcpy(shadowTxAddress, address, len);
+        shadowValid |= SHADOW_TX_ADDR;
+    }
     uint8_t actadd[len];
     if(!getTransmitAddress(actadd))
         return false;
@@ -378,6 +667,16 @@ boolean NRF24::setTransmitAddress(uint8_t* address)
 boolean NRF24::getTransmitAddress(uint8_t * address)
 {
     int len = getAddressSize()+2;
+    if(shadowEnabled)
+    {
+        if(!(shadowValid & SHADOW_TX_ADDR))
+        {
+            spiBurstReadRegister(NRF24_REG_10_TX_ADDR, shadowTxAddress, len);
+            shadowValid |= SHADOW_TX_ADDR;
+        }
+        memcpy(address, shadowTxAddress, len);
+        return true;
+    }
     spiBurstReadRegister(NRF24_REG_10_TX_ADDR, address, len);
     return true;
 }
@@ -385,9 +684,32 @@ boolean NRF24::getTransmitAddress(uint8_t * address)
 boolean NRF24::setPipeAddress(uint8_t pipe, uint8_t* address)
 {
     if(pipe == 0)
-        pipe0Address = 0;
+    {
+        //pipe 0 is overwritten by acked transmissions, keep it for powerUpRx()
+        memcpy(pipe0Address, address, getAddressSize()+2);
+        pipe0Stored = true;
+    }
+    return writePipeAddress(pipe, address);
+}
+
+boolean NRF24::writePipeAddress(uint8_t pipe, uint8_t* address)
+{
     int len = getAddressSize()+2;
-    //TODO: only send first byte for byte 1,2,3,4,5, or maybe it works anyway?
+    if((pipe == 0) && shadowEnabled)
+    {
+        if((shadowValid & SHADOW_P0_ADDR) && areAddressesEquals(address, shadowPipe0Address, len))
+            return true;
+        memcpy(shadowPipe0Address, address, len);
+        shadowValid |= SHADOW_P0_ADDR;
+    }
+    if(pipe > 5)
+        return false;
+    if(pipe >= 2)
+    {
+        //pipes 2 to 5 only have their least significant byte, the others are those of pipe 1
+        spiWriteRegister(NRF24_REG_0A_RX_ADDR_P0 + pipe, address[0]);
+        return spiReadRegister(NRF24_REG_0A_RX_ADDR_P0 + pipe) == address[0];
+    }
     spiBurstWriteRegister(NRF24_REG_0A_RX_ADDR_P0 + pipe, address, len);
     uint8_t curraddr[len];
     if(!getPipeAddress(pipe, curraddr))
@@ -398,6 +720,16 @@ boolean NRF24::setPipeAddress(uint8_t pipe, uint8_t* address)
 boolean NRF24::getPipeAddress(uint8_t pipe, uint8_t * address)
 {
     uint8_t len = getAddressSize()+2;
+    if((pipe == 0) && shadowEnabled)
+    {
+        if(!(shadowValid & SHADOW_P0_ADDR))
+        {
+            spiBurstReadRegister(NRF24_REG_0A_RX_ADDR_P0, shadowPipe0Address, len);
+            shadowValid |= SHADOW_P0_ADDR;
+        }
+        memcpy(address, shadowPipe0Address, len);
+        return true;
+    }
     if((pipe == 0) || (pipe == 1))
     {
         spiBurstReadRegister(NRF24_REG_0A_RX_ADDR_P0 + pipe, address, len);
@@ -407,9 +739,8 @@ boolean NRF24::getPipeAddress(uint8_t pipe, uint8_t * address)
     {
         if(!getPipeAddress(1, address)) //Get base address
             return false;
-        uint8_t lastbyte[1];
-        spiBurstReadRegister(NRF24_REG_0A_RX_ADDR_P0 + pipe, lastbyte, 1);
-        address[len-1] = lastbyte[0];
+        //the least significant byte is the first one
+        address[0] = spiReadRegister(NRF24_REG_0A_RX_ADDR_P0 + pipe);
         return true;
     }
     else return false;
@@ -417,41 +748,41 @@ boolean NRF24::getPipeAddress(uint8_t pipe, uint8_t * address)
 
 boolean NRF24::enablePipe(uint8_t pipe)
 {
-    uint8_t reg = spiReadRegister(NRF24_REG_02_EN_RXADDR);
-    reg = reg | (NRF24_ERX_P0 + pipe);
-    spiWriteRegister(NRF24_REG_02_EN_RXADDR, reg);
+    uint8_t reg = readRegister(NRF24_REG_02_EN_RXADDR);
+    reg = reg | (NRF24_ERX_P0 << pipe);
+    writeRegister(NRF24_REG_02_EN_RXADDR, reg);
     return isPipeEnabled(pipe);
 }
 
 
 boolean NRF24::isPipeEnabled(uint8_t pipe)
 {
-    uint8_t reg = spiReadRegister(NRF24_REG_02_EN_RXADDR);
-    return !((reg & (NRF24_ERX_P0 + pipe)) ==0);
+    uint8_t reg = readRegister(NRF24_REG_02_EN_RXADDR);
+    return !((reg & (NRF24_ERX_P0 << pipe)) ==0);
 }
 
 
 boolean NRF24::setAutoAck(uint8_t pipe, boolean autoack)
 {
-    uint8_t reg = spiReadRegister(NRF24_REG_01_EN_AA);
+    uint8_t reg = readRegister(NRF24_REG_01_EN_AA);
     if(autoack)
     {
-        reg = reg | NRF24_ENAA_P0 + pipe;
-        spiWriteRegister(NRF24_REG_01_EN_AA, reg);
+        reg = reg | (NRF24_ENAA_P0 << pipe);
+        writeRegister(NRF24_REG_01_EN_AA, reg);
         return isAutoAckEnabled(pipe);
     }
     else
     {
-        reg = reg & ~(NRF24_ENAA_P0 + pipe);
-        spiWriteRegister(NRF24_REG_01_EN_AA, reg);
+        reg = reg & ~(NRF24_ENAA_P0 << pipe);
+        writeRegister(NRF24_REG_01_EN_AA, reg);
         return !isAutoAckEnabled(pipe);
     }
 }
 
 boolean NRF24::isAutoAckEnabled(uint8_t pipe)
 {
-    uint8_t reg = spiReadRegister(NRF24_REG_01_EN_AA);
-    return !((reg & (NRF24_ENAA_P0 + pipe)) ==0);
+    uint8_t reg = readRegister(NRF24_REG_01_EN_AA);
+    return !((reg & (NRF24_ENAA_P0 << pipe)) ==0);
 }
 
 boolean NRF24::setPayloadSize(uint8_t pipe, uint8_t size)
@@ -499,7 +830,7 @@ boolean NRF24::setRF(NRF24DataRate data_rate, NRF24TransmitPower power)
     else if (data_rate == NRF24DataRate2Mbps)
         value |= NRF24_RF_DR_HIGH;
     // else NRF24DataRate1Mbps, 00
-    spiWriteRegister(NRF24_REG_06_RF_SETUP, value);
+    writeRegister(NRF24_REG_06_RF_SETUP, value);
     NRF24DataRate actrate = getDatarate();
     NRF24TransmitPower actpow = getTransmitPower();
     if((data_rate == actrate) && (power == actpow))
@@ -509,7 +840,7 @@ boolean NRF24::setRF(NRF24DataRate data_rate, NRF24TransmitPower power)
 
 NRF24::NRF24DataRate NRF24::getDatarate()
 {
-    uint8_t reg = spiReadRegister(6);
+    uint8_t reg = readRegister(6);
     boolean drl = (reg & NRF24_RF_DR_LOW) != 0;
     boolean drh = (reg & NRF24_RF_DR_HIGH) != 0;
     if(drl && !drh)
@@ -522,7 +853,7 @@ NRF24::NRF24DataRate NRF24::getDatarate()
 
 NRF24::NRF24TransmitPower NRF24::getTransmitPower()
 {
-    uint8_t reg = spiReadRegister(6);
+    uint8_t reg = readRegister(6);
     reg = (reg & NRF24_PWR)>>1;
     if(reg == 0)
         return NRF24TransmitPowerm18dBm;
@@ -536,7 +867,7 @@ NRF24::NRF24TransmitPower NRF24::getTransmitPower()
 
 boolean NRF24::setIRQMask(boolean mask_RX, boolean mask_TX, boolean mask_MAX_RT){
 
-	uint8_t reg = spiReadRegister(0);
+	uint8_t reg = readRegister(0);
     if(mask_RX) {
 		reg = reg | NRF24_MASK_RX_DR;
     } else {
@@ -555,7 +886,7 @@ boolean NRF24::setIRQMask(boolean mask_RX, boolean mask_TX, boolean mask_MAX_RT)
         reg = reg & ~NRF24_MASK_MAX_RT;
     }
 
-    spiWriteRegister(NRF24_REG_00_CONFIG, reg);
+    writeRegister(NRF24_REG_00_CONFIG, reg);
 
 	return (getIRQMaskRX() == mask_RX) &&
 		(getIRQMaskTX() == mask_TX) &&
@@ -563,71 +894,221 @@ boolean NRF24::setIRQMask(boolean mask_RX, boolean mask_TX, boolean mask_MAX_RT)
 }
 
 boolean NRF24::getIRQMaskRX(){
-	uint8_t reg = spiReadRegister(0);
+	uint8_t reg = readRegister(0);
 	return ((reg & NRF24_MASK_RX_DR) != 0);
 }
 
 boolean NRF24::getIRQMaskTX(){
-	uint8_t reg = spiReadRegister(0);
+	uint8_t reg = readRegister(0);
 	return ((reg & NRF24_MASK_TX_DS) != 0);
 }
 
 boolean NRF24::getIRQMaskRT(){
-	uint8_t reg = spiReadRegister(0);
+	uint8_t reg = readRegister(0);
 	return ((reg & NRF24_MASK_MAX_RT) != 0);
 }
 
 boolean NRF24::send(uint8_t* data, uint8_t len, boolean noack)
 {
+    if(!sendAsync(data, len, noack))
+        return false;
+
+    //Radio will return to Standby II mode after transmission is complete
+    //Wait for either the Data Sent or Max ReTries flag, signalling the
+    //end of transmission
+    NRF24TxStatus status;
+    while ((status = pollTx()) == NRF24TxPending)
+        ;
+    return status == NRF24TxSent;
+}
+
+boolean NRF24::sendAsync(uint8_t* data, uint8_t len, boolean noack)
+{
+    if((pollTx() == NRF24TxPending) && (txCount == getTxQueueCapacity()))
+        return false;
+
     powerUpTx(); //set to transmit mode
 
-	if(! noack)  //if ack is set
+	if(! noack && (txCount == 0))  //if ack is set
     {
         //Set both TX_ADDR and RX_ADDR_P0 for auto-ack with Enhanced ShockBurst:
         //From manual:
         //Set RX_ADDR_P0 equal to this address to handle
         //automatic acknowledge if this is a PTX device with
         //Enhanced ShockBurst enabled
-        int len = getAddressSize();
+        //powerUpRx() restores the address set by the user
+        int len = getAddressSize() + 2;
         byte addr[len];
         if(getTransmitAddress(addr))
-			setPipeAddress(0, addr);
+			writePipeAddress(0, addr);
     }
 
+    //keep a copy, in case a packet before this one fails
+    NRF24TxRecord* rec = &txQueue[(txHead + txCount) % NRF24_TX_FIFO_LEN];
+    rec->noack = noack;
+    rec->len = len;
+    memcpy(rec->data, data, len);
+
+    uint8_t sreg = SREG;
+    cli();
+    if(txCount == 0)
+        txStart = millis();
     spiBurstWrite(noack ? NRF24_COMMAND_W_TX_PAYLOAD_NOACK : NRF24_COMMAND_W_TX_PAYLOAD, data, len);//send data
+    txCount++;
+    SREG = sreg;
     //signal send
     //digitalWrite(_chipEnablePin, LOW);
     //delayMicroseconds(10);
     //digitalWrite(_chipEnablePin, HIGH);
+    return true;
+}
 
-    //Radio will return to Standby II mode after transmission is complete
-    //Wait for either the Data Sent or Max ReTries flag, signalling the
-    //end of transmission
-    uint8_t status;
-    unsigned long starttime = millis();
-    while (((millis() - starttime) < 2000) && //times out after 2 seconds
-            !((status = statusRead()) & (NRF24_TX_DS | NRF24_MAX_RT)))
-        ;
+NRF24::NRF24TxStatus NRF24::pollTx()
+{
+    if(txCount == 0)
+        return txStatus;
 
-    // Must clear NRF24_MAX_RT if it is set, else no further comm
-    spiWriteRegister(NRF24_REG_07_STATUS, status | ~NRF24_TX_DS | ~NRF24_MAX_RT);
-    if (status & NRF24_MAX_RT)
+    if(_irqPin != NRF24_NO_PIN)
     {
+        //in case the edge was missed
+        if(digitalRead(_irqPin) == LOW)
+            handleIRQ();
+    }
+    else
+    {
+        uint8_t status = statusRead();
+        //the ack payload is read first, so that it is there when the transmission is notified
+        if(ackPayloadEnabled && (status & NRF24_RX_DR))
+            drainRx(status);
+        if(status & (NRF24_TX_DS | NRF24_MAX_RT))
+            completeTx(status);
+    }
+    if((txCount > 0) && ((millis() - txStart) >= 2000)) //times out after 2 seconds
+        abortTx(); //the chip is not transmitting at all, give up with all the queue
+    return (txCount > 0) ? NRF24TxPending : txStatus;
+}
+
+void NRF24::abortTx()
+{
+    if(txCount == 0)
+        return;
+    uint8_t sreg = SREG;
+    cli();
+    flushTx();
+    spiWriteRegister(NRF24_REG_07_STATUS, NRF24_TX_DS | NRF24_MAX_RT);
+    while(txCount > 0)
+        popTx(false);
+    SREG = sreg;
+}
+
+uint8_t NRF24::getTxQueueLength()
+{
+    return txCount;
+}
+
+uint8_t NRF24::getTxQueueCapacity()
+{
+    //the chip only tells if its FIFO is empty or full, without the IRQ pin more packets
+    //may be sent between two polls and with three queued the count would be ambiguous
+    return (_irqPin == NRF24_NO_PIN) ? NRF24_TX_FIFO_LEN - 1 : NRF24_TX_FIFO_LEN;
+}
+
+void NRF24::setTxCallback(void (*f)(boolean sent))
+{
+    txCallback = f;
+}
+
+void NRF24::popTx(boolean sent)
+{
+    txHead = (txHead + 1) % NRF24_TX_FIFO_LEN;
+    txCount--;
+    txStart = millis();
+    txStatus = sent ? NRF24TxSent : NRF24TxFailed;
+    if(txCallback != NULL)
+        txCallback(sent);
+}
+
+void NRF24::completeTx(uint8_t status)
+{
+    if(txCount == 0)
+    {
+        //when receiving, TX_DS signals that an ack payload has been sent
+        spiWriteRegister(NRF24_REG_07_STATUS, NRF24_TX_DS | NRF24_MAX_RT);
+        if((status & NRF24_TX_DS) && (ackPayloadsPending > 0))
+        {
+            ackPayloadsPending--;
+            ackPayloadsSent++;
+        }
+        return;
+    }
+    if(status & NRF24_TX_DS)
+    {
+        //The packets sent are those queued minus those still in the FIFO.
+        //The flag is cleared again if a packet leaves while the FIFO is read,
+        //so that the next TX_DS always means that at least one more packet has been sent
+        uint8_t fifo;
+        do
+        {
+            spiWriteRegister(NRF24_REG_07_STATUS, NRF24_TX_DS);
+            fifo = spiReadRegister(NRF24_REG_17_FIFO_STATUS);
+        } while(statusRead() & NRF24_TX_DS);
+        uint8_t done = txCount - txFifoLeft(fifo);
+        //retransmissions of the last packet, the others are assumed alike
+        lastRetries = spiReadRegister(NRF24_REG_08_OBSERVE_TX) & NRF24_ARC_CNT;
+        txAttempts += (uint16_t)done * (1 + lastRetries);
+        while((done-- > 0) && (txCount > 0))
+            popTx(true);
+    }
+    if((status & NRF24_MAX_RT) && (txCount > 0))
+    {
+        //The failed packet is on top of the FIFO, there is no command to
+        //remove it alone, so the FIFO is flushed and the following packets reloaded
+        lastRetries = spiReadRegister(NRF24_REG_08_OBSERVE_TX) & NRF24_ARC_CNT;
+        txAttempts += 1 + lastRetries;
         flushTx();
-        return false;
+        // Must clear NRF24_MAX_RT if it is set, else no further comm
+        spiWriteRegister(NRF24_REG_07_STATUS, NRF24_MAX_RT);
+        popTx(false);
+        for(uint8_t i = 0; i < txCount; i++)
+        {
+            NRF24TxRecord* rec = &txQueue[(txHead + i) % NRF24_TX_FIFO_LEN];
+            spiBurstWrite(rec->noack ? NRF24_COMMAND_W_TX_PAYLOAD_NOACK : NRF24_COMMAND_W_TX_PAYLOAD, rec->data, rec->len);
+        }
     }
+}
 
-    // Return true if data sent
-    return (status & NRF24_TX_DS)!=0;
+uint8_t NRF24::txFifoLeft(uint8_t fifo)
+{
+    if(fifo & NRF24_TX_EMPTY)
+        return 0;
+    if(fifo & NRF24_TX_FULL)
+        return txCount;
+    //one or two packets, at least one has been sent since the last check:
+    //exact with two packets queued, with three it is exact as long as
+    //the IRQ is serviced within a packet time
+    if(txCount <= 2)
+        return 1;
+    return 2;
 }
 
 boolean NRF24::isSending()
 {
-    return !(spiReadRegister(NRF24_REG_00_CONFIG) & NRF24_PRIM_RX) && !(statusRead() & (NRF24_TX_DS | NRF24_MAX_RT));
+    return (powerstatus == NRF24PowerUpTX) && (pollTx() == NRF24TxPending);
 }
 
 boolean NRF24::available()
 {
+    if(_irqPin != NRF24_NO_PIN)
+    {
+        //The line is held low while packets are waiting in the chip, this happens if the edge
+        //was missed (e.g. during sleep) or if the ring buffer was full
+        if((rxCount < NRF24_RX_RING_LEN) && (digitalRead(_irqPin) == LOW))
+            handleIRQ();
+        return rxCount > 0;
+    }
+    //packets read together with an ack payload
+    if (rxCount > 0)
+        return true;
     if (spiReadRegister(NRF24_REG_17_FIFO_STATUS) & NRF24_RX_EMPTY)
         return false;
     // Manual says that messages > 32 octets should be discarded
@@ -667,6 +1148,21 @@ boolean NRF24::recv(uint8_t* pipe, uint8_t* buf, uint8_t* len)
     if (!available())
         return false;
 
+    if(rxCount > 0)
+    {
+        //Copy from the ring buffer, no SPI involved
+        NRF24RxRecord* rec = &rxRing[rxTail];
+        *pipe = rec->pipe;
+        *len = rec->len;
+        memcpy(buf, rec->data, rec->len);
+        rxTail = (rxTail + 1) % NRF24_RX_RING_LEN;
+        uint8_t sreg = SREG;
+        cli();
+        rxCount--;
+        SREG = sreg;
+        return true;
+    }
+
     // Clear read interrupt
     spiWriteRegister(NRF24_REG_07_STATUS, NRF24_RX_DR);
 
@@ -683,6 +1179,129 @@ boolean NRF24::recv(uint8_t* pipe, uint8_t* buf, uint8_t* len)
     return true;
 }
 
+void NRF24::handleIRQ()
+{
+    //The chip may be unpowered and the line floating
+    if(powerstatus == NRF24PowerDown)
+        return;
+    uint8_t sreg = SREG;
+    cli();
+    uint8_t status = statusRead();
+    //the ack payload is read first, so that it is there when the transmission is notified
+    if(status & NRF24_RX_DR)
+        drainRx(status);
+    if(status & (NRF24_TX_DS | NRF24_MAX_RT))
+        completeTx(status);
+    SREG = sreg;
+}
+
+void NRF24::drainRx(uint8_t status)
+{
+    //an ack payload comes together with the TX_DS of the packet it acknowledges,
+    //pipe 0 packets without it were received before switching to TX
+    boolean acks = ackPayloadEnabled && (powerstatus == NRF24PowerUpTX) && (txCount > 0) && (status & NRF24_TX_DS);
+    while(true)
+    {
+        while(!(spiReadRegister(NRF24_REG_17_FIFO_STATUS) & NRF24_RX_EMPTY))
+        {
+            uint8_t len = spiRead(NRF24_COMMAND_R_RX_PL_WID);
+            uint8_t pipen = (statusRead() & NRF24_RX_P_NO) >> 1;
+            // Manual says that messages > 32 octets should be discarded
+            if((len > 32) || (pipen > 5))
+            {
+                flushRx();
+                break;
+            }
+            //when transmitting, the ack payloads come on pipe 0
+            if(acks && (pipen == 0))
+            {
+                spiBurstRead(NRF24_COMMAND_R_RX_PAYLOAD, ackPayload, len);
+                ackPayloadLen = len;
+                ackPayloadAvailable = true;
+                continue;
+            }
+            if(rxCount == NRF24_RX_RING_LEN)
+            {
+                //Leave the rest in the chip, RX_DR stays set and recv() will come back for it
+                rxOverflow++;
+                return;
+            }
+            NRF24RxRecord* rec = &rxRing[rxHead];
+            rec->pipe = pipen;
+            rec->len = len;
+            spiBurstRead(NRF24_COMMAND_R_RX_PAYLOAD, rec->data, len);
+            rxHead = (rxHead + 1) % NRF24_RX_RING_LEN;
+            rxCount++;
+        }
+        spiWriteRegister(NRF24_REG_07_STATUS, NRF24_RX_DR);
+        //A packet may have arrived between the last check and the clearing of the flag
+        if(spiReadRegister(NRF24_REG_17_FIFO_STATUS) & NRF24_RX_EMPTY)
+            return;
+    }
+}
+
+boolean NRF24::setAckPayloads(boolean enable)
+{
+    ackPayloadEnabled = enable;
+    if(powerstatus == NRF24PowerDown)
+        return true; //written by powerUpIdle()
+    uint8_t feature = NRF24_EN_DPL | NRF24_EN_DYN_ACK | (enable ? NRF24_EN_ACK_PAY : 0);
+    spiWriteRegister(NRF24_REG_1D_FEATURE, feature);
+    return spiReadRegister(NRF24_REG_1D_FEATURE) == feature;
+}
+
+boolean NRF24::writeAckPayload(uint8_t pipe, uint8_t* data, uint8_t len)
+{
+    //in TX mode the payload would be sent as a normal packet
+    if(!ackPayloadEnabled || (powerstatus != NRF24PowerUpRX) || (pipe > 5) || (len > 32))
+        return false;
+    uint8_t sreg = SREG;
+    cli();
+    if(spiReadRegister(NRF24_REG_17_FIFO_STATUS) & NRF24_TX_FULL)
+    {
+        SREG = sreg;
+        return false;
+    }
+    spiBurstWrite(NRF24_COMMAND_W_ACK_PAYLOAD(pipe), data, len);
+    ackPayloadsPending++;
+    SREG = sreg;
+    return true;
+}
+
+uint8_t NRF24::getAckPayloadsPending()
+{
+    if((ackPayloadsPending > 0) && (_irqPin == NRF24_NO_PIN) && (txCount == 0))
+    {
+        uint8_t status = statusRead();
+        if(status & NRF24_TX_DS)
+            completeTx(status);
+    }
+    return ackPayloadsPending;
+}
+
+unsigned long NRF24::getAckPayloadsSent()
+{
+    return ackPayloadsSent;
+}
+
+boolean NRF24::recvAckPayload(uint8_t* buf, uint8_t* len)
+{
+    if(!ackPayloadAvailable)
+        return false;
+    uint8_t sreg = SREG;
+    cli();
+    *len = ackPayloadLen;
+    memcpy(buf, ackPayload, ackPayloadLen);
+    ackPayloadAvailable = false;
+    SREG = sreg;
+    return true;
+}
+
+unsigned long NRF24::getRxOverflowCounter()
+{
+    return rxOverflow;
+}
+
 void NRF24::printRegisters()
 {
     uint8_t registers[] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0d, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x1c, 0x1d};
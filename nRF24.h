@@ -13,8 +13,7 @@
  * - adds reliability: almost every command is checked after being executed
  * - supports all pipes (not only 0 and 1)
  * - adds several functionalities that were missing in the original version
- * Still unsupported:
- * - acks with payload
+ * - supports acks with payload
  *
  * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
  */
@@ -43,6 +42,18 @@
 #define NRF24_MAX_MESSAGE_LEN 32
 #endif
 
+// This is the number of received packets that can be buffered in SRAM when the IRQ pin is used
+// Can be pre-defined to a smaller size (to save SRAM) prior to including this header
+#ifndef NRF24_RX_RING_LEN
+#define NRF24_RX_RING_LEN 6
+#endif
+
+// Number of packets that fit in the TX FIFO of the chip
+#define NRF24_TX_FIFO_LEN 3
+
+// Value used for pins that are not connected
+#define NRF24_NO_PIN 0xff
+
 // These values we set for FIFO thresholds are actually the same as the POR values
 #define NRF24_TXFFAEM_THRESHOLD 4
 #define NRF24_RXFFAFULL_THRESHOLD 55
@@ -184,6 +195,16 @@ public:
         NRF24PowerUpTX        /** powered up and transmitting */
     } NRF24PowerStatus;
 
+    /** Defines the status of the last transmission, as returned by pollTx()
+     */
+    typedef enum
+    {
+        NRF24TxIdle = 0,  /**< nothing has been sent yet */
+        NRF24TxPending,   /**< the packet is being transmitted */
+        NRF24TxSent,      /**< the packet has been sent (and acknowledged if ack was requested) */
+        NRF24TxFailed     /**< the packet could not be sent within the retries */
+    } NRF24TxStatus;
+
     /** Defines convenient values for setting data rates in setRF()
      */
     typedef enum
@@ -228,8 +249,12 @@ public:
      * @param chipSelectPin the Arduino pin number of the output to use to select the NRF24 before
      * @param powerPin the Arduino digital pin number used for powering up the NRF24 module
      * accessing it
+     * @param irqPin the Arduino pin connected to the IRQ line of the module, NRF24_NO_PIN if not connected.
+     * If given, received packets are moved from the chip to a ring buffer in SRAM by handleIRQ()
+     * and recv() does not need any SPI traffic.
      */
-    static void configure(uint8_t chipEnablePin = 9, uint8_t chipSelectPin = 10, uint8_t powerPin = -1);
+    static void configure(uint8_t chipEnablePin = 9, uint8_t chipSelectPin = 10, uint8_t powerPin = -1,
+                          uint8_t irqPin = NRF24_NO_PIN);
 
 	/** Powers the device up in idle mode.
 	 * @return true if really powered up
@@ -244,6 +269,8 @@ public:
 
     /** Sets the radio in RX mode.
      * Sets chip enable to HIGH to enable the chip in RX mode.
+     * Restores the address of pipe 0 if it has been changed by an acked transmission.
+     * Packets still queued for transmission are dropped.
      * @return true on success
      */
     static boolean powerUpRx();
@@ -254,6 +281,17 @@ public:
      */
     static boolean powerUpTx();
 
+    /** Enables or disables the fast turnaround between RX and TX.
+     * When enabled, powerUpRx() and powerUpTx() do not flush the FIFOs, received
+     * packets that have not been read yet are moved to the ring buffer when switching
+     * to TX (those that do not fit are dropped and counted as overflow), and do not wait for the radio
+     * to settle when switching between RX and TX, as the chip does it by itself.
+     * It also enables the shadow registers, so that addresses are only written
+     * when they change.
+     * @param enable true to enable
+     */
+    static void setFastTurnaround(boolean enable);
+
     /** Tells what the power status of the chip is
      */
     static NRF24PowerStatus getPowerStatus();
@@ -282,6 +320,21 @@ public:
      */
     static uint8_t getRSSI();
 
+    /** Takes a sample of the Received Power Detector without waiting, to be called
+     * often (for example in the loop) while receiving.
+     * Samples are averaged by an exponentially weighted moving average, see getCarrierLevel().
+     * Received packets are not touched.
+     * @return false if the radio is not receiving, in which case no sample is taken
+     */
+    static boolean sampleRPD();
+
+    /** Gives the average of the samples taken by sampleRPD(), which follows
+     * the last 16 samples or so.
+     * @return 0 if no signal above -64DBm has been observed,
+     * 255 if it has been observed all the time
+     */
+    static uint8_t getCarrierLevel();
+
     /** Sets the number of bytes used for CRC.
      * By default it's 1 byte CRC.
      * 0 bytes means no CRC, 1 byte or 2 bytes are allowed.
@@ -452,6 +505,48 @@ public:
      */
     static boolean send(uint8_t* data, uint8_t len, boolean noack = false);
 
+    /** Sends data to the address set by setTransmitAddress() without waiting
+     * for the transmission to complete.
+     * Sets the radio to TX mode, loads the TX FIFO and returns.
+     * Up to getTxQueueCapacity() packets can be queued, so that the chip transmits
+     * them back to back (streaming). A packet that reaches the maximum number of
+     * retries is dropped alone, the packets queued behind it are still sent.
+     * The transmit address must not be changed while packets are queued.
+     * The outcome is given by pollTx() and passed to the function set with setTxCallback().
+     * @param data Data bytes to send.
+     * @param len Number of data bytes to set in the TX buffer.
+     * @param noack Optional parameter if true sends the message NOACK mode.
+     * @return true if the packet has been loaded, false if the TX FIFO is full
+     */
+    static boolean sendAsync(uint8_t* data, uint8_t len, boolean noack = false);
+
+    /** Checks the status of the transmissions started with sendAsync() or send().
+     * Without IRQ pin it reads the status register, with the IRQ pin
+     * the status is updated by handleIRQ() and no SPI is used.
+     * Packets that do not complete in 2 seconds are considered failed.
+     * @return NRF24TxPending if packets are still queued, otherwise
+     * the status of the last transmitted packet, see NRF24TxStatus
+     */
+    static NRF24TxStatus pollTx();
+
+    /** Gives the number of packets that are queued for transmission.
+     * @return the number of packets in the TX FIFO, up to NRF24_TX_FIFO_LEN
+     */
+    static uint8_t getTxQueueLength();
+
+    /** Gives the maximum number of packets that can be queued for transmission.
+     * @return NRF24_TX_FIFO_LEN with the IRQ pin, one less without it, so that the
+     * packets sent can be counted from the TX FIFO status when polling
+     */
+    static uint8_t getTxQueueCapacity();
+
+    /** Sets a function that is called every time a packet transmission is completed.
+     * When the IRQ pin is used, the function is called from the interrupt handler
+     * so it must be short and must not use the radio.
+     * @param f the function, sent is true if the packet has been sent, NULL to remove it
+     */
+    static void setTxCallback(void (*f)(boolean sent));
+
     /** Indicates if the chip is in transmit mode and
      * there is a packet currently being transmitted
      * @return true if the chip is in transmit mode and there is a transmission in progress
@@ -497,19 +592,262 @@ public:
      */
     static void printRegisters();
 
+    /** Enables or disables payloads in acknowledgment packets.
+     * Requires dynamic payload size on the pipes used.
+     * @param enable true to enable
+     * @return true on success
+     */
+    static boolean setAckPayloads(boolean enable);
+
+    /** Loads a payload to be sent with the next acknowledgment on a pipe.
+     * The payload is sent to whichever node transmits next on that pipe.
+     * Ack payloads share the TX FIFO with normal packets: the ones still pending are
+     * flushed by powerUpTx().
+     * @param pipe the pipe number, from 0 to 5
+     * @param data the payload
+     * @param len the length of the payload, up to 32 bytes
+     * @return true if loaded, false if ack payloads are disabled, the radio is not in RX mode
+     * or the FIFO is full
+     */
+    static boolean writeAckPayload(uint8_t pipe, uint8_t* data, uint8_t len);
+
+    /** Gives the number of ack payloads that have been loaded and not yet sent
+     * (nor flushed).
+     * @return the number of pending ack payloads
+     */
+    static uint8_t getAckPayloadsPending();
+
+    /** Gives the number of ack payloads sent since start.
+     * @return the number of sent ack payloads
+     */
+    static unsigned long getAckPayloadsSent();
+
+    /** If the acknowledgment of a transmission carried a payload, copies it to buf.
+     * Only the last received ack payload is kept.
+     * @param buf Location to copy the payload
+     * @param len Set to the length of the payload
+     * @return true if a payload was copied
+     */
+    static boolean recvAckPayload(uint8_t* buf, uint8_t* len);
+
+    /** Enables or disables the shadow copy of the configuration registers.
+     * When enabled, CONFIG, EN_AA, EN_RXADDR, SETUP_AW, SETUP_RETR, RF_CH, RF_SETUP,
+     * the transmit address and the address of pipe 0 are kept in SRAM: getters do not
+     * use SPI and setters only write, and only if the value changes.
+     * Enabling it loads the copy from the chip.
+     * @param enable true to enable the shadow copy
+     */
+    static void setShadowRegisters(boolean enable);
+
+    /** Reloads the shadow copy of the registers from the chip.
+     */
+    static void resyncRegisters();
+
+    /** Compares the shadow copy of the registers with the content of the chip.
+     * @return true if they match (or the shadow copy is disabled)
+     */
+    static boolean verifyRegisters();
+
+    /** Gives the number of SPI transactions (chip select cycles)
+     * done since start or since the last resetSPICounter().
+     * @return the number of transactions
+     */
+    static unsigned long getSPICounter();
+
+    /** Resets the counter of SPI transactions.
+     */
+    static void resetSPICounter();
+
+    /** Handler of the IRQ line.
+     * Completes the pending transmission, if any, and
+     * drains the RX FIFO of the chip into the RX ring buffer.
+     * It is attached automatically by configure() when an IRQ pin is given, it
+     * can also be called by user's interrupt routines.
+     */
+    static void handleIRQ();
+
+    /** Gives the number of received packets that were dropped because
+     * the RX ring buffer was full.
+     * @return the number of dropped packets
+     */
+    static unsigned long getRxOverflowCounter();
+
+    /** Gives the time spent by the radio in a power status since start or since
+     * resetEnergyCounters(), the current status included.
+     * The time spent with the MCU sleeping is not counted, as the timers are stopped.
+     * @param status the power status
+     * @return the time in milliseconds
+     */
+    static unsigned long getStateTime(NRF24PowerStatus status);
+
+    /** Gives the number of transmission attempts since start or since resetEnergyCounters(),
+     * hardware retransmissions included, as read from the OBSERVE_TX register.
+     * @return the number of attempts
+     */
+    static unsigned long getTxAttempts();
+
+    /** Gives the number of retransmissions of the last completed transmission,
+     * as read from the OBSERVE_TX register (ARC_CNT) when it completed.
+     * @return 0 to 15
+     */
+    static uint8_t getLastRetries();
+
+    /** Resets the state times and the transmission attempts.
+     */
+    static void resetEnergyCounters();
+
 protected:
 
 private:
     static uint8_t _chipEnablePin;
     static uint8_t _chipSelectPin;
     static uint8_t _powerPin;
-    static uint8_t * pipe0Address;
+    static uint8_t _irqPin;
+    static uint8_t pipe0Address[5];
+    static boolean pipe0Stored;
+    static boolean fastTurnaround;
 	  static NRF24PowerStatus powerstatus;
 
+    /** Time spent in each power status, in milliseconds plus a remainder in microseconds,
+     * and when the current status was entered.
+     */
+    static unsigned long stateTime[NRF24PowerUpTX + 1];
+    static unsigned int stateMicros[NRF24PowerUpTX + 1];
+    static unsigned long stateStartMillis;
+    static unsigned long stateStartMicros;
+    static volatile unsigned long txAttempts;
+    static volatile uint8_t lastRetries;
+
+    /** Average of the RPD samples, 8 bits fixed point.
+     */
+    static uint16_t carrierLevel;
+
+    /** Changes the power status, accounting the time spent in the previous one.
+     */
+    static void setPowerStatus(NRF24PowerStatus status);
+
+    /** Adds the time spent in the current status to its counter.
+     */
+    static void accountStateTime();
+
+    /** A packet stored in the RX ring buffer.
+     */
+    typedef struct {
+        uint8_t pipe;
+        uint8_t len;
+        uint8_t data[NRF24_MAX_MESSAGE_LEN];
+    } NRF24RxRecord;
+
+    /** Ring buffer of received packets, filled by handleIRQ() or together with ack payloads.
+     * The interrupt handler only moves rxHead, the main code only moves rxTail.
+     */
+    static NRF24RxRecord rxRing[NRF24_RX_RING_LEN];
+    static volatile uint8_t rxHead;
+    static volatile uint8_t rxTail;
+    static volatile uint8_t rxCount;
+    static volatile unsigned long rxOverflow;
+
+    /** A copy of a packet loaded in the TX FIFO.
+     * Needed to reload the packets that follow a failed one.
+     */
+    typedef struct {
+        boolean noack;
+        uint8_t len;
+        uint8_t data[NRF24_MAX_MESSAGE_LEN];
+    } NRF24TxRecord;
+
+    /** Packets in the TX FIFO, oldest first.
+     */
+    static NRF24TxRecord txQueue[NRF24_TX_FIFO_LEN];
+    static volatile uint8_t txHead;
+    static volatile uint8_t txCount;
+
+    /** Status of the last completed transmission and when the oldest queued one was started.
+     */
+    static volatile NRF24TxStatus txStatus;
+    static unsigned long txStart;
+
+    /** Flushes the TX FIFO and notifies all queued packets as failed.
+     */
+    static void abortTx();
+
+    /** Removes the oldest packet from the TX queue and notifies its outcome.
+     * @param sent true if the packet has been sent
+     */
+    static void popTx(boolean sent);
+
+    /** Function called on completion of a transmission.
+     */
+    static void (*txCallback)(boolean sent);
+
+    /** Completes the queued transmissions given the value of the status register.
+     * When the IRQ pin is used, must be called with interrupts disabled.
+     * @param status the value of the status register
+     */
+    static void completeTx(uint8_t status);
+
+    /** Gives the number of queued packets still in the TX FIFO after a TX_DS.
+     * @param fifo the value of the FIFO status register
+     * @return the number of packets not sent yet
+     */
+    static uint8_t txFifoLeft(uint8_t fifo);
+
+    /** Moves the content of the RX FIFO into the ring buffer,
+     * ack payloads received while transmitting are kept apart.
+     * When the IRQ pin is used, must be called with interrupts disabled.
+     * @param status the value of the status register, packets on pipe 0 are
+     * ack payloads only if TX_DS is set while transmitting
+     */
+    static void drainRx(uint8_t status);
+
     /** Handlers of received packet, one per pipe.
      */
     static void (*pipehandlers[6])(uint8_t * pkt, uint8_t len);
 
+    /** Shadow copy of registers 0x00 to 0x06 and of the TX and pipe 0 addresses.
+     * shadowValid has a bit per register plus bits for the addresses.
+     */
+    static boolean shadowEnabled;
+    static uint16_t shadowValid;
+    static uint8_t shadowRegs[NRF24_REG_06_RF_SETUP + 1];
+    static uint8_t shadowTxAddress[5];
+    static uint8_t shadowPipe0Address[5];
+
+    /** Ack payloads: flag, number loaded in the FIFO, number sent
+     * and last one received.
+     */
+    static boolean ackPayloadEnabled;
+    static volatile uint8_t ackPayloadsPending;
+    static volatile unsigned long ackPayloadsSent;
+    static uint8_t ackPayload[NRF24_MAX_MESSAGE_LEN];
+    static volatile uint8_t ackPayloadLen;
+    static volatile boolean ackPayloadAvailable;
+
+    /** Counter of SPI transactions.
+     */
+    static volatile unsigned long spiCounter;
+
+    /** Reads a register using the shadow copy if available.
+     * @param reg Register number, one of NRF24_REG_*
+     * @return The value of the register
+     */
+    static uint8_t readRegister(uint8_t reg);
+
+    /** Writes a register and updates the shadow copy.
+     * If the shadow copy is enabled, the write is skipped when the value is unchanged.
+     * @param reg Register number, one of NRF24_REG_*
+     * @param val The value to write
+     */
+    static void writeRegister(uint8_t reg, uint8_t val);
+
+    /** Writes the address of a pipe without storing the one of pipe 0
+     * for powerUpRx().
+     * @param pipe The index of the pipe to set, from 0 to 5
+     * @param address The address for receiving
+     * @return true on success
+     */
+    static boolean writePipeAddress(uint8_t pipe, uint8_t* address);
+
     /** Execute an SPI command that requires neither reading or writing
      * @param command the SPI command to execute, one of NRF24_COMMAND_*
      * @return the value of the device status register
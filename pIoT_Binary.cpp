@@ -0,0 +1,146 @@
+/** Binary serial protocol between the pIoT base and the server.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#include <pIoT_Binary.h>
+
+uint16_t binaryCRC16(const uint8_t* data, int len)
+{
+    uint16_t crc = 0xFFFF;
+    for(int i=0; i<len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for(uint8_t b=0; b<8; b++)
+            crc = (crc & 0x8000)? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+    return crc;
+}
+
+int binaryCOBSEncode(const uint8_t* in, int len, uint8_t* out)
+{
+    int codePos = 0;
+    int pos = 1;
+    uint8_t code = 1;
+    for(int i=0; i<len; i++) {
+        if(in[i] == 0) {
+            out[codePos] = code;
+            codePos = pos++;
+            code = 1;
+        }
+        else {
+            out[pos++] = in[i];
+            code++;
+            //blocks are at most 254 bytes long
+            if((code == 0xFF) && (i < len-1)) {
+                out[codePos] = code;
+                codePos = pos++;
+                code = 1;
+            }
+        }
+    }
+    out[codePos] = code;
+    return pos;
+}
+
+int binaryCOBSDecode(const uint8_t* in, int len, uint8_t* out)
+{
+    int pos = 0;
+    int i = 0;
+    while(i < len) {
+        uint8_t code = in[i++];
+        if(code == 0) return -1;
+        for(uint8_t j=1; j<code; j++) {
+            if((i >= len) || (in[i] == 0)) return -1;
+            out[pos++] = in[i++];
+        }
+        //a zero follows every block shorter than 254 bytes, but the last
+        if((code < 0xFF) && (i < len))
+            out[pos++] = 0;
+    }
+    return pos;
+}
+
+int binaryEncodeFrame(int32_t address, uint16_t msgType, uint8_t flags, const uint8_t* data, int len, uint8_t* out)
+{
+    if((len < 0) || (len > BINARY_MAX_PAYLOAD)) return 0;
+    uint8_t raw[BINARY_HEADER_LEN + BINARY_MAX_PAYLOAD + 2];
+    raw[0] = address & 0xFF;
+    raw[1] = (address >> 8) & 0xFF;
+    raw[2] = (address >> 16) & 0xFF;
+    raw[3] = (address >> 24) & 0xFF;
+    raw[4] = msgType & 0xFF;
+    raw[5] = (msgType >> 8) & 0xFF;
+    raw[6] = flags;
+    for(int i=0; i<len; i++)
+        raw[BINARY_HEADER_LEN + i] = data[i];
+    uint16_t crc = binaryCRC16(raw, BINARY_HEADER_LEN + len);
+    raw[BINARY_HEADER_LEN + len] = crc & 0xFF;
+    raw[BINARY_HEADER_LEN + len + 1] = (crc >> 8) & 0xFF;
+    int enclen = binaryCOBSEncode(raw, BINARY_HEADER_LEN + len + 2, out);
+    out[enclen] = 0;
+    return enclen + 1;
+}
+
+void binaryFramerReset(BinaryFramer* framer)
+{
+    framer->len = 0;
+    framer->overflow = 0;
+    framer->dataLen = 0;
+    framer->data = framer->buffer + BINARY_HEADER_LEN;
+}
+
+uint8_t binaryFramerFeed(BinaryFramer* framer, uint8_t b)
+{
+    if(b != 0) {
+        if(framer->len < BINARY_FRAME_LEN) framer->buffer[framer->len++] = b;
+        else framer->overflow = 1;
+        return 0;
+    }
+    //end of frame
+    int enclen = framer->len;
+    uint8_t overflow = framer->overflow;
+    framer->len = 0;
+    framer->overflow = 0;
+    if(overflow || (enclen == 0)) return 0;
+    int len = binaryCOBSDecode(framer->buffer, enclen, framer->buffer);
+    if(len < BINARY_HEADER_LEN + 2) return 0;
+    uint8_t* raw = framer->buffer;
+    uint16_t crc = raw[len-2] | ((uint16_t)raw[len-1] << 8);
+    if(crc != binaryCRC16(raw, len - 2)) return 0;
+    framer->address = (int32_t)((uint32_t)raw[0] | ((uint32_t)raw[1] << 8) | ((uint32_t)raw[2] << 16) | ((uint32_t)raw[3] << 24));
+    framer->msgType = raw[4] | ((uint16_t)raw[5] << 8);
+    framer->flags = raw[6];
+    framer->data = raw + BINARY_HEADER_LEN;
+    framer->dataLen = len - BINARY_HEADER_LEN - 2;
+    return 1;
+}
+
+#ifdef ARDUINO
+
+boolean writeBinarySerial(long address, unsigned int msgType, byte flags, byte* data, int len)
+{
+    uint8_t frame[BINARY_FRAME_LEN];
+    int framelen = binaryEncodeFrame(address, msgType, flags, data, len, frame);
+    if(framelen == 0) return false;
+    return Serial.write(frame, framelen) == (size_t)framelen;
+}
+
+static BinaryFramer serialFramer;
+
+void readBinarySerial(int mis, void (*f)(long address, unsigned int msgType, byte flags, byte* data, int len))
+{
+    unsigned long start = millis();
+
+    while(true) {
+        if(Serial.available() > 0) {
+            if(binaryFramerFeed(&serialFramer, Serial.read())) {
+                f(serialFramer.address, serialFramer.msgType, serialFramer.flags, serialFramer.data, serialFramer.dataLen);
+                return;
+            }
+        }
+        else if(millis() - start >= (unsigned long)mis) return;
+    }
+}
+
+#endif
@@ -0,0 +1,134 @@
+/** Binary serial protocol between the pIoT base and the server.
+ * An alternative to JSON messages when the serial bandwidth matters:
+ * each frame carries the address of a node, the message type, some flags and the raw payload.
+ * Frames are:
+ * - address (4 bytes), message type (2 bytes), flags (1 byte), payload, CRC16 (2 bytes), all little endian
+ * - encoded with COBS, so that they contain no zeros
+ * - terminated by a zero
+ * The CRC is CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF) of all the preceding bytes.
+ * From the base to the server the address is the sender, from the server to the base the destination.
+ *
+ * The codec does not depend on Arduino, this file and pIoT_Binary.cpp can be compiled
+ * on the server side as well.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#ifndef pIoT_BINARY_H_INCLUDED
+#define pIoT_BINARY_H_INCLUDED
+
+#ifdef ARDUINO
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <wiring.h>
+#include <pins_arduino.h>
+#endif
+#else
+#include <stdint.h>
+#endif
+
+//Maximum payload of a binary frame
+//Can be pre-defined prior to including this header, must be the same on both sides
+#ifndef BINARY_MAX_PAYLOAD
+#define BINARY_MAX_PAYLOAD 128
+#endif
+
+//Length of the header, address + message type + flags
+#define BINARY_HEADER_LEN 7
+
+//Maximum length of an encoded frame: header, payload, CRC, COBS overhead and terminator
+#define BINARY_FRAME_LEN (BINARY_HEADER_LEN + BINARY_MAX_PAYLOAD + 2 + (BINARY_HEADER_LEN + BINARY_MAX_PAYLOAD + 2) / 254 + 2)
+
+//Flags
+//The message was sent in broadcast (base to server) or has to be (server to base)
+#define BINARY_FLAG_BROADCAST 0x01
+//Signals above -64dBm have been seen most of the time recently, see NRF24::getCarrierLevel()
+#define BINARY_FLAG_STRONG 0x02
+
+/** Computes the CRC-16/CCITT of some bytes.
+ * @param data the bytes
+ * @param len the number of bytes
+ * @return the CRC
+ */
+uint16_t binaryCRC16(const uint8_t* data, int len);
+
+/** Encodes bytes with COBS (Consistent Overhead Byte Stuffing).
+ * The output contains no zeros and is at most len + len/254 + 1 bytes long, the terminator is not added.
+ * @param in the bytes to encode
+ * @param len the number of bytes
+ * @param out where the encoded bytes are written
+ * @return the length of the encoded bytes
+ */
+int binaryCOBSEncode(const uint8_t* in, int len, uint8_t* out);
+
+/** Decodes bytes encoded with COBS, without the terminator.
+ * out can be the same as in.
+ * @param in the encoded bytes
+ * @param len the number of encoded bytes
+ * @param out where the decoded bytes are written
+ * @return the length of the decoded bytes, -1 if the encoding is not valid
+ */
+int binaryCOBSDecode(const uint8_t* in, int len, uint8_t* out);
+
+/** Builds a frame, terminator included.
+ * @param address the address of the node
+ * @param msgType the message type
+ * @param flags the flags, see BINARY_FLAG_*
+ * @param data the payload
+ * @param len the length of the payload, up to BINARY_MAX_PAYLOAD
+ * @param out where the frame is written, BINARY_FRAME_LEN bytes long
+ * @return the length of the frame, 0 if the payload is too long
+ */
+int binaryEncodeFrame(int32_t address, uint16_t msgType, uint8_t flags, const uint8_t* data, int len, uint8_t* out);
+
+/** Incremental reader of frames from a stream of bytes.
+ */
+typedef struct {
+    uint8_t buffer[BINARY_FRAME_LEN];
+    int len;
+    uint8_t overflow;
+    //the last frame read
+    int32_t address;
+    uint16_t msgType;
+    uint8_t flags;
+    uint8_t* data; //points into buffer, valid until the next byte is fed
+    int dataLen;
+} BinaryFramer;
+
+/** Empties a framer, must be called before using it.
+ */
+void binaryFramerReset(BinaryFramer* framer);
+
+/** Feeds a byte to a framer.
+ * Frames that are too long or have a wrong CRC are dropped.
+ * @param framer the framer
+ * @param b the byte
+ * @return 1 if the byte completes a valid frame, whose content is in the framer, 0 otherwise
+ */
+uint8_t binaryFramerFeed(BinaryFramer* framer, uint8_t b);
+
+#ifdef ARDUINO
+
+/** Sends a frame on the serial port, with a single write.
+ * @param address the address of the node
+ * @param msgType the message type
+ * @param flags the flags, see BINARY_FLAG_*
+ * @param data the payload
+ * @param len the length of the payload, up to BINARY_MAX_PAYLOAD
+ * @return true if sent
+ */
+boolean writeBinarySerial(long address, unsigned int msgType, byte flags, byte* data, int len);
+
+/** Reads frames from the serial port.
+ * It returns as soon as a frame is complete, or when there is nothing
+ * to read and the time specified in millis has passed.
+ * @param millis the maximum time to wait for data
+ * @param f the function that treats the frame, data points into the internal buffer
+ */
+void readBinarySerial(int millis, void (*f)(long address, unsigned int msgType, byte flags, byte* data, int len));
+
+#endif
+
+#endif
@@ -52,12 +52,32 @@ void reset(){
 //Used to keep track if we have to keep sleeping or not
 volatile boolean keepSleeping = true;
 
-//ISR that wakes up the PIC when a pin changes from LOW to HIGH or viceversa
+//Levels of the ports B, C and D when going to sleep, and pins that changed since then,
+//bit n is the pin n of the Arduino
+byte sleepPorts[3];
+volatile unsigned long wakePins = 0;
+
+//ISRs that wake up the MCU when a pin changes from LOW to HIGH or viceversa,
+//the port is compared with its level before sleeping, only the watched pins are considered
 ISR(PCINT0_vect){
+    wakePins |= (unsigned long)((PINB ^ sleepPorts[0]) & PCMSK0) << 8;
+    keepSleeping = false;
+}
+ISR(PCINT1_vect){
+    wakePins |= (unsigned long)((PINC ^ sleepPorts[1]) & PCMSK1) << 14;
+    keepSleeping = false;
+}
+ISR(PCINT2_vect){
+    wakePins |= (PIND ^ sleepPorts[2]) & PCMSK2;
     keepSleeping = false;
 }
-ISR(PCINT1_vect, ISR_ALIASOF(PCINT0_vect));
-ISR(PCINT2_vect, ISR_ALIASOF(PCINT0_vect));
+
+unsigned long getWakePins(){
+    noInterrupts();
+    unsigned long p = wakePins;
+    interrupts();
+    return p;
+}
 
 //Returns the interrupt mask of the pin
 byte pinToInt(byte pin){
@@ -77,43 +97,203 @@ byte pinToIE(byte pin){
   else return PCIE1;
 }
 
-/** Counter of the wake ups produced by the watchdog.
+/** Time spent sleeping, seconds and microseconds.
  */
-volatile unsigned long totalSleepCounter;
+volatile unsigned long totalSleepSeconds = 0;
+volatile unsigned long totalSleepMicros = 0;
 
 unsigned long getTotalSleepSeconds(){
-    return totalSleepCounter;
+    noInterrupts();
+    unsigned long seconds = totalSleepSeconds;
+    interrupts();
+    return seconds;
+}
+
+/** Adds time to the time slept, called with interrupts disabled */
+void addSleepMicros(unsigned long us){
+    totalSleepMicros += us;
+    while(totalSleepMicros >= 1000000){
+        totalSleepMicros -= 1000000;
+        totalSleepSeconds++;
+    }
+}
+
+unsigned long getTotalSleepMillis(){
+    noInterrupts();
+    unsigned long ms = (totalSleepSeconds * 1000) + (totalSleepMicros / 1000);
+    interrupts();
+    return ms;
 }
 
-/** seconds to be waited */
-int toWaitSeconds = 0;
-volatile int sleptSecondsSinceLastWakeUp =0;
+/** Time slept by the MCU with the radio in each of its states, in ms.
+ * The radio counts its own time with millis(), which stops while sleeping.
+ */
+unsigned long radioSleepMillis[NRF24::NRF24PowerUpTX + 1];
+/** Time slept already given to a radio state, and the state of the radio in the last sleep */
+unsigned long radioSleepMark = 0;
+NRF24::NRF24PowerStatus radioSleepStatus = NRF24::NRF24PowerDown;
+
+/** Gives the time slept since the last call to a state of the radio.
+ * Part of a sleep may be counted after it, see sleepUntilPins().
+ */
+void accountRadioSleep(NRF24::NRF24PowerStatus status){
+    unsigned long total = getTotalSleepMillis();
+    radioSleepMillis[status] += total - radioSleepMark;
+    radioSleepMark = total;
+}
 
-/** ISR of the watchdog */
+/** Measured period of the watchdog with WDT_CALIBRATION_PRESCALER, in us */
+unsigned long wdtCalibratedUS = (unsigned long)WDT_MIN_PERIOD_MS * 1000 << WDT_CALIBRATION_PRESCALER;
+/** When the watchdog was calibrated, in seconds of operation */
+unsigned long wdtCalibrationTime;
+/** True when the watchdog has to be calibrated before sleeping */
+boolean wdtCalibrationNeeded = true;
+/** Vcc and temperature at the last calibration, and the last read */
+float calibrationVcc = NAN;
+float calibrationTemp = NAN;
+float lastVcc = NAN;
+float lastTemp = NAN;
+
+/** Period of the watchdog being used, in us */
+volatile unsigned long wdtPeriodUS;
+/** Set by the watchdog ISR */
+volatile boolean wdtFired;
+/** True when a period of the watchdog is counted as sleep time, and true while
+ * the MCU is in sleepUntilPins() */
+volatile boolean wdtRunning = false;
+volatile boolean wdtSleeping = false;
+/** Time spent awake in the current period, and start of the current awake stretch, in micros() */
+volatile unsigned long wdtAwakeUS;
+volatile unsigned long wdtAwakeStart;
+/** Time slept counted at the end of the last period, in us */
+volatile unsigned long wdtCreditUS;
+
+/** ISR of the watchdog.
+ * The part of the period not spent awake has been slept. When the period ends
+ * with the MCU awake, after a pin has woken it up, the watchdog is stopped.
+ */
 ISR(WDT_vect) {
-    totalSleepCounter++;
-    sleptSecondsSinceLastWakeUp ++;
-    if(( toWaitSeconds >0) && (sleptSecondsSinceLastWakeUp >= toWaitSeconds)){
-        //Time to wake up!
-        keepSleeping = false;
-        sleptSecondsSinceLastWakeUp = 0;
-    } else {
-        keepSleeping = true;
+    if(wdtRunning){
+        unsigned long awakeUS = wdtAwakeUS;
+        if(!wdtSleeping) awakeUS += micros() - wdtAwakeStart;
+        wdtCreditUS = (wdtPeriodUS > awakeUS) ? wdtPeriodUS - awakeUS : 0;
+        addSleepMicros(wdtCreditUS);
+        //the watchdog starts a new period by itself
+        wdtAwakeUS = 0;
+        if(!wdtSleeping){
+            wdtRunning = false;
+            wdt_disable();
+        }
     }
+    wdtFired = true;
 }
 
+/** Gives the real period of the watchdog with a prescaler, as calibrated.
+ * @param prescaler 0 to 9, the nominal period is 16ms * 2^prescaler
+ * @return the period in us
+ */
+unsigned long watchdogPeriod(byte prescaler){
+    if(prescaler >= WDT_CALIBRATION_PRESCALER)
+        return wdtCalibratedUS << (prescaler - WDT_CALIBRATION_PRESCALER);
+    return wdtCalibratedUS >> (WDT_CALIBRATION_PRESCALER - prescaler);
+}
 
-void sleepUntil(int seconds, int pinsN, ...){
-    if(seconds == 0)
-        return;
+/** Starts the watchdog in interrupt mode.
+ * @param prescaler 0 to 9, the period is 16ms * 2^prescaler
+ */
+void startWatchdog(byte prescaler){
+    byte bits = (prescaler & 0x07) | ((prescaler & 0x08) ? _BV(WDP3) : 0);
+    wdtPeriodUS = watchdogPeriod(prescaler);
+    noInterrupts();
+    wdt_reset();
+    // reset status flag
+    MCUSR &= ~(1 << WDRF);
+    // enable configuration changes
+    WDTCSR |= (1 << WDCE) | (1 << WDE);
+    // set the prescaler and enable interrupt mode without reset
+    WDTCSR = bits | _BV(WDIE);
+    interrupts();
+}
 
-    int pins[pinsN];
-    va_list list;
-    va_start(list, pinsN);
-    for(int i = 0; i<pinsN; i++){
-       pins[i] = va_arg(list, int);
+boolean calibrateWatchdog(){
+    unsigned long nominal = (unsigned long)WDT_MIN_PERIOD_MS * 1000 << WDT_CALIBRATION_PRESCALER;
+    //a period left running by a pin is stopped, the part of it slept is lost
+    wdtRunning = false;
+    wdtSleeping = false;
+    wdtFired = false;
+    //the watchdog is reset when started, so the first period is whole
+    startWatchdog(WDT_CALIBRATION_PRESCALER);
+    unsigned long start = micros();
+    while(!wdtFired && (micros() - start < 2 * nominal))
+        ;
+    unsigned long measured = micros() - start;
+    wdt_disable();
+    wdtCalibrationTime = getTotalSleepSeconds() + (millis() / 1000);
+    wdtCalibrationNeeded = false;
+    calibrationVcc = lastVcc;
+    calibrationTemp = lastTemp;
+    //the oscillator is within +-10%, anything else is a wrong measure
+    if(!wdtFired || (measured < nominal - nominal / 4) || (measured > nominal + nominal / 4))
+        return false;
+    wdtCalibratedUS = measured;
+    return true;
+}
+
+//ADMUX settings for the internal readings
+//Vcc: 1.1V reference read against AVcc
+#define ADMUX_VCC (_BV(REFS0) | _BV(MUX3) | _BV(MUX2) | _BV(MUX1))
+//Temperature: sensor read against the internal 1.1V reference
+#define ADMUX_TEMP (_BV(REFS1) | _BV(REFS0) | _BV(MUX3))
+
+//When the reference was last changed, in micros()
+unsigned long adcRefChanged = 0;
+
+#ifndef PIOT_NO_ADC_ISR
+//Sum of the samples taken by the ADC ISR, their number, and true if the next one is discarded
+volatile unsigned int adcSum;
+volatile byte adcCount;
+volatile boolean adcDiscard;
+
+ISR(ADC_vect){
+    if(adcDiscard) adcDiscard = false;
+    else{
+        adcSum += ADCW;
+        adcCount++;
     }
-    va_end(list);
+}
+#endif
+
+/** Selects an input of the ADC, and its reference.
+ */
+void selectADC(byte admux){
+    if(ADMUX == admux) return;
+    //the internal reference charges the capacitor on AREF slowly, AVcc quickly
+    if((admux & _BV(REFS1)) && !(ADMUX & _BV(REFS1)))
+        adcRefChanged = micros();
+    ADMUX = admux;
+}
+
+//Cached readings and when they were taken, in ms of operation, sleep included
+float cachedVcc;
+float cachedTemp;
+unsigned long cachedVccTime;
+unsigned long cachedTempTime;
+boolean cachedVccValid = false;
+boolean cachedTempValid = false;
+
+//Each period of the watchdog is the longest that fits in the time left,
+//so that long sleeps need few wake ups
+byte sleepUntilPins(unsigned long ms, int pinsN, int* pins){
+    //the oscillator of the watchdog drifts with time, voltage and temperature
+    if(wdtCalibrationNeeded ||
+       (getTotalSleepSeconds() + (millis() / 1000) - wdtCalibrationTime >= WDT_CALIBRATION_PERIOD_S))
+        calibrateWatchdog();
+
+    //the radio stays in its state while sleeping, what has been counted since the last
+    //sleep belongs to that one
+    NRF24::NRF24PowerStatus radioStatus = nRF24.getPowerStatus();
+    accountRadioSleep(radioSleepStatus);
+    radioSleepStatus = radioStatus;
 
     //make sure we don't get interrupted before we sleep
     noInterrupts ();
@@ -122,11 +302,13 @@ void sleepUntil(int seconds, int pinsN, ...){
 	ADCSRA &= ~(1<<ADEN);
 
     //register pin changes
+    wakePins = 0;
+    sleepPorts[0] = PINB;
+    sleepPorts[1] = PINC;
+    sleepPorts[2] = PIND;
     if(pinsN >0){
-		//clear pins interrupts
-		PCIFR &= ~(bit (PCIF0));
-		PCIFR &= ~(bit (PCIF1));
-		PCIFR &= ~(bit (PCIF2));
+		//clear pins interrupts, flags are cleared by writing 1
+		PCIFR = bit (PCIF0) | bit (PCIF1) | bit (PCIF2);
 		for(int i=0; i< pinsN; i++){
 			//set pin mask
 			if((pins[i]>=0) && (pins[i]<=19)){//pin is considered only if >=0 and <=19
@@ -141,17 +323,6 @@ void sleepUntil(int seconds, int pinsN, ...){
 		}
 	}
 
-    //Activate the watchdog
-    toWaitSeconds = seconds;
-    // reset status flag
-    MCUSR &= ~(1 << WDRF);
-    // enable configuration changes
-    WDTCSR |= (1 << WDCE) | (1 << WDE);
-    // set the prescalar to 0110 (1 second)
-    WDTCSR = (0<<WDP0) | (1<< WDP1) | (1 << WDP2) | (0<<WDP3);
-    // enable interrupt mode without reset
-    WDTCSR |= _BV(WDIE);
-
     //Set sleep mode power down:
     //In this mode, the external Oscillator is stopped, while the external interrupts, the 2-
     //wire Serial Interface address watch, and the Watchdog continue operating (if enabled). Only an
@@ -159,63 +330,247 @@ void sleepUntil(int seconds, int pinsN, ...){
     //Serial Interface address match, an external level interrupt on INT0 or INT1, or a pin change
     //interrupt can wake up the MCU.
     set_sleep_mode(SLEEP_MODE_PWR_DOWN);
-    sleep_enable();
 
     keepSleeping = true;
 
+    //the awake stretch in the period left running by a pin ends here
+    if(wdtRunning) wdtAwakeUS += micros() - wdtAwakeStart;
+    wdtSleeping = true;
+    wdtFired = false;
+
     //interrupts allowed now
     interrupts ();
-    //Let's sleep !
+
+    boolean forever = (ms == 0);
+    //a pin wakes the board up in the middle of a period, shorter periods lose less if it
+    //is not slept again
+    byte maxPrescaler = (pinsN > 0) ? WDT_PIN_MAX_PRESCALER : WDT_MAX_PRESCALER;
+    //fractions of millisecond slept and not yet taken from ms
+    unsigned int extraUS = 0;
     while(keepSleeping){
-        // turns BOD off, must be done right before sleep
-        #ifdef BODS
-        MCUCR |= (1<<BODS) | (1<<BODSE);
-        MCUCR &= ~(1<<BODSE);
-        #endif
-        sleep_cpu();  // sleep here
+        //the running period goes on if what is left of it surely fits in the time left,
+        //otherwise it is restarted and the part slept before the last pin change is lost
+        if(wdtRunning && ((wdtPeriodUS > watchdogPeriod(maxPrescaler)) ||
+                          (!forever && ((wdtPeriodUS - wdtAwakeUS) / 1000 > ms))))
+            wdtRunning = false;
+        if(!wdtRunning){
+            if(!forever && (ms < watchdogPeriod(0) / 1000))
+                break;
+            //the longest period that fits in the time left
+            byte prescaler = 0;
+            while((prescaler < maxPrescaler) && (forever || (watchdogPeriod(prescaler + 1) / 1000 <= ms)))
+                prescaler++;
+            startWatchdog(prescaler);
+            wdtAwakeUS = 0;
+            wdtRunning = true;
+        }
+        //Let's sleep !
+        while(!wdtFired && keepSleeping){
+            noInterrupts();
+            if(!wdtFired && keepSleeping){
+                sleep_enable();
+                // turns BOD off, must be done right before sleep
+                #ifdef BODS
+                MCUCR |= (1<<BODS) | (1<<BODSE);
+                MCUCR &= ~(1<<BODSE);
+                #endif
+                //the instruction after sei is always executed, no interrupt can be lost
+                interrupts();
+                sleep_cpu();  // sleep here
+                sleep_disable();
+            }
+            interrupts();
+        }
+        if(wdtFired){
+            noInterrupts();
+            wdtFired = false;
+            unsigned long credit = wdtCreditUS;
+            interrupts();
+            if(!forever){
+                //a period resumed after a pin change also counts what was slept before it,
+                //which can only make the board wake up earlier
+                unsigned long slept = credit / 1000;
+                extraUS += credit % 1000;
+                if(extraUS >= 1000){
+                    slept++;
+                    extraUS -= 1000;
+                }
+                ms = (slept < ms) ? ms - slept : 0;
+            }
+        }
     }
 
     //Here we wake up
-    sleep_disable();
-
-    //deactivate watchdog
-    wdt_disable();
+    noInterrupts();
+    wdtSleeping = false;
+    //woken up by a pin, the period goes on: what has been slept of it is counted when it ends
+    //(in the ISR, or in the next sleep), otherwise nothing of the new period has been slept
+    if(keepSleeping || !wdtRunning){
+        wdt_disable();
+        wdtRunning = false;
+    }
+    else wdtAwakeStart = micros();
 
     //deactivate pins
     if(pinsN >0) for(int i=0; i< pinsN; i++){
         if((pins[i]>=0) && (pins[i]<=19)){
+            if(pins[i] <=7)
+                PCMSK2 &= ~(1 << pinToInt(pins[i]));
+            else if(pins[i] >=8 && pins[i] <=13)
+                PCMSK0 &= ~(1 << pinToInt(pins[i]));
+            else PCMSK1 &= ~(1 << pinToInt(pins[i]));
             PCICR &= ~(1 << pinToIE(pins[i]));
         }
     }
+    byte reason = keepSleeping ? WAKE_TIMER : WAKE_PIN;
+    interrupts();
+    accountRadioSleep(radioStatus);
 
 
 	//restore ADC
 	ADCSRA |= (1<<ADEN);  // adc on
+    //if the node reads the temperature and it will have to be read again, the reference
+    //starts settling while the node does its work after waking up
+    //nodes that never read it keep their reference, an external one on AREF would be shorted
+    if(cachedTempValid && (millis() + getTotalSleepMillis() - cachedTempTime >= ADC_FRESHNESS_MS))
+        selectADC(ADMUX_TEMP);
 
     power_all_enable();
+    return reason;
+}
+
+byte sleepUntil(int seconds, int pinsN, ...){
+    if(seconds == 0)
+        return 0;
+
+    int pins[pinsN > 0 ? pinsN : 1];
+    va_list list;
+    va_start(list, pinsN);
+    for(int i = 0; i<pinsN; i++){
+       pins[i] = va_arg(list, int);
+    }
+    va_end(list);
+
+    return sleepUntilPins(seconds > 0 ? (unsigned long)seconds * 1000 : 0, pinsN, pins);
+}
+
+byte sleepUntilMillis(unsigned long ms, int pinsN, ...){
+    if(ms < WDT_MIN_PERIOD_MS)
+        return 0;
+
+    int pins[pinsN > 0 ? pinsN : 1];
+    va_list list;
+    va_start(list, pinsN);
+    for(int i = 0; i<pinsN; i++){
+       pins[i] = va_arg(list, int);
+    }
+    va_end(list);
+
+    return sleepUntilPins(ms, pinsN, pins);
+}
+
+/** Gives the time spent by the radio in a state, MCU sleep included.
+ * @return the time in ms
+ */
+float radioStateTime(NRF24::NRF24PowerStatus status){
+    return (float)nRF24.getStateTime(status) + radioSleepMillis[status];
+}
+
+float getEstimatedCharge(){
+    accountRadioSleep(radioSleepStatus);
+    //charges in microamperes * milliseconds
+    float awake = (float)millis() * ENERGY_MCU_ACTIVE_UA;
+    float asleep = (float)getTotalSleepMillis() * ENERGY_SLEEP_UA;
+    float radio = radioStateTime(NRF24::NRF24PowerDown) * ENERGY_RADIO_DOWN_UA;
+    radio += radioStateTime(NRF24::NRF24PowerUpIdle) * ENERGY_RADIO_IDLE_UA;
+    radio += radioStateTime(NRF24::NRF24PowerUpRX) * ENERGY_RADIO_RX_UA;
+    //in TX mode the radio transmits only during the attempts, otherwise it waits
+    float txTime = radioStateTime(NRF24::NRF24PowerUpTX);
+    float txOnAir = (float)nRF24.getTxAttempts() * ENERGY_TX_ATTEMPT_US / 1000;
+    if(txOnAir > txTime) txOnAir = txTime;
+    radio += txOnAir * ENERGY_RADIO_TX_UA + (txTime - txOnAir) * ENERGY_RADIO_TX_IDLE_UA;
+    //1 mAh = 1000 uA * 3600000 ms
+    return (awake + asleep + radio) / 3.6e9;
 }
 
 
+float readADC(byte admux){
+    boolean changed = (ADMUX != admux);
+    selectADC(admux);
+    //the capacitor on AREF needs time when the reference changes
+    unsigned long settled = micros() - adcRefChanged;
+    if((admux & _BV(REFS1)) && (settled < ADC_REF_SETTLE_US)) delayMicroseconds(ADC_REF_SETTLE_US - settled);
+
+#ifdef PIOT_NO_ADC_ISR
+    //the sketch has the ADC interrupt, the conversions are polled
+    unsigned int sum = 0;
+    ADCSRA |= _BV(ADEN);
+    for(byte i = changed ? 0 : 1; i <= ADC_OVERSAMPLING; i++){
+        ADCSRA |= _BV(ADSC);
+        while(bit_is_set(ADCSRA, ADSC))
+            ;
+        if(i > 0) sum += ADCW;
+    }
+#else
+    noInterrupts();
+    adcSum = 0;
+    adcCount = 0;
+    //the first conversion after a change of input is not accurate
+    adcDiscard = changed;
+    ADCSRA |= _BV(ADEN) | _BV(ADIE);
+    interrupts();
+    while(adcCount < ADC_OVERSAMPLING){
+        noInterrupts();
+        if(!bit_is_set(ADCSRA, ADSC)) ADCSRA |= _BV(ADSC);
+        //the noise reduction mode stops the clocks of the serial port and of Timer0, it is used
+        //only when the last byte has been sent (TXC0 is cleared by each write) and nothing can
+        //be received
+        boolean serial = bit_is_set(UCSR0B, RXEN0) || bit_is_set(UCSR0B, UDRIE0) || !bit_is_set(UCSR0A, TXC0);
+        set_sleep_mode(serial ? SLEEP_MODE_IDLE : SLEEP_MODE_ADC);
+        sleep_enable();
+        //the instruction after sei is always executed, the ADC interrupt cannot be lost
+        interrupts();
+        //woken up by the ADC, or by other interrupts, in which case the conversion goes on
+        sleep_cpu();
+        sleep_disable();
+    }
+    ADCSRA &= ~_BV(ADIE);
+    unsigned int sum = adcSum;
+#endif
+    //the temperature reference settles again while the node does its work, if it is read next
+    if((admux != ADMUX_TEMP) && cachedTempValid && (millis() + getTotalSleepMillis() - cachedTempTime >= ADC_FRESHNESS_MS))
+        selectADC(ADMUX_TEMP);
+    return (float)sum / ADC_OVERSAMPLING;
+}
+
+float readAnalogOversampled(byte pin){
+    if(pin >= 14) pin -= 14;
+    return readADC(_BV(REFS0) | (pin & 0x07));
+}
+
 float getInternalVcc() {
-  long result;
-  // Read 1.1V reference against AVcc
-  ADMUX = _BV(REFS0) | _BV(MUX3) | _BV(MUX2) | _BV(MUX1);
-  delay(2);
-  ADCSRA |= _BV(ADSC);
-  while (bit_is_set(ADCSRA,ADSC));
-  result = ADCL;
-  result |= ADCH<<8;
-  result = 1126400L / result; // Back-calculate AVcc in mV
-  float retval = (float)result / 1000;
+  unsigned long now = millis() + getTotalSleepMillis();
+  if(cachedVccValid && (now - cachedVccTime < ADC_FRESHNESS_MS)) return cachedVcc;
+  float retval = 1126.4 / readADC(ADMUX_VCC); // Back-calculate AVcc in V
+  cachedVcc = retval;
+  cachedVccTime = now;
+  cachedVccValid = true;
+  if(isnan(calibrationVcc)) calibrationVcc = retval;
+  else if(fabs(retval - calibrationVcc) > WDT_CALIBRATION_VCC_DELTA) wdtCalibrationNeeded = true;
+  lastVcc = retval;
   return retval;
 }
 
 //From: http://playground.arduino.cc/Main/InternalTemperatureSensor
 float getInternalTemperature() {
-  ADMUX = (_BV(REFS1) | _BV(REFS0) | _BV(MUX3));
-  ADCSRA |= _BV(ADEN);
-  delay(20);
-  ADCSRA |= _BV(ADSC);
-  while (bit_is_set(ADCSRA,ADSC));
-  return ((float)ADCW * 0.9873) - 330.12;
+  unsigned long now = millis() + getTotalSleepMillis();
+  if(cachedTempValid && (now - cachedTempTime < ADC_FRESHNESS_MS)) return cachedTemp;
+  float retval = (readADC(ADMUX_TEMP) * 0.9873) - 330.12;
+  cachedTemp = retval;
+  cachedTempTime = now;
+  cachedTempValid = true;
+  if(isnan(calibrationTemp)) calibrationTemp = retval;
+  else if(fabs(retval - calibrationTemp) > WDT_CALIBRATION_TEMP_DELTA) wdtCalibrationNeeded = true;
+  lastTemp = retval;
+  return retval;
 }
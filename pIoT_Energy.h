@@ -15,6 +15,44 @@
 #include <pins_arduino.h>
 #endif
 
+#include <nRF24.h>
+
+
+//Shortest period of the watchdog, in ms, and largest prescaler (8s)
+#define WDT_MIN_PERIOD_MS 16
+#define WDT_MAX_PRESCALER 9
+
+//Largest prescaler used when pins can wake the board up (1s), the time slept in the period
+//interrupted by a pin is counted when the period ends
+//Can be pre-defined prior to including this header
+#ifndef WDT_PIN_MAX_PRESCALER
+#define WDT_PIN_MAX_PRESCALER 6
+#endif
+
+//Reasons of a wake up, returned by sleepUntil()
+//the time has passed
+#define WAKE_TIMER 0x01
+//a pin has changed, see getWakePins()
+#define WAKE_PIN 0x02
+
+//Prescaler of the watchdog used for calibration, 128ms
+#define WDT_CALIBRATION_PRESCALER 3
+
+//Seconds of operation after which the watchdog is calibrated again
+//Can be pre-defined prior to including this header
+#ifndef WDT_CALIBRATION_PERIOD_S
+#define WDT_CALIBRATION_PERIOD_S 3600
+#endif
+
+//Changes of Vcc (V) and temperature (C), as read by getInternalVcc() and
+//getInternalTemperature(), after which the watchdog is calibrated again
+//Can be pre-defined prior to including this header
+#ifndef WDT_CALIBRATION_VCC_DELTA
+#define WDT_CALIBRATION_VCC_DELTA 0.1
+#endif
+#ifndef WDT_CALIBRATION_TEMP_DELTA
+#define WDT_CALIBRATION_TEMP_DELTA 5
+#endif
 
 /** Resets the MCU.
  */
@@ -32,23 +70,160 @@ void powerDownAllPins();
  * a number <1 means don't care, sleep until someone else wakes it up
  * @param pinsN the number of pins, if <=0 the pins arenot considered
  * @param ... a set of pins to be considered if any
+ * @return why the board woke up, WAKE_TIMER or WAKE_PIN (see getWakePins()), 0 if it did not sleep
  */
-void sleepUntil(int seconds, int pinsN, ...);
+byte sleepUntil(int seconds, int pinsN, ...);
+
+/** Put the MCU into sleep mode until either a certain time has passed or a pin has changed.
+ * Like sleepUntil(), but with the time in milliseconds.
+ * The watchdog runs with periods of 16ms * 2^n, up to 8s, or up to 16ms * 2^WDT_PIN_MAX_PRESCALER
+ * if pins are watched, the longest that fit in the time left are used, so the time slept
+ * is rounded down to a multiple of 16ms.
+ * When a pin wakes the board up the watchdog keeps running, the next sleep goes on with
+ * the same period if it ends in time, in which case the board may wake up earlier,
+ * by up to what was slept of the period before the pin changed.
+ * @param ms the number of milliseconds after which we want the board to wakeup,
+ * less than 16 means don't sleep at all
+ * @param pinsN the number of pins, if <=0 the pins are not considered
+ * @param ... a set of pins to be considered if any
+ * @return why the board woke up, WAKE_TIMER or WAKE_PIN (see getWakePins()), 0 if it did not sleep
+ */
+byte sleepUntilMillis(unsigned long ms, int pinsN, ...);
+
+/** Like sleepUntilMillis(), but with the pins in an array.
+ * @param ms the number of milliseconds after which we want the board to wakeup,
+ * 0 means sleep until a pin changes
+ * @param pinsN the number of pins, if <=0 the pins are not considered
+ * @param pins the pins
+ * @return why the board woke up, WAKE_TIMER or WAKE_PIN (see getWakePins())
+ */
+byte sleepUntilPins(unsigned long ms, int pinsN, int* pins);
+
+/** Tells which pins woke the board up from the last sleep.
+ * Pins that changed and changed back before the MCU woke up are not reported.
+ * @return a mask where bit n is set if the pin n changed, pins A0-A5 are 14-19
+ */
+unsigned long getWakePins();
+
+/** Measures the period of the watchdog oscillator against the main clock.
+ * The watchdog drifts by up to 10% with voltage and temperature, its measured
+ * period is used to count the time slept and to choose the periods when sleeping.
+ * It takes about 130ms. It is called automatically before sleeping the first time,
+ * every WDT_CALIBRATION_PERIOD_S and when getInternalVcc() or getInternalTemperature()
+ * see a change larger than WDT_CALIBRATION_VCC_DELTA or WDT_CALIBRATION_TEMP_DELTA.
+ * @return false if the measure is not plausible, in which case the previous one is kept
+ */
+boolean calibrateWatchdog();
 
 /** Gives the number of seconds the Sensorino has been sleeping since it has been switched on
  * @return the total number of seconds it has slept
  */
 unsigned long getTotalSleepSeconds();
 
+/** Gives the number of milliseconds the board has been sleeping since it has been switched on.
+ * When a pin wakes the board up, the time slept in the last watchdog period is counted when
+ * the period ends, at most 16ms * 2^WDT_PIN_MAX_PRESCALER later. It is lost if the next
+ * sleep has to restart the watchdog, or if the watchdog is calibrated, before that.
+ * @return the total number of milliseconds it has slept
+ */
+unsigned long getTotalSleepMillis();
+
+//Currents used to estimate the charge, in microamperes
+//Can be pre-defined prior to including this header
+//MCU running
+#ifndef ENERGY_MCU_ACTIVE_UA
+#define ENERGY_MCU_ACTIVE_UA 5000
+#endif
+//MCU sleeping, watchdog on, the radio is counted apart
+#ifndef ENERGY_SLEEP_UA
+#define ENERGY_SLEEP_UA 4
+#endif
+//radio powered down
+#ifndef ENERGY_RADIO_DOWN_UA
+#define ENERGY_RADIO_DOWN_UA 1
+#endif
+//radio powered up and idle (standby-I)
+#ifndef ENERGY_RADIO_IDLE_UA
+#define ENERGY_RADIO_IDLE_UA 26
+#endif
+//radio receiving
+#ifndef ENERGY_RADIO_RX_UA
+#define ENERGY_RADIO_RX_UA 13500
+#endif
+//radio in TX mode waiting for packets (standby-II)
+#ifndef ENERGY_RADIO_TX_IDLE_UA
+#define ENERGY_RADIO_TX_IDLE_UA 320
+#endif
+//radio transmitting, at 0dBm
+#ifndef ENERGY_RADIO_TX_UA
+#define ENERGY_RADIO_TX_UA 11300
+#endif
+//duration of a transmission attempt, settling, packet and wait for the ack, in microseconds
+#ifndef ENERGY_TX_ATTEMPT_US
+#define ENERGY_TX_ATTEMPT_US 400
+#endif
+
+/** Estimates the charge used since the board has been switched on.
+ * The time spent by the MCU running and sleeping, and by the radio in each of its states,
+ * sleep included (e.g. the radio left receiving while the MCU sleeps), is multiplied by the currents defined above (ENERGY_*_UA), which can be tuned
+ * on the actual hardware.
+ * @return the charge in milliampere-hours
+ */
+float getEstimatedCharge();
+
+//Number of samples averaged by readADC(), up to 64
+//Can be pre-defined prior to including this header
+#ifndef ADC_OVERSAMPLING
+#define ADC_OVERSAMPLING 8
+#endif
+
+//Milliseconds, sleep included, during which Vcc and temperature are not read again
+//Can be pre-defined prior to including this header
+#ifndef ADC_FRESHNESS_MS
+#define ADC_FRESHNESS_MS 60000
+#endif
+
+//Microseconds needed by the ADC reference to settle after being changed
+//Can be pre-defined prior to including this header
+#ifndef ADC_REF_SETTLE_US
+#define ADC_REF_SETTLE_US 20000
+#endif
+
+//The ADC interrupt is used by readADC(), sketches with their own ISR(ADC_vect) would not link:
+//they define PIOT_NO_ADC_ISR, in the compiler flags as the library is compiled apart,
+//and readADC() then polls the conversions with the MCU awake
+
+/** Reads the ADC, averaging ADC_OVERSAMPLING samples.
+ * Conversions are done with the MCU sleeping in ADC noise reduction mode and end with
+ * the ADC interrupt. The mode stops the serial port and Timer0, so the MCU only idles if
+ * the serial port is sending or can receive (Serial.end() allows noise reduction).
+ * The first conversion after a change of input is discarded.
+ * If the temperature is due to be read again, its reference is selected afterwards,
+ * so reading it last gives it time to settle.
+ * @param admux the value of the ADMUX register, which selects reference and input
+ * @return the average of the samples, 0 to 1023, with decimals
+ */
+float readADC(byte admux);
+
+/** Reads an analog pin against AVcc, like analogRead() but oversampled and with less noise.
+ * @param pin the pin, 0 to 7 or A0 to A7
+ * @return the average of the samples, 0 to 1023, with decimals
+ */
+float readAnalogOversampled(byte pin);
+
 /** Retrieves the value of the alimentation voltage
  * this value i scomputed against an internal reference
- * and might be unprecise
+ * and might be unprecise.
+ * The value is read again only after ADC_FRESHNESS_MS.
  * @return the value in volts
  */
 float getInternalVcc();
 
 /** Gives the internal temperature in chip.
- * The value has an uncertainty of 10 degrees
+ * The value has an uncertainty of 10 degrees.
+ * The value is read again only after ADC_FRESHNESS_MS, when the board wakes up and the
+ * value is old the reference is selected, so that it settles while the node does its work:
+ * read it after the other values (see readADC())
  * @return the temperature in Celsius
  */
 float getInternalTemperature() ;
@@ -0,0 +1,57 @@
+/** Headers of the packets of the pIoT protocol.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#include <pIoT_Header.h>
+
+byte writeVarint(unsigned int value, byte* buf){
+    byte n = 0;
+    while(value >= 0x80){
+        buf[n++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buf[n++] = value;
+    return n;
+}
+
+byte readVarint(const byte* buf, int len, unsigned int* value){
+    unsigned int v = 0;
+    for(byte n=0; (n < len) && (n < VARINT_MAX_LEN); n++){
+        v |= (unsigned int)(buf[n] & 0x7F) << (7 * n);
+        if(!(buf[n] & 0x80)){
+            *value = v;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+int packHeader(boolean compact, byte nodeId, const byte* address, unsigned int msgType, byte* pkt){
+    if(compact){
+        pkt[0] = nodeId;
+        return 1 + writeVarint(msgType, pkt + 1);
+    }
+    pkt[0] = address[0];
+    pkt[1] = address[1];
+    pkt[2] = address[2];
+    pkt[3] = address[3];
+    pkt[4] = msgType & 0xFF;
+    pkt[5] = (msgType >> 8) & 0xFF;
+    return FULL_HEADER_LEN;
+}
+
+int parseHeader(boolean compact, const byte* pkt, int len, byte* nodeId, long* sender, unsigned int* msgType){
+    if(compact){
+        if(len < 1) return 0;
+        byte typelen = readVarint(pkt + 1, len - 1, msgType);
+        if(typelen == 0) return 0;
+        *nodeId = pkt[0];
+        return 1 + typelen;
+    }
+    if(len < FULL_HEADER_LEN) return 0;
+    *sender = (long)pkt[0] + ((long)pkt[1] << 8) + ((long)pkt[2] << 16) + ((long)pkt[3] << 24);
+    *msgType = (unsigned int)(pkt[5] << 8) + (unsigned int)pkt[4];
+    return FULL_HEADER_LEN;
+}
@@ -0,0 +1,72 @@
+/** Headers of the packets of the pIoT protocol.
+ * The full header is the address of the sender (4 bytes) and the message type (2 bytes),
+ * both little endian, the compact header is the 1 byte identifier assigned to the sender
+ * by the base and the message type as varint.
+ * The encoding does not depend on Arduino, this file and pIoT_Header.cpp can be compiled
+ * on a host as well.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#ifndef pIoT_HEADER_H_INCLUDED
+#define pIoT_HEADER_H_INCLUDED
+
+#ifdef ARDUINO
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <wiring.h>
+#include <pins_arduino.h>
+#endif
+#else
+#include <stdint.h>
+typedef bool boolean;
+typedef uint8_t byte;
+#endif
+
+//Length of the full header
+#define FULL_HEADER_LEN 6
+
+//Maximum length of a varint, and of the compact header
+#define VARINT_MAX_LEN 3
+#define COMPACT_HEADER_MAX_LEN (1 + VARINT_MAX_LEN)
+
+/** Writes an unsigned value as a varint: 7 bits per byte, least significant first,
+ * the top bit set on all bytes but the last.
+ * @param value the value
+ * @param buf where the varint is written, VARINT_MAX_LEN bytes are enough
+ * @return the number of bytes written, at most VARINT_MAX_LEN
+ */
+byte writeVarint(unsigned int value, byte* buf);
+
+/** Reads a varint written by writeVarint().
+ * @param buf the buffer
+ * @param len the bytes available in the buffer
+ * @param value where the value is stored
+ * @return the number of bytes read, 0 if the varint is not valid
+ */
+byte readVarint(const byte* buf, int len, unsigned int* value);
+
+/** Writes the header of a packet.
+ * @param compact true for the compact header
+ * @param nodeId the identifier of the sender, for the compact header
+ * @param address the 4 bytes of the address of the sender, least significant first, for the full header
+ * @param msgType the message type
+ * @param pkt where the header is written, COMPACT_HEADER_MAX_LEN or FULL_HEADER_LEN bytes
+ * @return the length of the header
+ */
+int packHeader(boolean compact, byte nodeId, const byte* address, unsigned int msgType, byte* pkt);
+
+/** Reads the header of a packet.
+ * @param compact true if the packet has the compact header
+ * @param pkt the packet
+ * @param len the length of the packet
+ * @param nodeId where the identifier of the sender is stored, for the compact header
+ * @param sender where the address of the sender is stored, for the full header
+ * @param msgType where the message type is stored
+ * @return the length of the header, 0 if the packet is too short or the header not valid
+ */
+int parseHeader(boolean compact, const byte* pkt, int len, byte* nodeId, long* sender, unsigned int* msgType);
+
+#endif // pIoT_HEADER_H_INCLUDED
@@ -12,8 +12,6 @@ extern "C"
 
 #include <pIoT_JSON.h>
 
-#define JSON_STRING_BUFFER_LEN 150
-
 void JSONtoStringArray(char* line, char** arr, int* len) {
     *len = 0;
     if(line == NULL) return;
@@ -45,14 +43,31 @@ void JSONtoStringArray(char* line, char** arr, int* len) {
 
 char* JSONsearchDataName(char* line, char* dataname)
 {
-    char* dataptr = strstr(line, dataname);
-    char* ptr = dataptr + strlen(dataname);
-			
-    for(int i=0; i<strlen(dataptr); i++) {
-        ptr += i;
-        if(*ptr == ':') {
-            return ptr+1;
+    int len = strlen(dataname);
+    char* ptr = line;
+    while((ptr = strstr(ptr, dataname)) != NULL) {
+        //only names between quotes, not parts of other names or values
+        if((ptr > line) && (ptr[-1] == '"') && (ptr[len] == '"')) {
+            ptr += len + 1;
+            while(*ptr == ' ') ptr++;
+            if(*ptr == ':') return ptr+1;
+        }
+        else ptr++;
+    }
+    return NULL;
+}
+
+char* JSONsearchDataName_P(char* line, PGM_P dataname)
+{
+    int len = strlen_P(dataname);
+    char* ptr = line;
+    while((ptr = strstr_P(ptr, dataname)) != NULL) {
+        if((ptr > line) && (ptr[-1] == '"') && (ptr[len] == '"')) {
+            ptr += len + 1;
+            while(*ptr == ' ') ptr++;
+            if(*ptr == ':') return ptr+1;
         }
+        else ptr++;
     }
     return NULL;
 }
@@ -97,72 +112,392 @@ boolean JSONtoBoolean(char* line, char* dataName) {
     return false;
 }
 
-static char buffer[JSON_STRING_BUFFER_LEN];
-static int buffPtr = 0;
-static int level =0;
-static boolean inQuotes = false;
+/** Adds an entry to the index.
+ * @return the position of the entry, -1 if the index is full
+ */
+static int JSONaddEntry(JSONIndex* index, char* key, byte keyLen, char* value, int valueLen, byte type, byte depth)
+{
+    if(index->count == JSON_INDEX_LEN) return -1;
+    JSONEntry* e = &index->entries[index->count];
+    e->key = key;
+    e->keyLen = keyLen;
+    e->value = value;
+    e->valueLen = valueLen;
+    e->type = type;
+    e->depth = depth;
+    return index->count++;
+}
 
-static char firstWordBuff[20];
-static int firstWordBuffPtr = 0;
-static boolean inFirstWord = false;
+boolean JSONindex(char* line, JSONIndex* index)
+{
+    index->count = 0;
+    //entry of each open object or array, -1 if it has no name
+    int open[JSON_MAX_DEPTH];
+    boolean inArray[JSON_MAX_DEPTH];
+    byte depth = 0;
+    boolean complete = true;
+    char* key = NULL;
+    byte keyLen = 0;
+    char* ptr = line;
 
-void readSerial(int mis, void (*f)(char* dataName, char* msg)) {
-    long now=  millis();
-
-    while ((millis()-now < mis) || (Serial.available() >0)){
-        if(!Serial.available()) continue;
-        char b = Serial.read();
-        if(b=='"'){
-            if(inQuotes)  //not in quote anymore
-            {
-                inQuotes = false;
-                inFirstWord = false;
+    while(*ptr != '\0') {
+        char c = *ptr;
+        if(c == '"') {
+            char* start = ++ptr;
+            while((*ptr != '"') && (*ptr != '\0')) {
+                if((*ptr == '\\') && (ptr[1] != '\0')) ptr++;
+                ptr++;
             }
-            else     //in quote
-            {
-                inQuotes = true;
-                if(firstWordBuffPtr == 0){
-                    inFirstWord = true;
-                }
+            if(*ptr == '\0') return false;
+            int len = ptr - start;
+            ptr++;
+            char* next = ptr;
+            while(isspace(*next)) next++;
+            if((key == NULL) && (depth > 0) && !inArray[depth-1] && (*next == ':')) {
+                key = start;
+                keyLen = len;
+                ptr = next + 1;
+                continue;
             }
+            if(key != NULL) {
+                if(JSONaddEntry(index, key, keyLen, start, len, JSONString, depth) < 0) complete = false;
+                key = NULL;
+            }
+            continue;
         }
-        if(b=='{'){
-            level++;
+        if((c == '{') || (c == '[')) {
+            if(depth == JSON_MAX_DEPTH) return false;
+            open[depth] = -1;
+            if(key != NULL) {
+                open[depth] = JSONaddEntry(index, key, keyLen, ptr, 0, (c == '{')? JSONObject : JSONArray, depth);
+                if(open[depth] < 0) complete = false;
+                key = NULL;
+            }
+            inArray[depth] = (c == '[');
+            depth++;
+            ptr++;
+            continue;
         }
-
-        if((level>0) && ((inQuotes) || ((b!=' ')&&(b!='\n')&&(b!='\r')&&(b!='\t')))){
-            buffer[buffPtr] = b;
-            buffPtr++;
-            if(inFirstWord)  //Fill the first word buffer
-            {
-                firstWordBuff[firstWordBuffPtr] = b;
-                firstWordBuffPtr++;
+        if((c == '}') || (c == ']')) {
+            if(depth == 0) return false;
+            depth--;
+            if(open[depth] >= 0) {
+                JSONEntry* e = &index->entries[open[depth]];
+                e->valueLen = ptr - e->value + 1;
             }
+            ptr++;
+            if(depth == 0) return complete;
+            continue;
+        }
+        if((key != NULL) && !isspace(c) && (c != ',')) {
+            //number, boolean or null, until the next separator
+            char* start = ptr;
+            while((*ptr != '\0') && (*ptr != ',') && (*ptr != '}') && (*ptr != ']') && !isspace(*ptr))
+                ptr++;
+            char first = toupper(*start);
+            byte type = ((first == 'T') || (first == 'F'))? JSONBoolean : ((first == 'N')? JSONNull : JSONNumber);
+            if(JSONaddEntry(index, key, keyLen, start, ptr - start, type, depth) < 0) complete = false;
+            key = NULL;
+            continue;
         }
+        ptr++;
+    }
+    return false;
+}
 
-        if(b=='}'){
-            if(level == 1){
-			
-                //The message is complete, use it
-                char msg[buffPtr+1];
-                for(int i=0; i<buffPtr; i++)
-                    msg[i] = buffer[i];
-                msg[buffPtr] = '\0';
-
-                char firstword[firstWordBuffPtr];
-                for(int i=0; i<firstWordBuffPtr-1; i++)
-                    firstword[i] = firstWordBuff[i+1];
-                firstword[firstWordBuffPtr-1] = '\0';
-
-                //reset buffers
-                buffPtr = 0;
-                firstWordBuffPtr = 0;
-
-                f(firstword, msg);
-            }
-			level--;
+JSONEntry* JSONfind(JSONIndex* index, char* dataName)
+{
+    int len = strlen(dataName);
+    for(int i=0; i<index->count; i++) {
+        JSONEntry* e = &index->entries[i];
+        if((e->keyLen == len) && (strncmp(e->key, dataName, len) == 0))
+            return e;
+    }
+    return NULL;
+}
+
+JSONEntry* JSONfind_P(JSONIndex* index, PGM_P dataName)
+{
+    int len = strlen_P(dataName);
+    for(int i=0; i<index->count; i++) {
+        JSONEntry* e = &index->entries[i];
+        if((e->keyLen == len) && (strncmp_P(e->key, dataName, len) == 0))
+            return e;
+    }
+    return NULL;
+}
+
+unsigned long JSONindexToULong(JSONIndex* index, char* dataName)
+{
+    JSONEntry* e = JSONfind(index, dataName);
+    if(e != NULL) return strtoul(e->value, NULL, 10);
+    return 0;
+}
+
+long JSONindexToLong(JSONIndex* index, char* dataName)
+{
+    JSONEntry* e = JSONfind(index, dataName);
+    if(e != NULL) return strtol(e->value, NULL, 10);
+    return 0;
+}
+
+double JSONindexToDouble(JSONIndex* index, char* dataName)
+{
+    JSONEntry* e = JSONfind(index, dataName);
+    if(e != NULL) return strtod(e->value, NULL);
+    return 0;
+}
+
+boolean JSONindexToBoolean(JSONIndex* index, char* dataName)
+{
+    JSONEntry* e = JSONfind(index, dataName);
+    return (e != NULL) && (e->type == JSONBoolean) && (toupper(e->value[0]) == 'T');
+}
+
+void JSONframerReset(JSONFramer* framer)
+{
+    framer->len = 0;
+    framer->level = 0;
+    framer->inQuotes = false;
+    framer->escape = false;
+    framer->overflow = false;
+    framer->complete = false;
+    framer->nameLen = 0;
+    framer->nameState = 0;
+    framer->buffer[0] = '\0';
+    framer->name[0] = '\0';
+}
+
+boolean JSONframerFeed(JSONFramer* framer, char b)
+{
+    //the previous message has been used
+    if(framer->complete) JSONframerReset(framer);
+
+    if(framer->level == 0) {
+        //outside messages only the start matters
+        if(b != '{') return false;
+        framer->len = 0;
+        framer->overflow = false;
+        framer->nameLen = 0;
+        framer->nameState = 0;
+    }
+    else if(b == '\0') {
+        //noise on the line, the message could not be used as a string: dropped as a too long one
+        framer->overflow = true;
+        return false;
+    }
+    else if(framer->inQuotes) {
+        if(framer->escape) framer->escape = false;
+        else if(b == '\\') framer->escape = true;
+        else if(b == '"') {
+            framer->inQuotes = false;
+            if(framer->nameState == 1) framer->nameState = 2;
+        }
+        else if((framer->nameState == 1) && (framer->nameLen < JSON_NAME_LEN - 1))
+            framer->name[framer->nameLen++] = b;
+    }
+    else if(b == '"') {
+        framer->inQuotes = true;
+        //the first string of the message is its name
+        if((framer->nameState == 0) && (framer->level == 1)) framer->nameState = 1;
+    }
+    else if((b == ' ') || (b == '\n') || (b == '\r') || (b == '\t')) return false;
+
+    if(!framer->inQuotes) {
+        if(b == '{') framer->level++;
+        else if(b == '}') framer->level--;
+    }
+
+    if(framer->len < JSON_FRAME_LEN) framer->buffer[framer->len++] = b;
+    else framer->overflow = true;
+
+    if((framer->level == 0) && (b == '}')) {
+        //too long messages are dropped
+        if(framer->overflow) return false;
+        framer->buffer[framer->len] = '\0';
+        framer->name[framer->nameLen] = '\0';
+        framer->complete = true;
+        return true;
+    }
+    return false;
+}
+
+int JSONframerWrite(JSONFramer* framer, char* data, int len)
+{
+    for(int i=0; i<len; i++) {
+        if(JSONframerFeed(framer, data[i])) return i+1;
+    }
+    return len;
+}
+
+void JSONwriterInit(JSONWriter* writer, char* buffer, int size)
+{
+    writer->buffer = buffer;
+    writer->size = size;
+    writer->len = 0;
+    writer->overflow = false;
+    writer->needComma = false;
+    if(size > 0) buffer[0] = '\0';
+}
+
+static void JSONputChar(JSONWriter* writer, char c)
+{
+    if(writer->len < writer->size - 1) {
+        writer->buffer[writer->len++] = c;
+        writer->buffer[writer->len] = '\0';
+    }
+    else writer->overflow = true;
+}
+
+static void JSONputString_P(JSONWriter* writer, PGM_P s)
+{
+    char c;
+    while((c = pgm_read_byte(s++)) != '\0')
+        JSONputChar(writer, c);
+}
+
+static void JSONputULong(JSONWriter* writer, unsigned long value)
+{
+    char digits[10];
+    byte n = 0;
+    do {
+        digits[n++] = '0' + (value % 10);
+        value /= 10;
+    } while(value > 0);
+    while(n > 0)
+        JSONputChar(writer, digits[--n]);
+}
+
+//Writes the comma, if needed, and the name
+static void JSONputName(JSONWriter* writer, PGM_P name)
+{
+    if(writer->needComma) JSONputChar(writer, ',');
+    writer->needComma = true;
+    if(name == NULL) return;
+    JSONputChar(writer, '"');
+    JSONputString_P(writer, name);
+    JSONputChar(writer, '"');
+    JSONputChar(writer, ':');
+}
+
+void JSONwriteObjectStart(JSONWriter* writer, PGM_P name)
+{
+    JSONputName(writer, name);
+    JSONputChar(writer, '{');
+    writer->needComma = false;
+}
+
+void JSONwriteObjectEnd(JSONWriter* writer)
+{
+    JSONputChar(writer, '}');
+    writer->needComma = true;
+}
+
+void JSONwriteLong(JSONWriter* writer, PGM_P name, long value)
+{
+    JSONputName(writer, name);
+    if(value < 0) {
+        JSONputChar(writer, '-');
+        JSONputULong(writer, 0UL - (unsigned long)value);
+    }
+    else JSONputULong(writer, value);
+}
+
+void JSONwriteULong(JSONWriter* writer, PGM_P name, unsigned long value)
+{
+    JSONputName(writer, name);
+    JSONputULong(writer, value);
+}
+
+void JSONwriteDouble(JSONWriter* writer, PGM_P name, double value, byte decimals)
+{
+    JSONputName(writer, name);
+    if(decimals > 6) decimals = 6;
+    unsigned long scale = 1;
+    for(byte i=0; i<decimals; i++) scale *= 10;
+    if(value < 0) {
+        JSONputChar(writer, '-');
+        value = -value;
+    }
+    //also false for NaN
+    if(!(value * scale < 4294967040.0)) {
+        if(writer->len > 0 && writer->buffer[writer->len-1] == '-') writer->len--;
+        JSONputString_P(writer, PSTR("null"));
+        return;
+    }
+    unsigned long fixed = (unsigned long)(value * scale + 0.5);
+    JSONputULong(writer, fixed / scale);
+    if(decimals == 0) return;
+    JSONputChar(writer, '.');
+    unsigned long frac = fixed % scale;
+    for(unsigned long d = scale / 10; d > 0; d /= 10) {
+        JSONputChar(writer, '0' + (frac / d));
+        frac %= d;
+    }
+}
+
+void JSONwriteBoolean(JSONWriter* writer, PGM_P name, boolean value)
+{
+    JSONputName(writer, name);
+    JSONputString_P(writer, value? PSTR("TRUE") : PSTR("FALSE"));
+}
+
+void JSONwriteString(JSONWriter* writer, PGM_P name, const char* value)
+{
+    JSONputName(writer, name);
+    JSONputChar(writer, '"');
+    for(; *value != '\0'; value++) {
+        char c = *value;
+        if((c == '"') || (c == '\\')) {
+            JSONputChar(writer, '\\');
+            JSONputChar(writer, c);
+        }
+        else if((byte)c < 0x20) {
+            //control characters as \u00XX
+            JSONputString_P(writer, PSTR("\\u00"));
+            JSONputChar(writer, "0123456789abcdef"[(c >> 4) & 0x0F]);
+            JSONputChar(writer, "0123456789abcdef"[c & 0x0F]);
         }
+        else JSONputChar(writer, c);
     }
+    JSONputChar(writer, '"');
 }
 
+static unsigned long jsonOverflows = 0;
 
+boolean JSONwriteLine(JSONWriter* writer, Print& out)
+{
+    JSONputChar(writer, '\r');
+    JSONputChar(writer, '\n');
+    if(writer->overflow) {
+        jsonOverflows++;
+        return false;
+    }
+    out.write((const uint8_t*)writer->buffer, writer->len);
+    return true;
+}
+
+unsigned long getJSONOverflowCounter()
+{
+    return jsonOverflows;
+}
+
+#ifdef ARDUINO
+
+static JSONFramer serialFramer;
+
+void readSerial(int mis, void (*f)(char* dataName, char* msg)) {
+    unsigned long start = millis();
+
+    while(true) {
+        if(Serial.available() > 0) {
+            if(JSONframerFeed(&serialFramer, Serial.read())) {
+                f(serialFramer.name, serialFramer.buffer);
+                return;
+            }
+        }
+        else if(millis() - start >= (unsigned long)mis) return;
+    }
+}
+
+#endif
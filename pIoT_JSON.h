@@ -1,18 +1,116 @@
 /** Trivial JSON messages parser for pIoT base.
  * The name of the first object identifies the type of message.
  *  A common fields is "address".
+ * Apart from readSerial(), it does not depend on Arduino and can be compiled on a host.
  *
  * Author: Dario Salvi (dariosalvi78 at gmail dot com)
  *
  * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
  */
 
+#ifndef pIoT_JSON_H_INCLUDED
+#define pIoT_JSON_H_INCLUDED
+
+#ifdef ARDUINO
 #if ARDUINO >= 100
 #include <Arduino.h>
 #else
 #include <wiring.h>
 #include <pins_arduino.h>
 #endif
+#else
+//On the server side, and in the host tests, strings in flash are plain strings
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+typedef bool boolean;
+typedef uint8_t byte;
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define strlen_P strlen
+#define strstr_P strstr
+#define strncmp_P strncmp
+#define strcasecmp_P strcasecmp
+
+/** Output of JSONwriteLine(), as the Print class of Arduino.
+ */
+class Print {
+public:
+    virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+};
+#endif
+
+//Maximum number of entries in a JSON index
+//Can be pre-defined prior to including this header
+#ifndef JSON_INDEX_LEN
+#define JSON_INDEX_LEN 12
+#endif
+
+//Maximum nesting of objects and arrays in an indexed JSON string
+#define JSON_MAX_DEPTH 6
+
+/** Types of the values in a JSON index.
+ */
+enum JSONType {JSONNull, JSONBoolean, JSONNumber, JSONString, JSONObject, JSONArray};
+
+/** A named value found in a JSON string.
+ * Key and value point into the string, strings are without quotes,
+ * objects and arrays include their brackets.
+ */
+typedef struct {
+    char* key;
+    byte keyLen;
+    char* value;
+    int valueLen;
+    byte type;
+    byte depth;
+} JSONEntry;
+
+/** Index of the named values of a JSON string, built in one pass by JSONindex().
+ */
+typedef struct {
+    JSONEntry entries[JSON_INDEX_LEN];
+    byte count;
+} JSONIndex;
+
+/** Builds the index of the named values of a JSON object, in a single pass.
+ * Unnamed values, as the elements of arrays, are not indexed. The string is not modified.
+ * @param line the JSON string, starting with the object
+ * @param index the index to fill
+ * @return true if the object is complete and all its values are in the index
+ */
+boolean JSONindex(char* line, JSONIndex* index);
+
+/** Finds a value in an index, given its name.
+ * @param index the index built by JSONindex()
+ * @param dataName the name of the value, without quotes
+ * @return the first entry with that name, NULL if not found
+ */
+JSONEntry* JSONfind(JSONIndex* index, char* dataName);
+
+/** As JSONfind(), with the name in flash (PSTR).
+ */
+JSONEntry* JSONfind_P(JSONIndex* index, PGM_P dataName);
+
+/** Converts an indexed value to an unsigned long, 0 if not found.
+ */
+unsigned long JSONindexToULong(JSONIndex* index, char* dataName);
+
+/** Converts an indexed value to a long, 0 if not found.
+ */
+long JSONindexToLong(JSONIndex* index, char* dataName);
+
+/** Converts an indexed value to a double, 0 if not found.
+ */
+double JSONindexToDouble(JSONIndex* index, char* dataName);
+
+/** Converts an indexed value to a boolean, false if not found.
+ */
+boolean JSONindexToBoolean(JSONIndex* index, char* dataName);
 
 /** Separates an array into an array of strings.
  * @param line a pointer to the line to be analysed
@@ -29,6 +127,14 @@ void JSONtoStringArray(char* line, char** arr, int* len);
  */
 char* JSONsearchDataName(char* line, char* dataname);
 
+/** Looks for the start of a data, given its name stored in flash (PSTR).
+ * Only matches the name between quotes.
+ * @param line the line where to look into
+ * @param dataname the name of the data without the ".." and :, in flash
+ * @return the pointer where the data starts (after the :), NULL if not found
+ */
+char* JSONsearchDataName_P(char* line, PGM_P dataname);
+
 /** Converts a JSON property to a unsigned long.
  * @param line the line that contains the property
  * @param dataName the property to be parsed, should not include the \"...\":
@@ -57,14 +163,137 @@ double JSONtoDouble(char* line, char* dataName);
  */
 boolean JSONtoBoolean(char* line, char* dataName);
 
+//Maximum length of a JSON message read from the serial port, longer messages are dropped
+//Can be pre-defined prior to including this header
+#ifndef JSON_FRAME_LEN
+#define JSON_FRAME_LEN 150
+#endif
+
+//Maximum length of the name of a JSON message, including the terminator, longer names are truncated
+#define JSON_NAME_LEN 20
+
+/** Incremental reader of JSON messages from a stream of bytes.
+ * Spaces, tabs and new lines outside strings are removed, bytes outside messages are ignored.
+ */
+typedef struct {
+    char buffer[JSON_FRAME_LEN + 1];
+    char name[JSON_NAME_LEN];
+    int len;
+    int level;
+    boolean inQuotes;
+    boolean escape;
+    boolean overflow;
+    boolean complete;
+    byte nameLen;
+    byte nameState; //0 name not found yet, 1 reading it, 2 read
+} JSONFramer;
+
+/** Empties a framer, must be called before using it.
+ */
+void JSONframerReset(JSONFramer* framer);
+
+/** Feeds a byte to a framer.
+ * When a message is complete its string is in buffer, and the name of its first object in name,
+ * both are valid until the next byte is fed.
+ * Messages longer than JSON_FRAME_LEN, or with zeros, are dropped.
+ * @param framer the framer
+ * @param b the byte
+ * @return true if the byte completes a message
+ */
+boolean JSONframerFeed(JSONFramer* framer, char b);
+
+/** Feeds a chunk of bytes to a framer, stopping when a message is complete.
+ * @param framer the framer
+ * @param data the bytes
+ * @param len the number of bytes
+ * @return the number of bytes used, up to the end of the message if one is complete (check framer->complete)
+ */
+int JSONframerWrite(JSONFramer* framer, char* data, int len);
+
+//Size of the buffer used to print JSON lines that are not messages, such as errors
+//(messages declared with PIOT_MESSAGE() size their own)
+//Can be pre-defined prior to including this header
+#ifndef JSON_WRITER_LEN
+#define JSON_WRITER_LEN 150
+#endif
+
+/** Writer of JSON strings into a buffer given by the caller, without allocations.
+ * Names are strings in flash (PSTR), objects are opened and closed by the caller,
+ * commas are added automatically.
+ * If the buffer is too small the string is truncated and overflow is set.
+ */
+typedef struct {
+    char* buffer;
+    int size;
+    int len;
+    boolean overflow;
+    boolean needComma;
+} JSONWriter;
+
+/** Prepares a writer.
+ * @param writer the writer
+ * @param buffer where the string is written, it is always terminated
+ * @param size the size of the buffer
+ */
+void JSONwriterInit(JSONWriter* writer, char* buffer, int size);
+
+/** Opens an object.
+ * @param writer the writer
+ * @param name the name of the object, in flash, NULL for the outer object or inside arrays
+ */
+void JSONwriteObjectStart(JSONWriter* writer, PGM_P name);
+
+/** Closes an object.
+ */
+void JSONwriteObjectEnd(JSONWriter* writer);
+
+/** Writes a named long.
+ */
+void JSONwriteLong(JSONWriter* writer, PGM_P name, long value);
+
+/** Writes a named unsigned long.
+ */
+void JSONwriteULong(JSONWriter* writer, PGM_P name, unsigned long value);
+
+/** Writes a named number in fixed point, null if it is not a number or is too big.
+ * @param decimals the number of decimals, up to 6
+ */
+void JSONwriteDouble(JSONWriter* writer, PGM_P name, double value, byte decimals);
+
+/** Writes a named boolean, as TRUE or FALSE like the rest of pIoT.
+ */
+void JSONwriteBoolean(JSONWriter* writer, PGM_P name, boolean value);
+
+/** Writes a named string, escaping quotes, backslashes and control characters.
+ * @param value the string, in RAM
+ */
+void JSONwriteString(JSONWriter* writer, PGM_P name, const char* value);
+
+/** Sends the written string, followed by a new line, with a single write.
+ * @param writer the writer
+ * @param out where to send it, for example Serial
+ * @return false if the string was truncated, in which case nothing is sent
+ * and the counter given by getJSONOverflowCounter() is incremented
+ */
+boolean JSONwriteLine(JSONWriter* writer, Print& out);
+
+/** Gives the number of lines that JSONwriteLine() has dropped because they did not fit.
+ */
+unsigned long getJSONOverflowCounter();
+
+#ifdef ARDUINO
+
 /** Reads the strings coming from the serial and calls the parsers.
- * It listens for the time specified in millis and does not exit
- * until that time has been reached.
+ * It returns as soon as a message is complete, or when there is nothing
+ * to read and the time specified in millis has passed.
  * Spaces, tabs and new lines are removed automatically.
- * @param millis the time to wait until some data is found
+ * @param millis the maximum time to wait for data
  * @param a function that treats the message:
  * - dataname is the name of the first object
- * - msg is the entire JSON string
+ * - msg is the entire JSON string, it points to the internal buffer and is valid during the call
  */
 void readSerial(int millis, void (*f)(char* dataName, char* msg));
 
+#endif
+
+#endif
@@ -0,0 +1,46 @@
+/** Messages shared by the pIoT examples.
+ * The hello message is recommended to be used on all nodes, the charge message on
+ * battery powered nodes, the light and switch messages are used by the Sensor,
+ * Actuator and Base examples.
+ * See pIoT_Schema.h for how messages are declared.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#ifndef pIoT_MESSAGES_H_INCLUDED
+#define pIoT_MESSAGES_H_INCLUDED
+
+#include <pIoT_Schema.h>
+
+/** Hello message, contains internal values of the node.
+ */
+#define HELLO_MESSAGE_FIELDS(FIELD) \
+    FIELD(float, internalTemp, "temperature") \
+    FIELD(float, internalVcc, "vcc") \
+    FIELD(uint32_t, operationTime, "operationTime") \
+    FIELD(uint32_t, sentMsgs, "sentMessages") \
+    FIELD(uint32_t, unsentMsgs, "unsentMessages") \
+    FIELD(uint32_t, receivedMsgs, "receivedMessages")
+PIOT_MESSAGE(helloMessage, 1, "Hello", HELLO_MESSAGE_FIELDS)
+
+/** Charge used by the node since it started, in mAh, see getEstimatedCharge().
+ * It is a separate message so that the hello message keeps its length.
+ */
+#define CHARGE_MESSAGE_FIELDS(FIELD) \
+    FIELD(float, charge, "charge")
+PIOT_MESSAGE(chargeMessage, 2, "Charge", CHARGE_MESSAGE_FIELDS)
+
+/** Measured light intensity.
+ */
+#define LIGHT_MESSAGE_FIELDS(FIELD) \
+    FIELD(int16_t, intensity, "intensity")
+PIOT_MESSAGE(lightMessage, 100, "LightState", LIGHT_MESSAGE_FIELDS)
+
+/** Status of a switch, sent by the base to set it and by the actuator to confirm it.
+ */
+#define SWITCH_MESSAGE_FIELDS(FIELD) \
+    FIELD(bool, on, "on")
+PIOT_MESSAGE(switchMessage, 101, "SwitchState", SWITCH_MESSAGE_FIELDS)
+
+#endif
@@ -3,9 +3,12 @@
  * Decisions taken:
  * - pipe 0 is used as broadcast pipe, with shared address and no ACKs
  * - pipe 1 is used as private address
- * - nodes send their address
+ * - pipe 2 is used for the compact header, its address is the private one with the least
+ *   significant byte ^0x80 (COMPACT_ADDR_BIT)
+ * - nodes send their address, or, in the compact header, the 1 byte node ID assigned by the base
  * - addresses are 4 bytes long
- * - messages are identified by a message type field of 2 bytes
+ * - messages are identified by a message type field of 2 bytes, a varint in the compact header
+ * - headers are packed and parsed by pIoT_Header
  * - CRC is 2 bytes
  * - 2Mbps, 750us ack time, 5 retries
  *
@@ -18,6 +21,7 @@ extern "C"
 #endif
 
 #include <pIoT_Protocol.h>
+#include <pIoT_Header.h>
 
 //Configure retries, for strong reliability use 3 as delay and >10 as retries number
 #define TX_RETR_DELAY 2
@@ -27,12 +31,252 @@ extern "C"
 byte broadCastAddress[4];
 byte thisAddress[4];
 
-//Counters
-unsigned long sentCounter;
-unsigned long unsentCounter;
+//Node identifier assigned by a base for the compact header, and address of that base
+byte compactId = NO_NODE_ID;
+long compactBase;
+
+/** A node known by this base, its identifier is its position in the table + 1.
+ */
+typedef struct {
+    long address;
+    boolean compact; //true when the node has sent messages with the compact header
+} nodeEntry;
+nodeEntry nodeTable[NODE_TABLE_LEN];
+byte nodeCount = 0;
+
+//Time to live of the replies to node identifier requests
+#define NODE_ID_TTL_MS 60000
+
+//Counters, sent and unsent are updated when transmissions complete
+volatile unsigned long sentCounter;
+volatile unsigned long unsentCounter;
 unsigned long receivedCounter;
 
-boolean startRadio(byte chipEnablePin, byte chipSelectPin, byte powerPin, long myAdd) {
+/** A message waiting in the mailbox for its destination.
+ */
+typedef struct {
+    boolean used;
+    long destination;
+    unsigned int msgType;
+    unsigned int order; //posting order
+    unsigned long expiry; //in millis()
+    byte len;
+    byte data[26];
+} mailboxMessage;
+mailboxMessage mailbox[MAILBOX_LEN];
+
+//Counter used to order the messages in the mailbox
+unsigned int mailboxOrder = 0;
+
+//Mailbox slot loaded in the radio as ack payload (-1 if none) and the radio counter of sent ack payloads at that time
+int ackLoaded = -1;
+unsigned long ackSentMark;
+//True if the loaded message has been replaced by a newer one after loading
+boolean ackLoadedStale;
+
+/** A function registered for a message type.
+ */
+typedef struct {
+    unsigned int msgType;
+    int expectedLen;
+    void (*handler)(boolean broadcast, long sender, unsigned int msgType, byte* data, int len);
+} messageHandler;
+//Sorted by message type
+messageHandler handlers[MESSAGE_HANDLERS_LEN];
+byte handlersCount = 0;
+
+/** Passes a message to the function registered for its type, or to a default one.
+ * Messages of registered types with the wrong length are dropped.
+ * @param f the default function, can be NULL
+ */
+void dispatchMessage(boolean broadcast, long sender, unsigned int msgType, byte* data, int len,
+                     void (*f)(boolean broadcast, long sender, unsigned int msgType, byte* data, int len)){
+    receivedCounter ++;
+    //binary search
+    int low = 0;
+    int high = handlersCount - 1;
+    while(low <= high){
+        int mid = (low + high) / 2;
+        if(handlers[mid].msgType < msgType) low = mid + 1;
+        else if(handlers[mid].msgType > msgType) high = mid - 1;
+        else{
+            if((handlers[mid].expectedLen == ANY_LEN) || (handlers[mid].expectedLen == len))
+                handlers[mid].handler(broadcast, sender, msgType, data, len);
+            return;
+        }
+    }
+    if(f != NULL)
+        f(broadcast, sender, msgType, data, len);
+}
+
+boolean onMessage(unsigned int msgType, int expectedLen, void (*handler)(boolean broadcast, long sender, unsigned int msgType, byte* data, int len)){
+    //batches are split before dispatching, their handlers would never be called
+    if(msgType == BATCH_MSG_TYPE) return false;
+    int i = 0;
+    while((i < handlersCount) && (handlers[i].msgType < msgType))
+        i++;
+    if((i < handlersCount) && (handlers[i].msgType == msgType)){
+        if(handler == NULL){
+            //unregistered
+            handlersCount--;
+            memmove(&handlers[i], &handlers[i+1], (handlersCount - i) * sizeof(messageHandler));
+            return true;
+        }
+    }
+    else{
+        if((handler == NULL) || (handlersCount == MESSAGE_HANDLERS_LEN)) return handler == NULL;
+        memmove(&handlers[i+1], &handlers[i], (handlersCount - i) * sizeof(messageHandler));
+        handlersCount++;
+        handlers[i].msgType = msgType;
+    }
+    handlers[i].expectedLen = expectedLen;
+    handlers[i].handler = handler;
+    return true;
+}
+
+//User function called when an ack brings a message
+void (*ackHandler)(boolean broadcast, long sender, unsigned int msgType, byte* data, int len) = NULL;
+
+//User function called when a transmission completes
+void (*sendCallback)(boolean sent) = NULL;
+
+//Statistics of the links, nextLinkStats is the oldest entry
+LinkStats linkStats[LINK_STATS_LEN];
+byte linkStatsCount = 0;
+byte nextLinkStats = 0;
+
+//Destination of the queued asynchronous transmissions
+boolean queuedBroadcast;
+long queuedDestination;
+
+/** Finds the statistics of the link towards a destination.
+ * @return the statistics, NULL if there are none
+ */
+LinkStats* findLinkStats(long destination){
+    for(byte i=0; i<linkStatsCount; i++)
+        if(linkStats[i].address == destination) return &linkStats[i];
+    return NULL;
+}
+
+boolean getLinkStats(long destination, LinkStats* stats){
+    //updated by txDone(), which can run in the interrupt of the radio
+    uint8_t sreg = SREG;
+    cli();
+    LinkStats* found = findLinkStats(destination);
+    if(found != NULL) *stats = *found;
+    SREG = sreg;
+    return found != NULL;
+}
+
+void resetLinkStats(){
+    uint8_t sreg = SREG;
+    cli();
+    linkStatsCount = 0;
+    nextLinkStats = 0;
+    SREG = sreg;
+}
+
+/** Updates the statistics of the link towards the destination of the last transmission.
+ * @param sent true if the packet was delivered
+ */
+void updateLinkStats(boolean sent){
+    if(queuedBroadcast) return;
+    LinkStats* stats = findLinkStats(queuedDestination);
+    if(stats == NULL){
+        if(linkStatsCount < LINK_STATS_LEN) stats = &linkStats[linkStatsCount++];
+        else{
+            stats = &linkStats[nextLinkStats];
+            nextLinkStats = (nextLinkStats + 1) % LINK_STATS_LEN;
+        }
+        memset(stats, 0, sizeof(LinkStats));
+        stats->address = queuedDestination;
+        stats->quality = 255;
+    }
+    byte retries = nRF24.getLastRetries();
+    int sample = 0;
+    if(sent){
+        byte bucket = 0;
+        while((bucket < LINK_RETRIES_BUCKETS - 1) && (retries >= (1 << bucket))) bucket++;
+        if(stats->retries[bucket] < 0xFFFF) stats->retries[bucket]++;
+        sample = 255 - (retries << 4);
+    }
+    else if(stats->lost < 0xFFFF) stats->lost++;
+    //moving average with weight 1/8
+    stats->quality = stats->quality + (sample - stats->quality) / 8;
+}
+
+//Called by the nRF24 when a transmission completes
+void txDone(boolean sent){
+    if(sent) sentCounter++;
+    else unsentCounter ++;
+    updateLinkStats(sent);
+    if(sendCallback != NULL)
+        sendCallback(sent);
+}
+
+//Conversions between addresses as long and as bytes, least significant byte first
+void addressToBytes(long address, byte* bytes){
+    bytes[0] = address & 0xFF ;
+    bytes[1] = (address >> 8) & 0xFF;
+    bytes[2] = (address >> 16) & 0xFF;
+    bytes[3] = (address >> 24) & 0xFF;
+}
+
+long bytesToAddress(byte* bytes){
+    return (long)bytes[0] + ((long)bytes[1] << 8) + ((long)bytes[2] << 16) + ((long)bytes[3] << 24);
+}
+
+/** Tells if messages to a destination use the compact header.
+ */
+boolean isCompact(boolean broadcast, long destination){
+    if(broadcast) return false;
+    if((compactId != NO_NODE_ID) && (destination == compactBase)) return true;
+    for(int i=0; i<nodeCount; i++)
+        if(nodeTable[i].address == destination) return nodeTable[i].compact;
+    return false;
+}
+
+/** Returns the number of payload bytes that fit in a packet.
+ * @param compact true if the packet uses the compact header
+ * @param msgType the message type
+ */
+int maxPayload(boolean compact, unsigned int msgType){
+    if(!compact) return NRF24_MAX_MESSAGE_LEN - FULL_HEADER_LEN;
+    byte type[VARINT_MAX_LEN];
+    return NRF24_MAX_MESSAGE_LEN - 1 - writeVarint(msgType, type);
+}
+
+/** Returns the identifier of a node, assigning it if the node is new.
+ * @return the identifier, NO_NODE_ID if the table is full
+ */
+byte assignNodeId(long address){
+    for(int i=0; i<nodeCount; i++)
+        if(nodeTable[i].address == address) return i + 1;
+    if(nodeCount == NODE_TABLE_LEN) return NO_NODE_ID;
+    nodeTable[nodeCount].address = address;
+    nodeTable[nodeCount].compact = false;
+    nodeCount++;
+    return nodeCount;
+}
+
+/** Finds the address of the sender of a message with the compact header.
+ * @param id the identifier in the header
+ * @param address where the address is stored
+ * @return false if the identifier is unknown
+ */
+boolean nodeIdToAddress(byte id, long* address){
+    if(id == BASE_NODE_ID){
+        if(compactId == NO_NODE_ID) return false;
+        *address = compactBase;
+        return true;
+    }
+    if((id == NO_NODE_ID) || (id > nodeCount)) return false;
+    nodeTable[id - 1].compact = true;
+    *address = nodeTable[id - 1].address;
+    return true;
+}
+
+boolean startRadio(byte chipEnablePin, byte chipSelectPin, byte powerPin, long myAdd, byte irqPin) {
     long brdcst = BROADCAST_ADDR;
     broadCastAddress[0] =  brdcst & 0xFF ;
     broadCastAddress[1] = (brdcst >> 8) & 0xFF;
@@ -44,13 +288,23 @@ boolean startRadio(byte chipEnablePin, byte chipSelectPin, byte powerPin, long m
     thisAddress[2] = (myAdd >> 16) & 0xFF;
     thisAddress[3] = (myAdd >> 24) & 0xFF;
 
+    //identifiers have to be assigned again
+    compactId = NO_NODE_ID;
+    nodeCount = 0;
+    //the compact pipe only differs in the least significant byte
+    byte compactAddress[4];
+    memcpy(compactAddress, thisAddress, 4);
+    compactAddress[0] ^= COMPACT_ADDR_BIT;
+
     //Init the nrf24
-    nRF24.configure(chipEnablePin, chipSelectPin, powerPin);
+    nRF24.configure(chipEnablePin, chipSelectPin, powerPin, irqPin);
+    nRF24.setTxCallback(txDone);
     nRF24.powerUpIdle();
     if(!nRF24.setChannel(RF_CHANNEL)) return false;
     //set dynamic payload size
     if(!nRF24.setPayloadSize(0, 0)) return false;
     if(!nRF24.setPayloadSize(1, 0)) return false;
+    if(!nRF24.setPayloadSize(COMPACT_PIPE, 0)) return false;
     //Set address size to 4
     if(!nRF24.setAddressSize(NRF24::NRF24AddressSize4Bytes)) return false;
     //Set CRC to 2 bytes
@@ -62,19 +316,267 @@ boolean startRadio(byte chipEnablePin, byte chipSelectPin, byte powerPin, long m
 	if(!nRF24.enablePipe(1)) return false;
     if(!nRF24.setPipeAddress(0, broadCastAddress)) return false;
 	if(!nRF24.setPipeAddress(1, thisAddress)) return false;
+	if(!nRF24.enablePipe(COMPACT_PIPE)) return false;
+	if(!nRF24.setPipeAddress(COMPACT_PIPE, compactAddress)) return false;
     if(!nRF24.setAutoAck(0, true)) return false;
     if(!nRF24.setAutoAck(1, true)) return false;
+    if(!nRF24.setAutoAck(COMPACT_PIPE, true)) return false;
     if(!nRF24.setTXRetries(TX_RETR_DELAY, TX_RETR_NUM)) return false;
+    //downlink messages can travel in the acks
+    if(!nRF24.setAckPayloads(true)) return false;
+    //from now on mode switches and address changes only need writes
+    //and switching to TX does not throw away received packets
+    nRF24.setFastTurnaround(true);
     return true;
 }
 
 boolean stopRadio(){
-    nRF24.powerDown();
+    return nRF24.powerDown();
 }
 
-boolean send(boolean broadcast, long destination, unsigned int msgType, byte* data, int len){
-	if(len > 26) return false;
+/** A message being rebuilt from its fragments.
+ */
+typedef struct {
+    boolean used;
+    long sender;
+    unsigned int msgType;
+    byte seq;
+    byte next; //index of the next expected fragment
+    int len;
+    unsigned long lastMS; //millis() of the last fragment
+    byte data[FRAGMENT_MAX_LEN];
+} fragmentBuffer;
+fragmentBuffer fragments[FRAGMENT_BUFFERS];
+
+//Sequence number of the next message sent in fragments
+byte fragmentSeq = 0;
 
+//Marks the last fragment of a message, in the fragment index
+#define FRAGMENT_LAST 0x80
+
+/** Adds a fragment to the message it belongs to.
+ * Fragments must come in order, a missing one drops the message.
+ * @param data the fragment, starting with sequence number and index
+ * @param len the length of the fragment
+ * @return the buffer of the message if complete, NULL otherwise
+ */
+fragmentBuffer* addFragment(long sender, unsigned int msgType, byte* data, int len){
+    if(len < 3) return NULL;
+    byte seq = data[0];
+    byte index = data[1] & ~FRAGMENT_LAST;
+    unsigned long now = millis();
+    fragmentBuffer* buf = NULL;
+    fragmentBuffer* empty = NULL;
+    for(int i=0; i<FRAGMENT_BUFFERS; i++){
+        fragmentBuffer* b = &fragments[i];
+        //reclaims buffers of messages that will never be completed
+        if(b->used && ((now - b->lastMS) > FRAGMENT_TIMEOUT_MS))
+            b->used = false;
+        if(!b->used){
+            if(empty == NULL) empty = b;
+        }
+        else if((b->sender == sender) && (b->msgType == msgType) && (b->seq == seq))
+            buf = b;
+    }
+    if(index == 0){
+        //a new message, or the sender started it again
+        if(buf == NULL) buf = empty;
+        if(buf == NULL) return NULL;
+        buf->used = true;
+        buf->sender = sender;
+        buf->msgType = msgType;
+        buf->seq = seq;
+        buf->next = 0;
+        buf->len = 0;
+    }
+    if(buf == NULL) return NULL;
+    if((index != buf->next) || (buf->len + len - 2 > FRAGMENT_MAX_LEN)){
+        buf->used = false;
+        return NULL;
+    }
+    memcpy(buf->data + buf->len, data + 2, len - 2);
+    buf->len += len - 2;
+    buf->next++;
+    buf->lastMS = now;
+    if(data[1] & FRAGMENT_LAST){
+        buf->used = false; //the data stays valid until the next fragment
+        return buf;
+    }
+    return NULL;
+}
+
+/** Passes the message received in an ack, if any, to the ack handler.
+ * @param sender the node that sent the ack
+ */
+void dispatchAckMessage(long sender){
+    byte buffer[NRF24_MAX_MESSAGE_LEN];
+    byte totlen;
+    if(!nRF24.recvAckPayload(buffer, &totlen)) return;
+    if(totlen < 6) return;
+    unsigned int msgType = (unsigned int)(buffer[5] <<8) + (unsigned int)buffer[4];
+    if((msgType == NODE_ID_MSG_TYPE) && (totlen == 8) && (buffer[6] == NO_NODE_ID)){
+        //the base does not know the identifier, it has restarted: a new one is needed
+        if((sender == compactBase) && (compactId != NO_NODE_ID) && (buffer[7] == compactId)){
+            compactId = NO_NODE_ID;
+            requestNodeId(sender);
+        }
+        return;
+    }
+    //the base cannot choose who gets the ack, the payload starts with the destination
+    if(memcmp(buffer, thisAddress, 4) != 0) return;
+    if((msgType == NODE_ID_MSG_TYPE) && (totlen == 7)){
+        //reply to requestNodeId()
+        compactId = buffer[6];
+        compactBase = sender;
+        return;
+    }
+    dispatchMessage(false, sender, msgType, buffer + 6, totlen - 6, ackHandler);
+}
+
+/** Frees the mailbox slots whose messages have expired.
+ */
+void expireMailbox(){
+    unsigned long now = millis();
+    for(int i=0; i<MAILBOX_LEN; i++){
+        //the one loaded in the radio may still be delivered
+        if(mailbox[i].used && (i != ackLoaded) && ((long)(now - mailbox[i].expiry) >= 0))
+            mailbox[i].used = false;
+    }
+}
+
+/** Finds the oldest message in the mailbox for a destination.
+ * @param destination the destination
+ * @param skip slot to be ignored, -1 for none
+ * @return the slot, -1 if there is no message
+ */
+int nextMailboxMessage(long destination, int skip){
+    int found = -1;
+    for(int i=0; i<MAILBOX_LEN; i++){
+        if(mailbox[i].used && (i != skip) && (mailbox[i].destination == destination) &&
+           ((found < 0) || ((int)(mailbox[i].order - mailbox[found].order) < 0)))
+            found = i;
+    }
+    return found;
+}
+
+/** Loads in the radio the next mailbox message for a node that has just been heard from.
+ * An ack payload goes to whichever node transmits next, the one loaded after a packet from
+ * a node is likely to reach it with its next packet. Delivery is checked against the sender
+ * of the first packet received after loading.
+ * @param heardFrom the sender of the packet just received
+ * @param pipe the pipe the packet was received on, the ack payload is loaded on the same pipe
+ */
+void serviceMailbox(long heardFrom, byte pipe){
+    if(ackLoaded >= 0){
+        if(nRF24.getAckPayloadsPending() > 0) return; //still waiting for a packet
+        //sent with the ack of the packet just received, or flushed
+        if((nRF24.getAckPayloadsSent() != ackSentMark) && (mailbox[ackLoaded].destination == heardFrom)
+           && !ackLoadedStale)
+            mailbox[ackLoaded].used = false;
+        ackLoaded = -1;
+    }
+    expireMailbox();
+    //a reject of a node identifier is waiting
+    if(nRF24.getAckPayloadsPending() > 0) return;
+    int i = nextMailboxMessage(heardFrom, -1);
+    if(i < 0) return;
+    //the receive function may have sent something
+    if(!nRF24.powerUpRx()) return;
+    //with other packets already received it would not be possible to tell who got it
+    if(nRF24.available()) return;
+    mailboxMessage* msg = &mailbox[i];
+    byte pkt[NRF24_MAX_MESSAGE_LEN];
+    addressToBytes(msg->destination, pkt);
+    pkt[4] = msg->msgType & 0xFF ;
+    pkt[5] = (msg->msgType >> 8) & 0xFF;
+    memcpy(pkt + 6, msg->data, msg->len);
+    ackSentMark = nRF24.getAckPayloadsSent();
+    ackLoadedStale = false;
+    if(nRF24.writeAckPayload(pipe, pkt, msg->len + 6))
+        ackLoaded = i;
+}
+
+/** Tells a node that its identifier is unknown, e.g. because the base has restarted.
+ * The sender is not known, so the reject goes with the next ack on the compact pipe
+ * and carries the identifier: other nodes ignore it. It is not loaded while other
+ * ack payloads are waiting, the node will be rejected at one of its next messages.
+ * @param id the unknown identifier
+ */
+void rejectNodeId(byte id){
+    if((ackLoaded >= 0) || (nRF24.getAckPayloadsPending() > 0)) return;
+    if(!nRF24.powerUpRx()) return;
+    byte pkt[8];
+    addressToBytes(BROADCAST_ADDR, pkt);
+    pkt[4] = NODE_ID_MSG_TYPE & 0xFF;
+    pkt[5] = (NODE_ID_MSG_TYPE >> 8) & 0xFF;
+    pkt[6] = NO_NODE_ID;
+    pkt[7] = id;
+    nRF24.writeAckPayload(COMPACT_PIPE, pkt, 8);
+}
+
+boolean postMessage(long destination, unsigned int msgType, byte* data, int len, unsigned long ttlMS){
+    if((len > 26) || (msgType == BATCH_MSG_TYPE)) return false;
+    expireMailbox();
+    int slot = -1;
+    int queued = 0;
+    for(int i=0; i<MAILBOX_LEN; i++){
+        if(!mailbox[i].used){
+            if(slot < 0) slot = i;
+        }
+        else if(mailbox[i].destination == destination){
+            if(mailbox[i].msgType == msgType){
+                //the new message supersedes the old one
+                slot = i;
+                if(i == ackLoaded) ackLoadedStale = true;
+                queued = 0;
+                break;
+            }
+            queued++;
+        }
+    }
+    if((slot < 0) || (queued >= MAILBOX_NODE_LEN)) return false;
+    mailboxMessage* msg = &mailbox[slot];
+    if(!msg->used)
+        msg->order = mailboxOrder++;
+    msg->destination = destination;
+    msg->msgType = msgType;
+    msg->expiry = millis() + ttlMS;
+    msg->len = len;
+    memcpy(msg->data, data, len);
+    msg->used = true;
+    return true;
+}
+
+int flushMailbox(long destination){
+    int delivered = 0;
+    expireMailbox();
+    int i;
+    //the message loaded in the radio is left to the ack
+    while((i = nextMailboxMessage(destination, ackLoaded)) >= 0){
+        if(!send(false, destination, mailbox[i].msgType, mailbox[i].data, mailbox[i].len))
+            break; //not listening, do not waste more retries
+        mailbox[i].used = false;
+        delivered++;
+    }
+    return delivered;
+}
+
+int getMailboxLength(long destination){
+    expireMailbox();
+    int count = 0;
+    for(int i=0; i<MAILBOX_LEN; i++)
+        if(mailbox[i].used && (mailbox[i].destination == destination)) count++;
+    return count;
+}
+
+void setAckMessageHandler(void (*f)(boolean broadcast, long sender, unsigned int msgType, byte* data, int len)){
+    ackHandler = f;
+}
+
+/** Puts the radio in TX mode and sets the transmit address.
+ * @return true on success
+ */
+boolean setDestination(boolean broadcast, long destination, boolean compact){
 	if(!nRF24.powerUpTx()) return false;
 
     if(broadcast){
@@ -82,42 +584,184 @@ boolean send(boolean broadcast, long destination, unsigned int msgType, byte* da
     }
     else{
         byte destaddr[4];
-        destaddr[0] = destination & 0xFF ;
-        destaddr[1] = (destination >> 8) & 0xFF;
-        destaddr[2] = (destination >> 16) & 0xFF;
-        destaddr[3] = (destination >> 24) & 0xFF;
+        addressToBytes(destination, destaddr);
+        if(compact) destaddr[0] ^= COMPACT_ADDR_BIT;
         if(!nRF24.setTransmitAddress(destaddr)) return false;
     }
-    unsigned int totlen = len + 6;
-    byte pkt[totlen];
-    pkt[0] = thisAddress[0];
-    pkt[1] = thisAddress[1];
-    pkt[2] = thisAddress[2];
-    pkt[3] = thisAddress[2];
+    queuedBroadcast = broadcast;
+    queuedDestination = destination;
+    return true;
+}
+
+/** Fills the packet with header and payload.
+ * The full header is the address of the sender and the message type on 2 bytes,
+ * the compact one is the node identifier and the message type as varint.
+ * @param compact true for the compact header
+ * @return the total length of the packet
+ */
+int buildPacket(boolean compact, unsigned int msgType, byte* data, int len, byte* pkt){
+    //the base is the one that has not got an identifier
+    int hdrlen = packHeader(compact, (compactId != NO_NODE_ID)? compactId : BASE_NODE_ID,
+                            thisAddress, msgType, pkt);
+    memcpy(pkt + hdrlen, data, len);
+    return len + hdrlen;
+}
+
+/** Sends a long message as a sequence of fragments, streamed through the TX FIFO.
+ * Each fragment carries the message type with FRAGMENT_FLAG, a sequence number of the message
+ * and the index of the fragment, with FRAGMENT_LAST set on the last one.
+ */
+boolean sendFragments(boolean broadcast, long destination, unsigned int msgType, byte* data, int len){
+    if((len > FRAGMENT_MAX_LEN) || (msgType & FRAGMENT_FLAG)) return false;
+    while(pollSend() == NRF24::NRF24TxPending)
+        ;
+    unsigned long unsent = unsentCounter;
+    byte chunk[FRAGMENT_PAYLOAD_LEN + 2];
+    chunk[0] = fragmentSeq++;
+    byte index = 0;
+    int offset = 0;
+    while(offset < len){
+        int n = len - offset;
+        if(n > FRAGMENT_PAYLOAD_LEN) n = FRAGMENT_PAYLOAD_LEN;
+        chunk[1] = index | ((offset + n == len)? FRAGMENT_LAST : 0);
+        memcpy(chunk + 2, data + offset, n);
+        //waits for a free slot in the TX FIFO, the radio is polled before trying, so that
+        //a FIFO drained in between is tried again: it fails with the radio idle only if it cannot be sent
+        boolean queued = false;
+        boolean idle = false;
+        while(!queued && !idle && (unsentCounter == unsent)){
+            idle = (pollSend() != NRF24::NRF24TxPending);
+            if(unsentCounter == unsent)
+                queued = sendAsync(broadcast, destination, msgType | FRAGMENT_FLAG, chunk, n + 2);
+        }
+        //a lost fragment makes the whole message useless
+        if(!queued || (unsentCounter != unsent)) break;
+        offset += n;
+        index++;
+    }
+    while(pollSend() == NRF24::NRF24TxPending)
+        ;
+    return (offset == len) && (unsentCounter == unsent);
+}
+
+/** Sends a message, like send(), reserved message types included.
+ */
+boolean sendMessage(boolean broadcast, long destination, unsigned int msgType, byte* data, int len){
+    boolean compact = isCompact(broadcast, destination);
+	if(len > maxPayload(compact, msgType)) return sendFragments(broadcast, destination, msgType, data, len);
+    //queued asynchronous transmissions must be over before changing address
+    while(nRF24.pollTx() == NRF24::NRF24TxPending)
+        ;
+    if(!setDestination(broadcast, destination, compact)) return false;
+    byte pkt[NRF24_MAX_MESSAGE_LEN];
+    int totlen = buildPacket(compact, msgType, data, len, pkt);
+    //counters are updated by txDone()
+    boolean sent = nRF24.send(pkt, totlen, broadcast);
+    if(sent && !broadcast)
+        dispatchAckMessage(destination);
+    return sent;
+}
+
+boolean send(boolean broadcast, long destination, unsigned int msgType, byte* data, int len){
+    if(msgType == BATCH_MSG_TYPE) return false;
+    return sendMessage(broadcast, destination, msgType, data, len);
+}
+
+boolean sendAsync(boolean broadcast, long destination, unsigned int msgType, byte* data, int len){
+    boolean compact = isCompact(broadcast, destination);
+	if((len > maxPayload(compact, msgType)) || (msgType == BATCH_MSG_TYPE)) return false;
+    if(nRF24.pollTx() == NRF24::NRF24TxPending){
+        //packets to the same destination can be streamed
+        if((broadcast != queuedBroadcast) || (!broadcast && (destination != queuedDestination)))
+            return false;
+        if(nRF24.getTxQueueLength() == nRF24.getTxQueueCapacity())
+            return false;
+    }
+    else if(!setDestination(broadcast, destination, compact)) return false;
+    byte pkt[NRF24_MAX_MESSAGE_LEN];
+    int totlen = buildPacket(compact, msgType, data, len, pkt);
+    return nRF24.sendAsync(pkt, totlen, broadcast);
+}
 
-    pkt[4] = msgType & 0xFF ;
-    pkt[5] = (msgType >> 8) & 0xFF;
+//Messages waiting to be sent together, as records of length, varint message type and data
+boolean batchBroadcast;
+long batchDestination;
+byte batchData[NRF24_MAX_MESSAGE_LEN];
+byte batchLen = 0;
+byte batchCount = 0;
 
-    for(int i=0; i<len; i++){
-        pkt[i+6] = data[i];
+boolean beginBatch(boolean broadcast, long destination){
+    boolean sent = flushBatch();
+    batchBroadcast = broadcast;
+    batchDestination = destination;
+    return sent;
+}
+
+boolean addToBatch(unsigned int msgType, byte* data, int len){
+    if((msgType & FRAGMENT_FLAG) || (msgType == BATCH_MSG_TYPE)) return false;
+    byte type[VARINT_MAX_LEN];
+    byte typelen = writeVarint(msgType, type);
+    int reclen = 1 + typelen + len;
+    int capacity = maxPayload(isCompact(batchBroadcast, batchDestination), BATCH_MSG_TYPE);
+    if(reclen > capacity){
+        //too long to share a frame, sent alone
+        boolean sent = flushBatch();
+        return send(batchBroadcast, batchDestination, msgType, data, len) && sent;
+    }
+    boolean sent = true;
+    if(batchLen + reclen > capacity)
+        sent = flushBatch();
+    batchData[batchLen] = len;
+    memcpy(batchData + batchLen + 1, type, typelen);
+    memcpy(batchData + batchLen + 1 + typelen, data, len);
+    batchLen += reclen;
+    batchCount++;
+    return sent;
+}
+
+boolean flushBatch(){
+    if(batchCount == 0) return true;
+    boolean sent;
+    if(batchCount == 1){
+        //a single message does not need the batch format
+        unsigned int msgType;
+        byte typelen = readVarint(batchData + 1, batchLen - 1, &msgType);
+        sent = send(batchBroadcast, batchDestination, msgType, batchData + 1 + typelen, batchData[0]);
     }
-    boolean justsent = nRF24.send(pkt, totlen, broadcast);
+    else sent = sendMessage(batchBroadcast, batchDestination, BATCH_MSG_TYPE, batchData, batchLen);
+    batchLen = 0;
+    batchCount = 0;
+    return sent;
+}
+
+NRF24::NRF24TxStatus pollSend(){
+    NRF24::NRF24TxStatus status = nRF24.pollTx();
+    if((status == NRF24::NRF24TxSent) && !queuedBroadcast)
+        dispatchAckMessage(queuedDestination);
+    return status;
+}
+
+void setSendCallback(void (*f)(boolean sent)){
+    sendCallback = f;
+}
 
-	if(justsent) sentCounter++;
-	else unsentCounter ++;
+boolean requestNodeId(long base){
+    return send(false, base, NODE_ID_MSG_TYPE, NULL, 0);
+}
 
-	return justsent;
+byte getNodeId(){
+    return compactId;
 }
 
 boolean receive(unsigned int timeoutMS, void (*f)(boolean broadcast, long sender, unsigned int msgType, byte* data, int len)){
+    //switching to RX would drop the queued asynchronous transmissions
+    while(nRF24.pollTx() == NRF24::NRF24TxPending)
+        ;
 
 	if(!nRF24.powerUpRx())
 		return false;
 
-	if(timeoutMS >0){
-		nRF24.waitAvailableTimeout(timeoutMS);
-	}
-
+    unsigned long start = millis();
 	boolean broadcast;
     long sender;
     unsigned int msgType;
@@ -126,20 +770,76 @@ boolean receive(unsigned int timeoutMS, void (*f)(boolean broadcast, long sender
     byte totlen;
     byte pipe;
 
-	if(nRF24.recv(&pipe, buffer, &totlen)){
+    while(true){
+        if(timeoutMS >0){
+            unsigned long elapsed = millis() - start;
+            if(elapsed < timeoutMS)
+                nRF24.waitAvailableTimeout(timeoutMS - elapsed);
+        }
+
+        if(!nRF24.recv(&pipe, buffer, &totlen))
+            return false;
+
         broadcast = (pipe == BROADCAST_PIPE);
-        sender = buffer[0] + (buffer[1] << 8) + (buffer[2] << 16) + (buffer[3] << 24);
-        msgType = (unsigned int)(buffer[5] <<8) + (unsigned int)buffer[4];
-        len = totlen - 6;
-        byte data[len];
-        for(int i=0; i<len; i++)
-            data[i] = buffer[i+6];
-
-		receivedCounter ++;
-        f(broadcast,sender, msgType, data, len);
-        return true;
-       }
-    return false;
+        boolean delivered = false;
+        byte nodeId;
+        int hdrlen = parseHeader(pipe == COMPACT_PIPE, buffer, totlen, &nodeId, &sender, &msgType);
+        if((hdrlen == 0) || ((pipe == COMPACT_PIPE) && !nodeIdToAddress(nodeId, &sender))){
+            //unknown node, dropped, and told to ask for a new identifier
+            if((hdrlen > 0) && (nodeId != BASE_NODE_ID)) rejectNodeId(nodeId);
+            if((millis() - start) >= timeoutMS && !nRF24.available())
+                return false;
+            continue;
+        }
+        byte* payload = buffer + hdrlen;
+        len = totlen - hdrlen;
+
+        if(msgType == NODE_ID_MSG_TYPE){
+            if(!broadcast && (len == 0)){
+                //request from a node, the reply goes with the ack of its next message
+                byte id = assignNodeId(sender);
+                if(id != NO_NODE_ID)
+                    postMessage(sender, NODE_ID_MSG_TYPE, &id, 1, NODE_ID_TTL_MS);
+            }
+            else if(!broadcast && (len == 1)){
+                //reply from a base
+                compactId = payload[0];
+                compactBase = sender;
+            }
+        }
+        else if(msgType & FRAGMENT_FLAG){
+            fragmentBuffer* msg = addFragment(sender, msgType & ~FRAGMENT_FLAG, payload, len);
+            if(msg != NULL){
+                dispatchMessage(broadcast, sender, msg->msgType, msg->data, msg->len, f);
+                delivered = true;
+            }
+        }
+        else if(msgType == BATCH_MSG_TYPE){
+            //one call per record
+            byte* rec = payload;
+            while(len > 0){
+                unsigned int recType;
+                byte typelen = readVarint(rec + 1, len - 1, &recType);
+                if((typelen == 0) || (1 + typelen + rec[0] > len)) break;
+                dispatchMessage(broadcast, sender, recType, rec + 1 + typelen, rec[0], f);
+                delivered = true;
+                len -= 1 + typelen + rec[0];
+                rec += 1 + typelen + rec[0];
+            }
+        }
+        else{
+            //the payload is passed straight from the receive buffer
+            dispatchMessage(broadcast, sender, msgType, payload, len, f);
+            delivered = true;
+        }
+        if(!broadcast)
+            serviceMailbox(sender, pipe);
+        if(delivered)
+            return true;
+        //waits for the rest of the message within the time-out
+        if((millis() - start) >= timeoutMS && !nRF24.available())
+            return false;
+    }
 }
 
 unsigned long getSentCounter(){
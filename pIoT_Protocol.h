@@ -3,9 +3,11 @@
  * Decisions taken:
  * - pipe 0 is used as broadcast pipe, with shared address and no acks
  * - pipe 1 is used as private address
- * - nodes send their address
+ * - pipe 2 is used for messages with the compact header, its address is the private one
+ *   with COMPACT_ADDR_BIT flipped in the least significant byte
+ * - nodes send their address, or the 1 byte identifier assigned by the base in the compact header
  * - addresses are 4 bytes long
- * - messages are identified by a message type field of 2 bytes
+ * - messages are identified by a message type field of 2 bytes, a varint in the compact header
  * - CRC is 2 bytes
  * - 2Mbps, 750us ack time, 5 retries
  *
@@ -27,12 +29,104 @@
 //The pipe used for private messages
 #define PRIVATE_PIPE 1
 
+//The pipe used for messages with the compact header
+#define COMPACT_PIPE 2
+
+//Bit of the least significant address byte that distinguishes the compact pipe,
+//addresses that only differ in this bit must not be used
+#define COMPACT_ADDR_BIT 0x80
+
+//Message type reserved to requests, and replies, of node identifiers
+#define NODE_ID_MSG_TYPE 0x7FFE
+
+//Node identifier of the base in the compact header
+#define BASE_NODE_ID 0
+
+//Node identifier not assigned
+#define NO_NODE_ID 0xFF
+
+//Number of nodes a base can assign identifiers to, up to 254
+//Can be pre-defined to a smaller size (to save SRAM) prior to including this header
+#ifndef NODE_TABLE_LEN
+#define NODE_TABLE_LEN 16
+#endif
+
+//Number of functions that can be registered with onMessage()
+//Can be pre-defined to a smaller size (to save SRAM) prior to including this header
+#ifndef MESSAGE_HANDLERS_LEN
+#define MESSAGE_HANDLERS_LEN 8
+#endif
+
+//Expected length that accepts messages of any length
+#define ANY_LEN -1
+
 //Default address of the base station
 #define BASE_ADDR -2130771712
 
 //Default radio channel
 #define RF_CHANNEL 50
 
+//Number of messages that can wait in the mailbox, for all nodes
+//Can be pre-defined to a smaller size (to save SRAM) prior to including this header
+#ifndef MAILBOX_LEN
+#define MAILBOX_LEN 8
+#endif
+
+//Number of messages that can wait in the mailbox for a single node
+//Can be pre-defined prior to including this header
+#ifndef MAILBOX_NODE_LEN
+#define MAILBOX_NODE_LEN 3
+#endif
+
+//Message type reserved to frames that contain several messages, message types must not use it:
+//send(), sendAsync(), postMessage() and onMessage() refuse it
+//It is below 128 so that it takes a single byte in the compact header
+#define BATCH_MSG_TYPE 127
+
+//Bit of the message type that marks fragments of longer messages,
+//message types must not use it
+#define FRAGMENT_FLAG 0x8000
+
+//Payload bytes carried by each fragment
+#define FRAGMENT_PAYLOAD_LEN 24
+
+//Maximum length of a message sent in fragments, it cannot exceed 128 fragments
+//Can be pre-defined prior to including this header, must be the same on all nodes
+#ifndef FRAGMENT_MAX_LEN
+#define FRAGMENT_MAX_LEN 128
+#endif
+
+//Number of messages in fragments that can be rebuilt at the same time
+//Can be pre-defined to a smaller size (to save SRAM) prior to including this header
+#ifndef FRAGMENT_BUFFERS
+#define FRAGMENT_BUFFERS 2
+#endif
+
+//Milliseconds after which an incomplete message is dropped
+//Can be pre-defined prior to including this header
+#ifndef FRAGMENT_TIMEOUT_MS
+#define FRAGMENT_TIMEOUT_MS 1000
+#endif
+
+//Number of destinations whose link statistics are kept, the oldest is replaced
+//Can be pre-defined to a smaller size (to save SRAM) prior to including this header
+#ifndef LINK_STATS_LEN
+#define LINK_STATS_LEN 4
+#endif
+
+//Buckets of the retransmissions histogram: 0, 1, 2-3, 4-7, 8-15 retransmissions
+#define LINK_RETRIES_BUCKETS 5
+
+/** Statistics of the link towards a destination, updated on every completed
+ * transmission that is not in broadcast.
+ */
+typedef struct {
+    long address;
+    unsigned int retries[LINK_RETRIES_BUCKETS]; //histogram of the retransmissions of the delivered packets
+    unsigned int lost; //packets not delivered within the retries
+    byte quality; //moving average, 255 when all packets go through at the first attempt, 0 when all are lost
+} LinkStats;
+
 
 /** Configures and starts the radio.
  * init() must be called to initialise the interface and the radio module
@@ -40,9 +134,11 @@
  * @param chipSelectPin the Arduino pin number of the output to use to select the NRF24 before
  * @param powerPin the Arduino pin number used to power up the nRF24 module (-1 if always powered up)
  * @param myAddress the address of this node, expressed as a long (from -2,147,483,648 to 2,147,483,647)
+ * @param irqPin the Arduino pin connected to the IRQ line of the nRF24 module (NRF24_NO_PIN if not connected),
+ * when given received packets are buffered by the interrupt handler and are not lost while the MCU is busy
  * @return true on success
  */
-boolean startRadio(byte chipEnablePin, byte chipSelectPin, byte powerPin, long myaddress);
+boolean startRadio(byte chipEnablePin, byte chipSelectPin, byte powerPin, long myaddress, byte irqPin = NRF24_NO_PIN);
 
 /** Shuts the radio module down.
  * To restart it you don't need to call startRadio() explicitly.
@@ -50,26 +146,143 @@ boolean startRadio(byte chipEnablePin, byte chipSelectPin, byte powerPin, long m
 boolean stopRadio();
 
 /** Sends a message to another pIoT.
+ * Messages longer than 26 bytes are split into fragments that are streamed back to back,
+ * the receiver rebuilds them before passing them to the receive function.
  * @param broadcast true if broadcast
  * @param destination address of the destination
- * @param msgType type of message
- * @param len length of the payload in bytes, it cannot exceed 26 (!)
- * @return true if sent
+ * @param msgType type of message, below FRAGMENT_FLAG, not BATCH_MSG_TYPE
+ * @param len length of the payload in bytes, it cannot exceed FRAGMENT_MAX_LEN (!)
+ * @return true if sent, for fragmented messages if all the fragments have been sent
  */
 boolean send(boolean broadcast, long destination, unsigned int msgType, byte* data, int len);
 
+/** Sends a message to another pIoT without waiting for the transmission to complete.
+ * The outcome can be checked with pollSend() or received by the function set with setSendCallback(),
+ * the sent and unsent counters are updated on completion.
+ * Up to nRF24.getTxQueueCapacity() messages to the same destination can be queued and are transmitted
+ * back to back, which is convenient for bulk transfers.
+ * @param broadcast true if broadcast
+ * @param destination address of the destination
+ * @param msgType type of message, not BATCH_MSG_TYPE
+ * @param len length of the payload in bytes, it cannot exceed 26 (!), or 30 minus the varint type length with the compact header
+ * @return true if the transmission has started, false if the queue is full or
+ * still contains messages to another destination
+ */
+boolean sendAsync(boolean broadcast, long destination, unsigned int msgType, byte* data, int len);
+
+/** Starts collecting short messages to be sent together in a single packet.
+ * Messages are added with addToBatch() and sent with flushBatch(), the receive function
+ * of the destination is called once per message.
+ * Each message takes its length plus 3 bytes (2 if the type is below 128) out of the 26
+ * available in a packet, 30 with the compact header.
+ * @param broadcast true if broadcast
+ * @param destination address of the destination
+ * @return false if messages of a previous batch have been flushed but could not be sent
+ */
+boolean beginBatch(boolean broadcast, long destination);
+
+/** Adds a message to the current batch.
+ * If the message does not fit in the packet, the batch is flushed first.
+ * Messages that cannot share a packet are sent alone.
+ * @param msgType type of message, it cannot be BATCH_MSG_TYPE
+ * @param data the payload, copied
+ * @param len length of the payload in bytes
+ * @return false if a packet flushed to make space, or the message itself, could not be sent
+ */
+boolean addToBatch(unsigned int msgType, byte* data, int len);
+
+/** Sends the messages of the current batch.
+ * @return true if sent, or if there is nothing to send
+ */
+boolean flushBatch();
+
+/** Asks a base for a node identifier, which enables the compact header.
+ * The compact header takes 2 bytes (if the type is below 128) instead of 6.
+ * The identifier comes with the ack of a following message to the base,
+ * then messages between this node and the base use the compact header.
+ * The base keeps the identifiers in RAM: after a restart it rejects the identifiers it does
+ * not know with the ack of the next message, the message is lost and the node asks again by itself.
+ * @param base address of the base
+ * @return true if the request has been sent
+ */
+boolean requestNodeId(long base);
+
+/** Returns the identifier assigned by the base, NO_NODE_ID if none.
+ */
+byte getNodeId();
+
+/** Checks the status of the last transmission.
+ * Must be called in the loop when sendAsync() is used without the IRQ pin.
+ * @return the status of the transmission, see NRF24::NRF24TxStatus
+ */
+NRF24::NRF24TxStatus pollSend();
+
+/** Sets a function that is called when a transmission completes.
+ * With the IRQ pin the function is called from the interrupt handler,
+ * so it must be short and it must not use the radio.
+ * @param f the function, sent is true if the message has been sent, NULL to remove it
+ */
+void setSendCallback(void (*f)(boolean sent));
+
 /** Receives a message.
+ * Messages are passed to the function registered for their type with onMessage(),
+ * or to f if their type is not registered.
  * @param timeoutMS a time-out in milliseconds
- * @param f a function that treats the message with the following parameters:
+ * @param f a function that treats the message, can be NULL, with the following parameters:
  * - broadcast tells if the message was in broadcast
  * - sender the sender address
  * - msgType the message type
- * - data the payload
+ * - data the payload, it points to the receive buffer and is only valid during the call
  * - len the length of the payload
  * @return true if something arrived
  */
 boolean receive(unsigned int timeoutMS, void (*f)(boolean broadcast, long sender, unsigned int msgType, byte* data, int len));
 
+/** Registers the function that treats a type of messages.
+ * The function gets the payload straight from the receive buffer, messages with a length
+ * different from the expected one are dropped before calling it.
+ * Messages received within acks are also passed to the registered functions.
+ * @param msgType the message type, not BATCH_MSG_TYPE
+ * @param expectedLen the length of the payload, ANY_LEN to accept any length
+ * @param handler the function, with the same parameters of the one of receive(), NULL to unregister
+ * @return false if there are already MESSAGE_HANDLERS_LEN functions, or the type is reserved
+ */
+boolean onMessage(unsigned int msgType, int expectedLen, void (*handler)(boolean broadcast, long sender, unsigned int msgType, byte* data, int len));
+
+/** Posts a message in the mailbox of a node that is not always listening.
+ * The message is sent within the ack of the next packet received from the destination,
+ * or by flushMailbox().
+ * A message with the same type of one already waiting for the same node replaces it.
+ * @param destination address of the destination
+ * @param msgType type of message, not BATCH_MSG_TYPE
+ * @param data the payload
+ * @param len length of the payload in bytes, it cannot exceed 26 (!)
+ * @param ttlMS time, in milliseconds, after which the message is dropped if not delivered
+ * @return true if posted, false if the mailbox, or the queue of the node, is full
+ */
+boolean postMessage(long destination, unsigned int msgType, byte* data, int len, unsigned long ttlMS);
+
+/** Sends directly the messages waiting in the mailbox of a node.
+ * Useful right after the node has been heard from, if it listens after sending.
+ * Stops at the first message that cannot be sent.
+ * @param destination the node
+ * @return the number of delivered messages
+ */
+int flushMailbox(long destination);
+
+/** Returns the number of messages waiting in the mailbox of a node.
+ * @param destination the node
+ */
+int getMailboxLength(long destination);
+
+/** Sets the function that treats messages received within acks.
+ * The function is called by send() and pollSend() for types not registered with onMessage(),
+ * the parameters are the same as in receive(),
+ * the sender is the destination of the acknowledged message.
+ * @param f the function, NULL to remove it
+ */
+void setAckMessageHandler(void (*f)(boolean broadcast, long sender, unsigned int msgType, byte* data, int len));
+
 /** Returns the number of sent, and received, packets since the node was started.
  */
 unsigned long getSentCounter();
@@ -82,4 +295,18 @@ unsigned long getUnsentCounter();
  */
 unsigned long getReceivedCounter();
 
+/** Gives the statistics of the link towards a destination.
+ * They cost no extra time: the retransmissions are read when a transmission completes.
+ * They are copied with interrupts disabled, as asynchronous transmissions update them
+ * from the interrupt of the radio.
+ * @param destination the address of the destination
+ * @param stats where the statistics are copied
+ * @return false if nothing has been sent to the destination recently
+ */
+boolean getLinkStats(long destination, LinkStats* stats);
+
+/** Clears the statistics of all links.
+ */
+void resetLinkStats();
+
 #endif // pIoT_PROTOCOL_H_INCLUDED
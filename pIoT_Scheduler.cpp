@@ -0,0 +1,218 @@
+/** Cooperative scheduler for pIoT nodes.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#include <pIoT_Scheduler.h>
+
+/** A timer, timers in the same slot of the wheel are in a list.
+ */
+typedef struct {
+    boolean used;
+    unsigned long deadline; //in schedulerMillis()
+    unsigned long period;
+    void (*f)();
+    byte next; //next timer in the same slot
+} schedulerTimer;
+static schedulerTimer timers[SCHEDULER_TIMERS];
+
+//First timer of each slot, a timer is in the slot of its deadline
+static byte wheel[SCHEDULER_WHEEL_LEN];
+static boolean wheelReady = false;
+//Last tick whose slot has been checked
+static unsigned long lastTick = 0;
+
+//Event sources
+static void (*radioHandler)() = NULL;
+static byte radioPin = NRF24_NO_PIN;
+static void (*serialHandler)() = NULL;
+typedef struct {
+    byte pin;
+    boolean level;
+    void (*f)(byte pin, boolean level);
+} schedulerPin;
+static schedulerPin pins[SCHEDULER_PINS];
+static byte pinsCount = 0;
+
+static boolean sleepEnabled = true;
+//Pins that woke the board up
+static unsigned long wokenPins = 0;
+
+unsigned long schedulerMillis(){
+    return millis() + getTotalSleepMillis();
+}
+
+static void initWheel(){
+    if(wheelReady) return;
+    for(byte i=0; i<SCHEDULER_WHEEL_LEN; i++)
+        wheel[i] = NO_TIMER;
+    lastTick = schedulerMillis() / SCHEDULER_TICK_MS;
+    wheelReady = true;
+}
+
+static void insertTimer(byte id){
+    byte slot = (timers[id].deadline / SCHEDULER_TICK_MS) % SCHEDULER_WHEEL_LEN;
+    timers[id].next = wheel[slot];
+    wheel[slot] = id;
+}
+
+static void removeTimer(byte id){
+    byte* p = &wheel[(timers[id].deadline / SCHEDULER_TICK_MS) % SCHEDULER_WHEEL_LEN];
+    while(*p != NO_TIMER){
+        if(*p == id){
+            *p = timers[id].next;
+            return;
+        }
+        p = &timers[*p].next;
+    }
+}
+
+byte addTimer(unsigned long delayMS, unsigned long periodMS, void (*f)()){
+    if(f == NULL) return NO_TIMER;
+    initWheel();
+    for(byte id=0; id<SCHEDULER_TIMERS; id++){
+        if(timers[id].used) continue;
+        timers[id].used = true;
+        timers[id].deadline = schedulerMillis() + delayMS;
+        timers[id].period = periodMS;
+        timers[id].f = f;
+        insertTimer(id);
+        return id;
+    }
+    return NO_TIMER;
+}
+
+boolean cancelTimer(byte id){
+    if((id >= SCHEDULER_TIMERS) || !timers[id].used) return false;
+    removeTimer(id);
+    timers[id].used = false;
+    return true;
+}
+
+/** Calls the functions of the expired timers.
+ * Only the slots of the ticks passed since the last call are checked,
+ * or all of them once if more than a round of the wheel has passed.
+ * @return true if a function has been called
+ */
+static boolean runTimers(){
+    unsigned long now = schedulerMillis();
+    unsigned long nowTick = now / SCHEDULER_TICK_MS;
+    unsigned long ticks = nowTick - lastTick;
+    if(ticks >= SCHEDULER_WHEEL_LEN) ticks = SCHEDULER_WHEEL_LEN - 1;
+    boolean called = false;
+    //the slot of the last tick is checked again, it may have got new timers
+    for(unsigned long t = nowTick - ticks; t != nowTick + 1; t++){
+        byte slot = t % SCHEDULER_WHEEL_LEN;
+        byte id = wheel[slot];
+        while(id != NO_TIMER){
+            if((long)(timers[id].deadline - now) > 0){
+                id = timers[id].next;
+                continue;
+            }
+            removeTimer(id);
+            if(timers[id].period > 0){
+                //periods missed while busy are skipped
+                do timers[id].deadline += timers[id].period;
+                while((long)(timers[id].deadline - now) <= 0);
+                insertTimer(id);
+            }
+            else timers[id].used = false;
+            timers[id].f();
+            called = true;
+            //the function may have changed the slot
+            id = wheel[slot];
+        }
+    }
+    lastTick = nowTick;
+    return called;
+}
+
+/** Gives the time until the nearest timer.
+ * @return the time in ms, 0 if there are no timers
+ */
+static unsigned long nextDeadline(){
+    unsigned long now = schedulerMillis();
+    unsigned long wait = 0;
+    for(byte id=0; id<SCHEDULER_TIMERS; id++){
+        if(!timers[id].used) continue;
+        long left = timers[id].deadline - now;
+        if(left < 1) left = 1;
+        if((wait == 0) || ((unsigned long)left < wait)) wait = left;
+    }
+    return wait;
+}
+
+void onRadioEvent(byte irqPin, void (*f)()){
+    radioHandler = f;
+    radioPin = irqPin;
+}
+
+boolean onPinChange(byte pin, void (*f)(byte pin, boolean level)){
+    for(byte i=0; i<pinsCount; i++){
+        if(pins[i].pin == pin){
+            pins[i].f = f;
+            return true;
+        }
+    }
+    if(pinsCount == SCHEDULER_PINS) return false;
+    pins[pinsCount].pin = pin;
+    pins[pinsCount].level = digitalRead(pin);
+    pins[pinsCount].f = f;
+    pinsCount++;
+    return true;
+}
+
+void onSerialEvent(void (*f)()){
+    serialHandler = f;
+}
+
+void setSchedulerSleep(boolean enable){
+    sleepEnabled = enable;
+}
+
+void runScheduler(){
+    initWheel();
+    boolean busy = runTimers();
+
+    if((radioHandler != NULL) && nRF24.available()){
+        radioHandler();
+        busy = true;
+    }
+    for(byte i=0; i<pinsCount; i++){
+        boolean level = digitalRead(pins[i].pin);
+        //a short pulse may have woken the board up without changing the level
+        if((level != pins[i].level) || (wokenPins & (1UL << pins[i].pin))){
+            pins[i].level = level;
+            if(pins[i].f != NULL) pins[i].f(pins[i].pin, level);
+            busy = true;
+        }
+    }
+    wokenPins = 0;
+    if((serialHandler != NULL) && (Serial.available() > 0)){
+        serialHandler();
+        busy = true;
+    }
+
+    if(busy) return;
+    //when idle the radio is left receiving
+    if(radioHandler != NULL) nRF24.powerUpRx();
+    if(!sleepEnabled || (serialHandler != NULL)) return;
+
+    int wakePins[SCHEDULER_PINS + 1];
+    int wakePinsN = 0;
+    for(byte i=0; i<pinsCount; i++)
+        wakePins[wakePinsN++] = pins[i].pin;
+    if((radioHandler != NULL) && (radioPin != NRF24_NO_PIN))
+        wakePins[wakePinsN++] = radioPin;
+
+    unsigned long wait = nextDeadline();
+    //nothing would wake the board up
+    if((wait == 0) && (wakePinsN == 0)) return;
+    //too short to sleep
+    if((wait > 0) && (wait < WDT_MIN_PERIOD_MS)) return;
+
+    //the serial port stops while sleeping
+    Serial.flush();
+    if(sleepUntilPins(wait, wakePinsN, wakePins) == WAKE_PIN) wokenPins = getWakePins();
+}
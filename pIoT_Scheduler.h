@@ -0,0 +1,105 @@
+/** Cooperative scheduler for pIoT nodes.
+ * Timers, one-shot or periodic, are kept in a timer wheel in static memory.
+ * Events come from the radio, from pins and from the serial port.
+ * runScheduler() is called in the loop: it calls the functions of the expired
+ * timers and of the events and, when there is nothing to do, it sleeps until
+ * the nearest deadline or until a pin (radio IRQ included) changes.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#ifndef pIoT_SCHEDULER_H_INCLUDED
+#define pIoT_SCHEDULER_H_INCLUDED
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <wiring.h>
+#include <pins_arduino.h>
+#endif
+
+#include <nRF24.h>
+#include <pIoT_Energy.h>
+
+//Maximum number of timers
+//Can be pre-defined to a smaller size (to save SRAM) prior to including this header
+#ifndef SCHEDULER_TIMERS
+#define SCHEDULER_TIMERS 8
+#endif
+
+//Number of slots of the timer wheel, and time covered by each slot in ms
+//Can be pre-defined prior to including this header
+#ifndef SCHEDULER_WHEEL_LEN
+#define SCHEDULER_WHEEL_LEN 16
+#endif
+#ifndef SCHEDULER_TICK_MS
+#define SCHEDULER_TICK_MS 16
+#endif
+
+//Maximum number of pins whose changes are events
+//Can be pre-defined to a smaller size (to save SRAM) prior to including this header
+#ifndef SCHEDULER_PINS
+#define SCHEDULER_PINS 4
+#endif
+
+//Returned when a timer cannot be added
+#define NO_TIMER 0xFF
+
+/** Gives the time since the board has been switched on, sleep included.
+ * @return the time in milliseconds
+ */
+unsigned long schedulerMillis();
+
+/** Adds a timer.
+ * @param delayMS milliseconds after which the function is called the first time
+ * @param periodMS milliseconds between the following calls, 0 for a one-shot timer
+ * @param f the function
+ * @return the identifier of the timer, NO_TIMER if there are already SCHEDULER_TIMERS timers
+ */
+byte addTimer(unsigned long delayMS, unsigned long periodMS, void (*f)());
+
+/** Removes a timer.
+ * One-shot timers are removed automatically after their call.
+ * @param id the identifier of the timer
+ * @return false if the timer does not exist
+ */
+boolean cancelTimer(byte id);
+
+/** Sets the function called when the radio has received something.
+ * The function is expected to call receive().
+ * @param irqPin the pin connected to the IRQ line of the radio, it wakes up the
+ * board while sleeping, NRF24_NO_PIN if not connected: then the radio is only checked between sleeps
+ * @param f the function, NULL to remove it
+ */
+void onRadioEvent(byte irqPin, void (*f)());
+
+/** Sets a function called when a pin changes level.
+ * Pins also wake up the board while sleeping.
+ * @param pin the pin, 0 to 19
+ * @param f the function, with the pin and its new level
+ * @return false if there are already SCHEDULER_PINS pins
+ */
+boolean onPinChange(byte pin, void (*f)(byte pin, boolean level));
+
+/** Sets the function called when something arrives on the serial port.
+ * While it is set the board does not sleep, as the serial port would not receive.
+ * @param f the function, which is expected to read the serial port (e.g. with readSerial()), NULL to remove it
+ */
+void onSerialEvent(void (*f)());
+
+/** Enables sleeping when there is nothing to do, it is enabled by default.
+ * @param enable false to keep the MCU awake
+ */
+void setSchedulerSleep(boolean enable);
+
+/** Runs the scheduler once, to be called in the loop.
+ * It calls the functions of the expired timers and of the events, if there are
+ * none and sleeping is enabled, it sleeps until the next timer or until a pin changes.
+ * The time slept before a pin change counts towards the timers, which may be called late
+ * by up to 16ms * 2^WDT_PIN_MAX_PRESCALER (see getTotalSleepMillis()).
+ * When idle, the radio is left receiving if a radio function is set.
+ */
+void runScheduler();
+
+#endif // pIoT_SCHEDULER_H_INCLUDED
@@ -0,0 +1,254 @@
+/** Message schemas for pIoT.
+ * A message is declared once, as a list of fields, and gets:
+ * - a struct with the fields
+ * - packing and unpacking of the payload, little endian, independent of the struct layout
+ * - a JSON serializer and parser for the base
+ * Everything is generated at compile time, names are kept in flash.
+ * Outside Arduino only the structs are declared, so that they can be used on a host.
+ *
+ * Example:
+ *   #define LIGHT_MESSAGE_FIELDS(FIELD) \
+ *     FIELD(int16_t, intensity, "intensity")
+ *   PIOT_MESSAGE(lightMessage, 100, "LightState", LIGHT_MESSAGE_FIELDS)
+ *
+ * Each FIELD has the C type, the name of the member and the name in JSON.
+ * Supported types are bool, int8_t, uint8_t, int16_t, uint16_t, int32_t, uint32_t and float:
+ * types whose size changes with the platform (int, long, double) are refused at compile time.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#ifndef pIoT_SCHEMA_H_INCLUDED
+#define pIoT_SCHEMA_H_INCLUDED
+
+#ifdef ARDUINO
+#include <pIoT_Protocol.h>
+#else
+//On a host only the structs are available, for the server side and the host tests
+#ifndef FRAGMENT_MAX_LEN
+#define FRAGMENT_MAX_LEN 128
+#endif
+#endif
+#include <pIoT_JSON.h>
+
+/** Size of each supported type in the payload.
+ */
+template<class T> struct pIoTWire;
+template<> struct pIoTWire<bool> { enum { len = 1 }; };
+template<> struct pIoTWire<int8_t> { enum { len = 1 }; };
+template<> struct pIoTWire<uint8_t> { enum { len = 1 }; };
+template<> struct pIoTWire<int16_t> { enum { len = 2 }; };
+template<> struct pIoTWire<uint16_t> { enum { len = 2 }; };
+template<> struct pIoTWire<int32_t> { enum { len = 4 }; };
+template<> struct pIoTWire<uint32_t> { enum { len = 4 }; };
+template<> struct pIoTWire<float> { enum { len = 4 }; };
+
+//Packing, little endian
+inline byte* pIoTPack(byte* p, uint32_t v, byte len){
+    for(byte i=0; i<len; i++){
+        p[i] = v & 0xFF;
+        v >>= 8;
+    }
+    return p + len;
+}
+inline byte* pIoTPack(byte* p, bool v){ *p = v ? 1 : 0; return p + 1; }
+inline byte* pIoTPack(byte* p, int8_t v){ *p = (byte)v; return p + 1; }
+inline byte* pIoTPack(byte* p, uint8_t v){ *p = v; return p + 1; }
+inline byte* pIoTPack(byte* p, int16_t v){ return pIoTPack(p, (uint32_t)(uint16_t)v, 2); }
+inline byte* pIoTPack(byte* p, uint16_t v){ return pIoTPack(p, (uint32_t)v, 2); }
+inline byte* pIoTPack(byte* p, int32_t v){ return pIoTPack(p, (uint32_t)v, 4); }
+inline byte* pIoTPack(byte* p, uint32_t v){ return pIoTPack(p, v, 4); }
+inline byte* pIoTPack(byte* p, float v){
+    uint32_t bits;
+    memcpy(&bits, &v, 4);
+    return pIoTPack(p, bits, 4);
+}
+
+//Unpacking, little endian
+inline uint32_t pIoTUnpack(const byte* p, byte len){
+    uint32_t v = 0;
+    for(byte i=len; i>0; i--)
+        v = (v << 8) | p[i-1];
+    return v;
+}
+inline const byte* pIoTUnpack(const byte* p, bool& v){ v = (*p != 0); return p + 1; }
+inline const byte* pIoTUnpack(const byte* p, int8_t& v){ v = (int8_t)*p; return p + 1; }
+inline const byte* pIoTUnpack(const byte* p, uint8_t& v){ v = *p; return p + 1; }
+inline const byte* pIoTUnpack(const byte* p, int16_t& v){ v = (int16_t)pIoTUnpack(p, 2); return p + 2; }
+inline const byte* pIoTUnpack(const byte* p, uint16_t& v){ v = (uint16_t)pIoTUnpack(p, 2); return p + 2; }
+inline const byte* pIoTUnpack(const byte* p, int32_t& v){ v = (int32_t)pIoTUnpack(p, 4); return p + 4; }
+inline const byte* pIoTUnpack(const byte* p, uint32_t& v){ v = pIoTUnpack(p, 4); return p + 4; }
+inline const byte* pIoTUnpack(const byte* p, float& v){
+    uint32_t bits = pIoTUnpack(p, 4);
+    memcpy(&v, &bits, 4);
+    return p + 4;
+}
+
+/** Longest text of each supported type in JSON.
+ * Floats have 2 decimals and at most 10 digits (see JSONwriteDouble()), plus sign and point.
+ */
+template<class T> struct pIoTJSONWidth;
+template<> struct pIoTJSONWidth<bool> { enum { len = 5 }; };
+template<> struct pIoTJSONWidth<int8_t> { enum { len = 4 }; };
+template<> struct pIoTJSONWidth<uint8_t> { enum { len = 3 }; };
+template<> struct pIoTJSONWidth<int16_t> { enum { len = 6 }; };
+template<> struct pIoTJSONWidth<uint16_t> { enum { len = 5 }; };
+template<> struct pIoTJSONWidth<int32_t> { enum { len = 11 }; };
+template<> struct pIoTJSONWidth<uint32_t> { enum { len = 10 }; };
+template<> struct pIoTJSONWidth<float> { enum { len = 12 }; };
+
+//JSON values
+inline void pIoTWrite(JSONWriter* w, PGM_P name, bool v){ JSONwriteBoolean(w, name, v); }
+inline void pIoTWrite(JSONWriter* w, PGM_P name, int8_t v){ JSONwriteLong(w, name, v); }
+inline void pIoTWrite(JSONWriter* w, PGM_P name, uint8_t v){ JSONwriteULong(w, name, v); }
+inline void pIoTWrite(JSONWriter* w, PGM_P name, int16_t v){ JSONwriteLong(w, name, v); }
+inline void pIoTWrite(JSONWriter* w, PGM_P name, uint16_t v){ JSONwriteULong(w, name, v); }
+inline void pIoTWrite(JSONWriter* w, PGM_P name, int32_t v){ JSONwriteLong(w, name, v); }
+inline void pIoTWrite(JSONWriter* w, PGM_P name, uint32_t v){ JSONwriteULong(w, name, v); }
+inline void pIoTWrite(JSONWriter* w, PGM_P name, float v){ JSONwriteDouble(w, name, v, 2); }
+
+inline void pIoTParse(char* s, bool& v){ v = (toupper(s[0]) == 'T'); }
+inline void pIoTParse(char* s, int8_t& v){ v = strtol(s, NULL, 10); }
+inline void pIoTParse(char* s, uint8_t& v){ v = strtoul(s, NULL, 10); }
+inline void pIoTParse(char* s, int16_t& v){ v = strtol(s, NULL, 10); }
+inline void pIoTParse(char* s, uint16_t& v){ v = strtoul(s, NULL, 10); }
+inline void pIoTParse(char* s, int32_t& v){ v = strtol(s, NULL, 10); }
+inline void pIoTParse(char* s, uint32_t& v){ v = strtoul(s, NULL, 10); }
+inline void pIoTParse(char* s, float& v){ v = strtod(s, NULL); }
+
+//Code generated for each field
+#define PIOT_FIELD_DECLARE(type, member, json) type member;
+#define PIOT_FIELD_LEN(type, member, json) + pIoTWire<type>::len
+#define PIOT_FIELD_PACK(type, member, json) p = pIoTPack(p, member);
+#define PIOT_FIELD_UNPACK(type, member, json) p = pIoTUnpack(p, member);
+//,"json": and the value
+#define PIOT_FIELD_JSON_LEN(type, member, json) + (sizeof(json) + 3) + pIoTJSONWidth<type>::len
+#define PIOT_FIELD_WRITE(type, member, json) pIoTWrite(writer, PSTR(json), member);
+#define PIOT_FIELD_PARSE(type, member, json) entry = JSONfind_P(index, PSTR(json)); \
+    if(entry != NULL) pIoTParse(entry->value, member);
+
+/** Declares a message.
+ * @param name the name of the generated struct
+ * @param type the message type
+ * @param json the name of the JSON object
+ * @param FIELDS a macro that lists the fields, see the example above
+ */
+#define PIOT_MESSAGE(name, type, json, FIELDS) \
+struct name { \
+    FIELDS(PIOT_FIELD_DECLARE) \
+    enum { msgType = type }; \
+    /** Length of the payload in bytes */ \
+    enum { packedLen = 0 FIELDS(PIOT_FIELD_LEN) }; \
+    /** Size of the buffer for the longest JSON line: {"json":{ the sender, the fields, }} new line and terminator */ \
+    enum { jsonLen = (sizeof(json) + 4) + (sizeof("\"sourceAddress\":") - 1 + 11) FIELDS(PIOT_FIELD_JSON_LEN) + 5 }; \
+    /** Writes the payload, buf must be packedLen bytes long, returns its length */ \
+    int pack(byte* buf) const { \
+        byte* p = buf; \
+        FIELDS(PIOT_FIELD_PACK) \
+        return p - buf; \
+    } \
+    /** Reads the payload, returns false if the length is not packedLen */ \
+    boolean unpack(const byte* buf, int len) { \
+        if(len != packedLen) return false; \
+        const byte* p = buf; \
+        FIELDS(PIOT_FIELD_UNPACK) \
+        return true; \
+    } \
+    /** Writes the message as JSON object, with the address of the sender, returns false if it does not fit */ \
+    boolean writeJSON(JSONWriter* writer, long sender) const { \
+        JSONwriteObjectStart(writer, NULL); \
+        JSONwriteObjectStart(writer, PSTR(json)); \
+        JSONwriteLong(writer, PSTR("sourceAddress"), sender); \
+        FIELDS(PIOT_FIELD_WRITE) \
+        JSONwriteObjectEnd(writer); \
+        JSONwriteObjectEnd(writer); \
+        return !writer->overflow; \
+    } \
+    /** Prints the message as JSON object, with the address of the sender, on a single line and with a single write, \
+     * the buffer is sized for the widest values, returns false if it does not fit anyway (see getJSONOverflowCounter()) */ \
+    boolean printJSON(Print& out, long sender) const { \
+        char buf[jsonLen]; \
+        JSONWriter writer; \
+        JSONwriterInit(&writer, buf, sizeof(buf)); \
+        writeJSON(&writer, sender); \
+        return JSONwriteLine(&writer, out); \
+    } \
+    /** Reads the fields found in a JSON index, the others are left unchanged */ \
+    void parseJSON(JSONIndex* index) { \
+        JSONEntry* entry; \
+        FIELDS(PIOT_FIELD_PARSE) \
+    } \
+    /** Reads the fields found in a JSON string, the others are left unchanged */ \
+    void parseJSON(char* msg) { \
+        JSONIndex index; \
+        JSONindex(msg, &index); \
+        parseJSON(&index); \
+    } \
+    /** Tells if a JSON object name is the one of this message */ \
+    static boolean isJSONName(const char* dataName) { \
+        return strcasecmp_P(dataName, PSTR(json)) == 0; \
+    } \
+}; \
+static_assert(name::packedLen <= FRAGMENT_MAX_LEN, #name " is longer than FRAGMENT_MAX_LEN");
+
+#ifdef ARDUINO
+
+/** Sends a message declared with PIOT_MESSAGE, see send().
+ */
+template<class M> boolean sendMessage(boolean broadcast, long destination, const M& msg){
+    byte buf[M::packedLen];
+    msg.pack(buf);
+    return send(broadcast, destination, M::msgType, buf, M::packedLen);
+}
+
+/** Posts a message declared with PIOT_MESSAGE in a mailbox, see postMessage().
+ */
+template<class M> boolean postMessage(long destination, const M& msg, unsigned long ttlMS){
+    byte buf[M::packedLen];
+    msg.pack(buf);
+    return postMessage(destination, M::msgType, buf, M::packedLen, ttlMS);
+}
+
+/** Adds a message declared with PIOT_MESSAGE to the current batch, see addToBatch().
+ */
+template<class M> boolean addToBatch(const M& msg){
+    byte buf[M::packedLen];
+    msg.pack(buf);
+    return addToBatch(M::msgType, buf, M::packedLen);
+}
+
+template<class M, void (*H)(boolean broadcast, long sender, M& msg)>
+void pIoTUnpackAndCall(boolean broadcast, long sender, unsigned int msgType, byte* data, int len){
+    M msg;
+    if(msg.unpack(data, len))
+        H(broadcast, sender, msg);
+}
+
+/** Registers a function for a message declared with PIOT_MESSAGE, see onMessage().
+ * Usage: onMessage<lightMessage, handleLight>(); with
+ * void handleLight(boolean broadcast, long sender, lightMessage& msg)
+ */
+template<class M, void (*H)(boolean broadcast, long sender, M& msg)>
+boolean onMessage(){
+    return onMessage(M::msgType, M::packedLen, pIoTUnpackAndCall<M, H>);
+}
+
+template<class M>
+void pIoTPrintJSON(boolean broadcast, long sender, unsigned int msgType, byte* data, int len){
+    M msg;
+    if(msg.unpack(data, len))
+        msg.printJSON(Serial, sender);
+}
+
+/** Registers a function that prints messages declared with PIOT_MESSAGE as JSON on the serial port.
+ * Useful for bases, usage: onMessageToJSON<lightMessage>();
+ */
+template<class M>
+boolean onMessageToJSON(){
+    return onMessage(M::msgType, M::packedLen, pIoTPrintJSON<M>);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,312 @@
+/** Host benchmarks of the parts of pIoT that do not depend on Arduino.
+ * Each scenario runs BENCH_SAMPLES batches of BENCH_BATCH operations and prints one
+ * CSV line, so that results can be collected and compared over time:
+ * scenario,ops,ops_per_s,p50_ns,p99_ns,bytes_per_op,bytes_per_us,line_ops_per_s
+ * - json_write: a message formatted as JSON by the gateway code, with the writer
+ * - json_print: the hello message printed on the serial port with the writer, a single write
+ * - json_index: the JSON index of the hello message, bytes_per_us is its speed
+ * - text_print: the hello message sent by the base to the server as text, with the sequence
+ *   of print() calls that the base used before the binary link
+ * - binary_frame: the same message sent as a binary frame, COBS and CRC
+ * - text_read: the text read by the server, framed, indexed and parsed
+ * - binary_read: the binary frame read by the server, checked and unpacked
+ * p50_ns and p99_ns are the time of an operation, from the time of the batches.
+ * line_ops_per_s is how many operations a serial line at BENCH_BAUD carries, 8N1.
+ * The host is much faster than the ATmega, the ratios between scenarios are what matters,
+ * but floats are in hardware on the host: print(), which formats them a digit at a time
+ * with floating point operations, costs relatively more on the ATmega.
+ * Build and run with: make -C tests bench
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+
+#include <pIoT_Binary.h>
+#include <pIoT_JSON.h>
+#include <pIoT_Messages.h>
+
+//Number of batches, and operations in each of them
+#define BENCH_SAMPLES 200
+#define BENCH_BATCH 1000
+
+//Speed of the serial line of the gateway
+#define BENCH_BAUD 57600
+
+//Address of the sender of the messages
+#define BENCH_ADDR 1001
+
+static double samples[BENCH_SAMPLES];
+
+/** Gives a monotonic time.
+ * @return the time in nanoseconds
+ */
+static double nowNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//Keeps the results alive, so that the compiler cannot drop the work
+static volatile unsigned long sink;
+
+/** Prints a line of results, the samples are the times of the batches.
+ * @param scenario the name of the scenario
+ * @param bytes the bytes processed or produced by an operation
+ */
+static void report(const char* scenario, int bytes) {
+    double total = 0;
+    for(int i = 0; i < BENCH_SAMPLES; i++) total += samples[i];
+    std::sort(samples, samples + BENCH_SAMPLES);
+    double ops = (double)BENCH_SAMPLES * BENCH_BATCH;
+    double opsPerS = ops * 1e9 / total;
+    printf("%s,%.0f,%.0f,%.1f,%.1f,%d,%.1f,%.1f\n", scenario, ops, opsPerS,
+           samples[BENCH_SAMPLES / 2] / BENCH_BATCH, samples[(BENCH_SAMPLES * 99) / 100] / BENCH_BATCH,
+           bytes, opsPerS * bytes / 1e6,
+           std::min(opsPerS, bytes > 0 ? BENCH_BAUD / 10.0 / bytes : opsPerS));
+}
+
+/** The serial port, a write per byte as HardwareSerial, with the print() of Arduino,
+ * so that the text path costs what it costs on the base.
+ */
+class SerialSink : public Print {
+public:
+    uint8_t last[256];
+    int len;
+    SerialSink() : len(0) {}
+    virtual size_t write(uint8_t c) {
+        last[len++ & 0xFF] = c;
+        return 1;
+    }
+    size_t write(const uint8_t* buffer, size_t size) {
+        for(size_t i = 0; i < size; i++) write(buffer[i]);
+        return size;
+    }
+    size_t print(const char* str) {
+        return write((const uint8_t*)str, strlen(str));
+    }
+    size_t print(char c) {
+        return write((uint8_t)c);
+    }
+    size_t print(unsigned long n) {
+        char buf[11];
+        char* str = &buf[sizeof(buf) - 1];
+        *str = '\0';
+        do {
+            *--str = '0' + n % 10;
+            n /= 10;
+        } while(n);
+        return print(str);
+    }
+    size_t print(long n) {
+        if(n >= 0) return print((unsigned long)n);
+        return print('-') + print((unsigned long)-n);
+    }
+    //as Print::printFloat(), a digit at a time
+    size_t print(double number, uint8_t digits = 2) {
+        if(isnan(number)) return print("nan");
+        size_t n = 0;
+        if(number < 0.0) {
+            n += print('-');
+            number = -number;
+        }
+        double rounding = 0.5;
+        for(uint8_t i = 0; i < digits; i++) rounding /= 10.0;
+        number += rounding;
+        unsigned long intPart = (unsigned long)number;
+        double remainder = number - (double)intPart;
+        n += print(intPart);
+        if(digits > 0) n += print('.');
+        while(digits-- > 0) {
+            remainder *= 10.0;
+            unsigned long toPrint = (unsigned long)remainder;
+            n += print(toPrint);
+            remainder -= toPrint;
+        }
+        return n;
+    }
+};
+
+/** The hello message sent to the server in the benchmarks.
+ */
+static void fillHello(helloMessage* hm, int i) {
+    hm->internalTemp = 23.5 + (i & 7);
+    hm->internalVcc = 3.28;
+    hm->operationTime = 123456 + i;
+    hm->sentMsgs = 1000 + i;
+    hm->unsentMsgs = 3;
+    hm->receivedMsgs = 200 + i;
+}
+
+/** Prints the hello message as the base did before the JSON writer and the binary link.
+ */
+static int printHello(SerialSink& out, const helloMessage& hm, long sender) {
+    int n = out.print("{ \"Hello\": { \"sourceAddress\":");
+    n += out.print(sender);
+    n += out.print(", \"temperature\":");
+    n += out.print(hm.internalTemp);
+    n += out.print(", \"vcc\":");
+    n += out.print(hm.internalVcc);
+    n += out.print(", \"operationTime\":");
+    n += out.print((unsigned long)hm.operationTime);
+    n += out.print(", \"sentMessages\":");
+    n += out.print((unsigned long)hm.sentMsgs);
+    n += out.print(", \"unsentMessages\":");
+    n += out.print((unsigned long)hm.unsentMsgs);
+    n += out.print(", \"receivedMessages\":");
+    n += out.print((unsigned long)hm.receivedMsgs);
+    n += out.print(" }}\r\n");
+    return n;
+}
+
+static void benchTextPrint() {
+    helloMessage hm;
+    SerialSink out;
+    int len = 0;
+    for(int s = 0; s < BENCH_SAMPLES; s++){
+        double t = nowNS();
+        for(int i = 0; i < BENCH_BATCH; i++){
+            fillHello(&hm, i);
+            len = printHello(out, hm, BENCH_ADDR);
+        }
+        samples[s] = nowNS() - t;
+    }
+    sink += out.len;
+    report("text_print", len);
+}
+
+static void benchBinaryFrame() {
+    helloMessage hm;
+    SerialSink out;
+    byte payload[helloMessage::packedLen];
+    uint8_t frame[BINARY_FRAME_LEN];
+    int len = 0;
+    for(int s = 0; s < BENCH_SAMPLES; s++){
+        double t = nowNS();
+        for(int i = 0; i < BENCH_BATCH; i++){
+            fillHello(&hm, i);
+            hm.pack(payload);
+            len = binaryEncodeFrame(BENCH_ADDR, helloMessage::msgType, 0, payload, sizeof(payload), frame);
+            out.write(frame, len);
+        }
+        samples[s] = nowNS() - t;
+    }
+    sink += out.len;
+    report("binary_frame", len);
+}
+
+static void benchTextRead() {
+    helloMessage hm;
+    fillHello(&hm, 0);
+    SerialSink out;
+    int len = printHello(out, hm, BENCH_ADDR);
+    char line[256];
+    memcpy(line, out.last, len);
+    JSONFramer framer;
+    JSONframerReset(&framer);
+    for(int s = 0; s < BENCH_SAMPLES; s++){
+        double t = nowNS();
+        for(int i = 0; i < BENCH_BATCH; i++){
+            JSONframerWrite(&framer, line, len);
+            JSONIndex index;
+            JSONindex(framer.buffer, &index);
+            hm.parseJSON(&index);
+            sink += hm.sentMsgs;
+        }
+        samples[s] = nowNS() - t;
+    }
+    report("text_read", len);
+}
+
+static void benchBinaryRead() {
+    helloMessage hm;
+    fillHello(&hm, 0);
+    byte payload[helloMessage::packedLen];
+    hm.pack(payload);
+    uint8_t frame[BINARY_FRAME_LEN];
+    int len = binaryEncodeFrame(BENCH_ADDR, helloMessage::msgType, 0, payload, sizeof(payload), frame);
+    BinaryFramer framer;
+    binaryFramerReset(&framer);
+    for(int s = 0; s < BENCH_SAMPLES; s++){
+        double t = nowNS();
+        for(int i = 0; i < BENCH_BATCH; i++){
+            for(int b = 0; b < len; b++)
+                if(binaryFramerFeed(&framer, frame[b])) hm.unpack(framer.data, framer.dataLen);
+            sink += hm.sentMsgs;
+        }
+        samples[s] = nowNS() - t;
+    }
+    report("binary_read", len);
+}
+
+static void benchJSONWrite() {
+    lightMessage lm;
+    char buf[lightMessage::jsonLen];
+    JSONWriter writer;
+    int len = 0;
+    for(int s = 0; s < BENCH_SAMPLES; s++){
+        double t = nowNS();
+        for(int i = 0; i < BENCH_BATCH; i++){
+            lm.intensity = i;
+            JSONwriterInit(&writer, buf, sizeof(buf));
+            lm.writeJSON(&writer, BENCH_ADDR);
+            len = writer.len;
+            sink += buf[len / 2];
+        }
+        samples[s] = nowNS() - t;
+    }
+    report("json_write", len);
+}
+
+static void benchJSONPrint() {
+    helloMessage hm;
+    SerialSink out;
+    int len = 0;
+    for(int s = 0; s < BENCH_SAMPLES; s++){
+        double t = nowNS();
+        for(int i = 0; i < BENCH_BATCH; i++){
+            fillHello(&hm, i);
+            int before = out.len;
+            hm.printJSON(out, BENCH_ADDR);
+            len = out.len - before;
+        }
+        samples[s] = nowNS() - t;
+    }
+    sink += out.len;
+    report("json_print", len);
+}
+
+static void benchJSONIndex() {
+    helloMessage hm;
+    fillHello(&hm, 0);
+    char line[helloMessage::jsonLen];
+    JSONWriter writer;
+    JSONwriterInit(&writer, line, sizeof(line));
+    hm.writeJSON(&writer, BENCH_ADDR);
+    JSONIndex index;
+    for(int s = 0; s < BENCH_SAMPLES; s++){
+        double t = nowNS();
+        for(int i = 0; i < BENCH_BATCH; i++){
+            JSONindex(line, &index);
+            sink += index.count;
+        }
+        samples[s] = nowNS() - t;
+    }
+    report("json_index", writer.len);
+}
+
+int main() {
+    printf("scenario,ops,ops_per_s,p50_ns,p99_ns,bytes_per_op,bytes_per_us,line_ops_per_s\n");
+    benchJSONWrite();
+    benchJSONPrint();
+    benchJSONIndex();
+    benchTextPrint();
+    benchBinaryFrame();
+    benchTextRead();
+    benchBinaryRead();
+    return 0;
+}
@@ -0,0 +1,499 @@
+/** Host tests of the parts of pIoT that do not depend on Arduino:
+ * the binary codec (pIoT_Binary), the packet headers (pIoT_Header), the JSON index,
+ * framer and writer (pIoT_JSON) and the messages declared with PIOT_MESSAGE (pIoT_Schema).
+ * The index and the framers are also fed with broken inputs, from a seeded generator.
+ * Build and run with: make -C tests, or make -C tests sanitize to catch accesses out of bounds
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+
+#include <pIoT_Binary.h>
+#include <pIoT_Header.h>
+#include <pIoT_JSON.h>
+#include <pIoT_Messages.h>
+
+static int failures = 0;
+static int checks = 0;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if(!(cond)) { \
+        failures++; \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while(0)
+
+/** Collects what is written, as the serial port would.
+ */
+class StringPrint : public Print {
+public:
+    std::string text;
+    int writes;
+    StringPrint() : writes(0) {}
+    size_t write(const uint8_t* buffer, size_t size) {
+        text.append((const char*)buffer, size);
+        writes++;
+        return size;
+    }
+};
+
+/** Feeds bytes to a binary framer, returns the number of frames completed.
+ */
+static int feedBinary(BinaryFramer* framer, const uint8_t* data, int len) {
+    int frames = 0;
+    for(int i = 0; i < len; i++)
+        frames += binaryFramerFeed(framer, data[i]);
+    return frames;
+}
+
+static void testBinaryRoundTrip() {
+    uint8_t payload[BINARY_MAX_PAYLOAD];
+    for(int i = 0; i < BINARY_MAX_PAYLOAD; i++)
+        payload[i] = (i % 3 == 0) ? 0 : i; //zeros have to be stuffed
+    uint8_t frame[BINARY_FRAME_LEN];
+    BinaryFramer framer;
+    binaryFramerReset(&framer);
+
+    int lens[] = {0, 1, 26, BINARY_MAX_PAYLOAD};
+    for(unsigned int t = 0; t < sizeof(lens) / sizeof(lens[0]); t++) {
+        int len = binaryEncodeFrame(-2130771712, 0x7FFE, BINARY_FLAG_BROADCAST, payload, lens[t], frame);
+        CHECK(len > 0);
+        CHECK(len <= BINARY_FRAME_LEN);
+        CHECK(frame[len - 1] == 0);
+        CHECK(memchr(frame, 0, len - 1) == NULL);
+        CHECK(feedBinary(&framer, frame, len) == 1);
+        CHECK(framer.address == -2130771712);
+        CHECK(framer.msgType == 0x7FFE);
+        CHECK(framer.flags == BINARY_FLAG_BROADCAST);
+        CHECK(framer.dataLen == lens[t]);
+        CHECK(memcmp(framer.data, payload, lens[t]) == 0);
+    }
+
+    //too long
+    uint8_t big[BINARY_MAX_PAYLOAD + 1] = {0};
+    CHECK(binaryEncodeFrame(1, 1, 0, big, BINARY_MAX_PAYLOAD + 1, frame) == 0);
+
+    //a corrupted frame is dropped, the next one is read
+    int len = binaryEncodeFrame(1234, 100, 0, payload + 1, 2, frame);
+    frame[3] ^= 0x01;
+    CHECK(feedBinary(&framer, frame, len) == 0);
+    len = binaryEncodeFrame(1234, 100, 0, payload + 1, 2, frame);
+    CHECK(feedBinary(&framer, frame, len) == 1);
+    CHECK(framer.address == 1234);
+}
+
+static void testCOBS() {
+    uint8_t in[600];
+    uint8_t enc[610];
+    uint8_t dec[600];
+    //runs longer than 254 bytes without zeros need extra code bytes
+    for(int i = 0; i < 600; i++)
+        in[i] = (i == 300) ? 0 : 1 + (i % 255);
+    int elen = binaryCOBSEncode(in, 600, enc);
+    CHECK(elen <= 600 + 600 / 254 + 1);
+    CHECK(memchr(enc, 0, elen) == NULL);
+    CHECK(binaryCOBSDecode(enc, elen, dec) == 600);
+    CHECK(memcmp(in, dec, 600) == 0);
+}
+
+static void testVarint() {
+    struct { unsigned int value; int len; uint8_t bytes[VARINT_MAX_LEN]; } cases[] = {
+        {0, 1, {0x00}},
+        {127, 1, {0x7F}},
+        {128, 2, {0x80, 0x01}},
+        {0x7FFE, 3, {0xFE, 0xFF, 0x01}},
+        {0xFFFF, 3, {0xFF, 0xFF, 0x03}},
+    };
+    for(unsigned int t = 0; t < sizeof(cases) / sizeof(cases[0]); t++) {
+        uint8_t buf[VARINT_MAX_LEN + 1] = {0};
+        CHECK(writeVarint(cases[t].value, buf) == cases[t].len);
+        CHECK(memcmp(buf, cases[t].bytes, cases[t].len) == 0);
+        unsigned int value = 0;
+        CHECK(readVarint(buf, cases[t].len, &value) == cases[t].len);
+        CHECK(value == cases[t].value);
+        //truncated
+        CHECK(readVarint(buf, cases[t].len - 1, &value) == 0);
+    }
+    //longer than VARINT_MAX_LEN
+    uint8_t longer[] = {0x80, 0x80, 0x80, 0x01};
+    unsigned int value;
+    CHECK(readVarint(longer, sizeof(longer), &value) == 0);
+}
+
+static void testHeaderRoundTrip() {
+    const uint8_t address[4] = {0x04, 0x03, 0x02, 0x81};
+    unsigned int types[] = {0, 127, 128, 0x7FFE, 0xFFFF};
+    for(unsigned int t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        uint8_t pkt[FULL_HEADER_LEN + 1];
+        uint8_t nodeId = 0;
+        long sender = 0;
+        unsigned int msgType = 0;
+
+        int len = packHeader(true, 42, address, types[t], pkt);
+        CHECK((len >= 2) && (len <= COMPACT_HEADER_MAX_LEN));
+        CHECK(pkt[0] == 42);
+        CHECK(parseHeader(true, pkt, len, &nodeId, &sender, &msgType) == len);
+        CHECK(nodeId == 42);
+        CHECK(msgType == types[t]);
+        CHECK(parseHeader(true, pkt, len - 1, &nodeId, &sender, &msgType) == 0);
+
+        len = packHeader(false, 42, address, types[t], pkt);
+        CHECK(len == FULL_HEADER_LEN);
+        CHECK(memcmp(pkt, address, 4) == 0);
+        CHECK(parseHeader(false, pkt, len, &nodeId, &sender, &msgType) == len);
+        CHECK(sender == (long)0x81020304L);
+        CHECK(msgType == types[t]);
+        CHECK(parseHeader(false, pkt, len - 1, &nodeId, &sender, &msgType) == 0);
+    }
+}
+
+static void testJSONIndex() {
+    char line[] = "{\"SwitchSet\":{\"destAddress\":-4321,\"on\":TRUE,\"level\":12.5,"
+                  "\"name\":\"a,b}\",\"list\":[1,{\"x\":2}],\"big\":4294967295}}";
+    JSONIndex index;
+    CHECK(JSONindex(line, &index));
+    CHECK(JSONindexToLong(&index, (char*)"destAddress") == -4321);
+    CHECK(JSONindexToBoolean(&index, (char*)"on"));
+    CHECK(JSONindexToDouble(&index, (char*)"level") == 12.5);
+    CHECK(JSONindexToULong(&index, (char*)"big") == 4294967295UL);
+    JSONEntry* e = JSONfind_P(&index, PSTR("name"));
+    CHECK(e != NULL);
+    CHECK((e != NULL) && (e->type == JSONString) && (e->valueLen == 4) && (strncmp(e->value, "a,b}", 4) == 0));
+    e = JSONfind(&index, (char*)"list");
+    CHECK((e != NULL) && (e->type == JSONArray));
+    CHECK(JSONfind(&index, (char*)"missing") == NULL);
+    //the string is not modified
+    CHECK(strstr(line, "\"big\":4294967295}}") != NULL);
+
+    char truncated[] = "{\"SwitchSet\":{\"on\":TRUE";
+    CHECK(!JSONindex(truncated, &index));
+}
+
+static void testJSONFramer() {
+    JSONFramer framer;
+    JSONframerReset(&framer);
+    char stream[] = "noise {\"LightState\" : {\"intensity\": 12,\n \"text\": \"a b\"}}\r\n"
+                    "{\"SwitchState\":{\"on\":FALSE}}";
+    int len = strlen(stream);
+    int used = JSONframerWrite(&framer, stream, len);
+    CHECK(framer.complete);
+    CHECK(strcmp(framer.name, "LightState") == 0);
+    CHECK(strcmp(framer.buffer, "{\"LightState\":{\"intensity\":12,\"text\":\"a b\"}}") == 0);
+    used += JSONframerWrite(&framer, stream + used, len - used);
+    CHECK(framer.complete);
+    CHECK(used == len);
+    CHECK(strcmp(framer.name, "SwitchState") == 0);
+
+    //longer than JSON_FRAME_LEN: dropped, the next one is read
+    std::string longMsg = "{\"Long\":{\"text\":\"";
+    longMsg.append(JSON_FRAME_LEN, 'x');
+    longMsg += "\"}}{\"Short\":{}}";
+    int completed = 0;
+    for(size_t i = 0; i < longMsg.size(); i++)
+        if(JSONframerFeed(&framer, longMsg[i])) {
+            completed++;
+            CHECK(strcmp(framer.name, "Short") == 0);
+        }
+    CHECK(completed == 1);
+}
+
+//Deterministic generator of the fuzz inputs, every run tests the same inputs
+static uint32_t fuzzState;
+
+static uint32_t fuzzNext(uint32_t n) {
+    fuzzState = fuzzState * 1103515245UL + 12345;
+    return (fuzzState >> 8) % n;
+}
+
+#define FUZZ_ROUNDS 5000
+
+/** Breaks a valid input: truncated, with garbage bytes replaced or inserted,
+ * or oversized by repeating a part of it.
+ * @param zeros true if garbage can contain zeros
+ */
+static std::string fuzzMutate(const std::string& valid, boolean zeros) {
+    std::string s = valid;
+    int mutations = 1 + fuzzNext(3);
+    for(int m = 0; m < mutations; m++) {
+        size_t at = s.empty() ? 0 : fuzzNext(s.size());
+        char garbage = zeros ? (char)fuzzNext(256) : (char)(1 + fuzzNext(255));
+        switch(fuzzNext(5)) {
+        case 0: s.resize(at); break;
+        case 1: if(!s.empty()) s[at] = garbage; break;
+        case 2: s.insert(at, 1, garbage); break;
+        case 3: s.insert(at, s.substr(at, 1 + fuzzNext(40)) + s.substr(at, 1 + fuzzNext(40)) + s.substr(at, 1 + fuzzNext(40))); break;
+        default: s.insert(at, std::string(1 + fuzzNext(2 * JSON_FRAME_LEN), valid[fuzzNext(valid.size())])); break;
+        }
+    }
+    return s;
+}
+
+static void testJSONIndexFuzz() {
+    const char* valid[] = {
+        "{\"SwitchSet\":{\"destAddress\":-4321,\"on\":TRUE,\"level\":12.5}}",
+        "{\"Text\":{\"name\":\"a,b}\\\"\",\"list\":[1,{\"x\":[2,[3]]}],\"n\":null}}",
+        "{\"Deep\":{\"a\":{\"b\":{\"c\":{\"d\":1}}}}}",
+    };
+    fuzzState = 1;
+    int accepted = 0;
+    for(int r = 0; r < FUZZ_ROUNDS; r++) {
+        std::string in = fuzzMutate(valid[fuzzNext(3)], false);
+        //exactly the size of the input, so that reading past it is an error of the sanitizers
+        char* line = (char*)malloc(in.size() + 1);
+        memcpy(line, in.c_str(), in.size() + 1);
+        JSONIndex index;
+        boolean ok = JSONindex(line, &index);
+        CHECK(index.count <= JSON_INDEX_LEN);
+        boolean inside = true;
+        for(int i = 0; i < index.count; i++) {
+            JSONEntry* e = &index.entries[i];
+            if((e->key < line) || (e->key + e->keyLen > line + in.size()) ||
+               (e->value < line) || (e->valueLen < 0) || (e->value + e->valueLen > line + in.size()))
+                inside = false;
+        }
+        CHECK(inside);
+        //the same answer every time
+        JSONIndex again;
+        CHECK(JSONindex(line, &again) == ok);
+        CHECK(again.count == index.count);
+        if(ok) accepted++;
+        free(line);
+    }
+    //some inputs are still valid after the mutations, most are not
+    CHECK((accepted > 0) && (accepted < FUZZ_ROUNDS));
+}
+
+static void testJSONFramerFuzz() {
+    const char* valid = "{\"LightState\" : {\"intensity\": 12,\n \"text\": \"a } b\\\"\"}}";
+    fuzzState = 2;
+    JSONFramer framer;
+    int completed = 0;
+    for(int r = 0; r < FUZZ_ROUNDS; r++) {
+        std::string in = fuzzMutate(valid, true);
+        JSONframerReset(&framer);
+        boolean consistent = true;
+        for(size_t i = 0; i < in.size(); i++) {
+            boolean done = JSONframerFeed(&framer, in[i]);
+            if((framer.len < 0) || (framer.len > JSON_FRAME_LEN) || (framer.level < 0) ||
+               (framer.nameLen >= JSON_NAME_LEN))
+                consistent = false;
+            if(done) {
+                completed++;
+                //a message, whole and terminated
+                if(!framer.complete || (framer.level != 0) || (framer.buffer[0] != '{') ||
+                   (framer.buffer[framer.len - 1] != '}') || (framer.buffer[framer.len] != '\0') ||
+                   (strlen(framer.name) != framer.nameLen))
+                    consistent = false;
+            }
+        }
+        CHECK(consistent);
+        //after a reset the next message is read
+        JSONframerReset(&framer);
+        CHECK(JSONframerWrite(&framer, (char*)valid, strlen(valid)) == (int)strlen(valid));
+        CHECK(framer.complete && (strcmp(framer.name, "LightState") == 0));
+    }
+    CHECK(completed > 0);
+}
+
+static void testBinaryFramerFuzz() {
+    uint8_t payload[BINARY_MAX_PAYLOAD];
+    for(int i = 0; i < BINARY_MAX_PAYLOAD; i++) payload[i] = i * 7;
+    uint8_t frame[BINARY_FRAME_LEN];
+    int len = binaryEncodeFrame(-2130771712, 1234, BINARY_FLAG_STRONG, payload, 40, frame);
+    std::string valid((char*)frame, len);
+    fuzzState = 3;
+    BinaryFramer framer;
+    binaryFramerReset(&framer);
+    int completed = 0;
+    for(int r = 0; r < FUZZ_ROUNDS; r++) {
+        std::string in = fuzzMutate(valid, true);
+        boolean consistent = true;
+        for(size_t i = 0; i < in.size(); i++) {
+            uint8_t done = binaryFramerFeed(&framer, (uint8_t)in[i]);
+            if((framer.len < 0) || (framer.len > BINARY_FRAME_LEN))
+                consistent = false;
+            if(done) {
+                completed++;
+                //only frames with a valid CRC come out, encoding them again gives the same frame
+                uint8_t again[BINARY_FRAME_LEN];
+                if((framer.dataLen < 0) || (framer.dataLen > BINARY_MAX_PAYLOAD) ||
+                   (framer.data < framer.buffer) || (framer.data + framer.dataLen > framer.buffer + BINARY_FRAME_LEN))
+                    consistent = false;
+                else {
+                    int againLen = binaryEncodeFrame(framer.address, framer.msgType, framer.flags, framer.data, framer.dataLen, again);
+                    BinaryFramer check;
+                    binaryFramerReset(&check);
+                    if((againLen == 0) || (feedBinary(&check, again, againLen) != 1) || (check.dataLen != framer.dataLen))
+                        consistent = false;
+                }
+            }
+        }
+        CHECK(consistent);
+        //the terminator of the next frame closes whatever was left, the frame is read
+        uint8_t zero = 0;
+        feedBinary(&framer, &zero, 1);
+        CHECK(feedBinary(&framer, frame, len) == 1);
+        CHECK((framer.msgType == 1234) && (framer.dataLen == 40));
+    }
+    CHECK(completed > 0);
+}
+
+static void testJSONWriterRoundTrip() {
+    char buf[JSON_WRITER_LEN];
+    JSONWriter writer;
+    JSONwriterInit(&writer, buf, sizeof(buf));
+    JSONwriteObjectStart(&writer, NULL);
+    JSONwriteObjectStart(&writer, PSTR("Test"));
+    JSONwriteLong(&writer, PSTR("long"), -2147483647L - 1);
+    JSONwriteULong(&writer, PSTR("ulong"), 4294967295UL);
+    JSONwriteDouble(&writer, PSTR("double"), -3.14159, 3);
+    JSONwriteDouble(&writer, PSTR("nan"), NAN, 2);
+    JSONwriteBoolean(&writer, PSTR("bool"), true);
+    JSONwriteString(&writer, PSTR("str"), "q\"b\\\n");
+    JSONwriteObjectEnd(&writer);
+    JSONwriteObjectEnd(&writer);
+    CHECK(!writer.overflow);
+    CHECK(strcmp(buf, "{\"Test\":{\"long\":-2147483648,\"ulong\":4294967295,\"double\":-3.142,"
+                      "\"nan\":null,\"bool\":TRUE,\"str\":\"q\\\"b\\\\\\u000a\"}}") == 0);
+
+    //what is written can be read back
+    JSONIndex index;
+    CHECK(JSONindex(buf, &index));
+    CHECK(JSONindexToLong(&index, (char*)"long") == -2147483647L - 1);
+    CHECK(JSONindexToULong(&index, (char*)"ulong") == 4294967295UL);
+    CHECK(JSONindexToDouble(&index, (char*)"double") == -3.142);
+    CHECK(JSONindexToBoolean(&index, (char*)"bool"));
+    JSONEntry* e = JSONfind(&index, (char*)"nan");
+    CHECK((e != NULL) && (e->type == JSONNull));
+
+    StringPrint out;
+    CHECK(JSONwriteLine(&writer, out));
+    CHECK(out.writes == 1);
+    CHECK(out.text == std::string(buf));
+    CHECK(out.text.substr(out.text.size() - 2) == "\r\n");
+}
+
+static void testJSONWriterOverflow() {
+    unsigned long overflows = getJSONOverflowCounter();
+    char buf[16];
+    JSONWriter writer;
+    JSONwriterInit(&writer, buf, sizeof(buf));
+    JSONwriteObjectStart(&writer, NULL);
+    JSONwriteString(&writer, PSTR("text"), "longer than the buffer");
+    JSONwriteObjectEnd(&writer);
+    CHECK(writer.overflow);
+    CHECK(strlen(buf) == sizeof(buf) - 1);
+    StringPrint out;
+    CHECK(!JSONwriteLine(&writer, out));
+    CHECK(out.writes == 0);
+    CHECK(getJSONOverflowCounter() == overflows + 1);
+}
+
+static void testMessagesRoundTrip() {
+    helloMessage hm;
+    hm.internalTemp = 23.5;
+    hm.internalVcc = 3.3;
+    hm.operationTime = 123456;
+    hm.sentMsgs = 1000;
+    hm.unsentMsgs = 3;
+    hm.receivedMsgs = 42;
+    byte packed[helloMessage::packedLen];
+    CHECK(helloMessage::packedLen == 24);
+    CHECK(hm.pack(packed) == helloMessage::packedLen);
+    helloMessage back;
+    CHECK(!back.unpack(packed, helloMessage::packedLen - 1));
+    CHECK(back.unpack(packed, helloMessage::packedLen));
+    CHECK(back.internalTemp == hm.internalTemp);
+    CHECK(back.operationTime == hm.operationTime);
+    CHECK(back.receivedMsgs == hm.receivedMsgs);
+
+    //printed and parsed back
+    StringPrint out;
+    CHECK(hm.printJSON(out, 1234));
+    std::string line = out.text.substr(0, out.text.size() - 2);
+    JSONIndex index;
+    CHECK(JSONindex((char*)line.c_str(), &index));
+    CHECK(JSONindexToLong(&index, (char*)"sourceAddress") == 1234);
+    helloMessage parsed;
+    parsed.parseJSON(&index);
+    CHECK(parsed.internalTemp == hm.internalTemp);
+    CHECK(parsed.sentMsgs == hm.sentMsgs);
+    CHECK(parsed.receivedMsgs == hm.receivedMsgs);
+    CHECK(helloMessage::isJSONName("hello"));
+
+    switchMessage sm;
+    sm.on = true;
+    char json[] = "{\"SwitchSet\":{\"destAddress\":4321,\"on\":FALSE}}";
+    sm.parseJSON(json);
+    CHECK(!sm.on);
+}
+
+static void testMessagesJSONWidth() {
+    //a realistic hello does not fit in the old 150 bytes buffer
+    helloMessage hm;
+    hm.internalTemp = -12.25;
+    hm.internalVcc = 3.31;
+    hm.operationTime = 31536000;
+    hm.sentMsgs = 1000000;
+    hm.unsentMsgs = 1000;
+    hm.receivedMsgs = 1000000;
+    char small[150];
+    JSONWriter writer;
+    JSONwriterInit(&writer, small, sizeof(small));
+    hm.writeJSON(&writer, -2130771712);
+    StringPrint out;
+    unsigned long overflows = getJSONOverflowCounter();
+    boolean printed = JSONwriteLine(&writer, out);
+    CHECK(!printed);
+    CHECK(getJSONOverflowCounter() == overflows + 1);
+    CHECK(out.writes == 0);
+    //printJSON() sizes the buffer for the widest values, so it fits
+    CHECK(hm.printJSON(out, -2130771712));
+
+    //the widest values fill the buffer exactly
+    hm.internalTemp = -42949668.0;
+    hm.internalVcc = -42949668.0;
+    hm.operationTime = 4294967295UL;
+    hm.sentMsgs = 4294967295UL;
+    hm.unsentMsgs = 4294967295UL;
+    hm.receivedMsgs = 4294967295UL;
+    out.text.clear();
+    CHECK(hm.printJSON(out, -2147483647L - 1));
+    CHECK(out.text.size() == helloMessage::jsonLen - 1);
+
+    switchMessage sm;
+    sm.on = false;
+    out.text.clear();
+    CHECK(sm.printJSON(out, -2147483647L - 1));
+    CHECK(out.text.size() == switchMessage::jsonLen - 1);
+
+    lightMessage lm;
+    lm.intensity = -32768;
+    out.text.clear();
+    CHECK(lm.printJSON(out, -2147483647L - 1));
+    CHECK(out.text.size() == lightMessage::jsonLen - 1);
+}
+
+int main() {
+    testBinaryRoundTrip();
+    testCOBS();
+    testVarint();
+    testHeaderRoundTrip();
+    testJSONIndex();
+    testJSONFramer();
+    testJSONIndexFuzz();
+    testJSONFramerFuzz();
+    testBinaryFramerFuzz();
+    testJSONWriterRoundTrip();
+    testJSONWriterOverflow();
+    testMessagesRoundTrip();
+    testMessagesJSONWidth();
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,479 @@
+/** Host tests of the nRF24 driver and of the pIoT protocol against the simulated
+ * nRF24L01+ and air of sim.h: configuration, transmissions with acks, retransmissions
+ * and failures, streaming through the TX FIFO, reception, ack payloads, batches, losses,
+ * link statistics and collisions.
+ * Build and run with: make -C tests
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#include "sim.h"
+#include <nRF24.h>
+#include <pIoT_Protocol.h>
+
+static int failures = 0;
+static int checks = 0;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if(!(cond)) { \
+        failures++; \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while(0)
+
+#define CE_PIN 9
+#define CSN_PIN 10
+#define IRQ_PIN 2
+#define POWER_PIN 8
+
+#define NODE_ADDR 0x01020304L
+#define PEER_ADDR 0x0A0B0C0DL
+#define TEST_MSG_TYPE 10
+
+static const uint8_t nodeBytes[5] = {0x04, 0x03, 0x02, 0x01, 0};
+static const uint8_t peerBytes[5] = {0x0D, 0x0C, 0x0B, 0x0A, 0};
+
+/** Powers the simulated radio up and starts the protocol on it.
+ * @param irq true if the IRQ line is connected
+ */
+static boolean start(boolean irq) {
+    simReset();
+    simRadioConnect(CE_PIN, CSN_PIN, irq ? IRQ_PIN : NRF24_NO_PIN, POWER_PIN);
+    return startRadio(CE_PIN, CSN_PIN, POWER_PIN, NODE_ADDR, irq ? IRQ_PIN : NRF24_NO_PIN);
+}
+
+/** Waits for the asynchronous transmissions to complete.
+ */
+static void drain() {
+    while(pollSend() == NRF24::NRF24TxPending)
+        ;
+}
+
+//Results of the transmissions, from the send callback
+static int sentOk;
+static int sentFailed;
+static boolean results[16];
+
+static void sendDone(boolean sent) {
+    if(sentOk + sentFailed < 16) results[sentOk + sentFailed] = sent;
+    if(sent) sentOk++;
+    else sentFailed++;
+}
+
+static void resetResults() {
+    sentOk = 0;
+    sentFailed = 0;
+}
+
+static void testConfiguration() {
+    CHECK(start(true));
+    CHECK(simRadioRegister(NRF24_REG_03_SETUP_AW) == NRF24_AW_4_BYTES);
+    CHECK(simRadioRegister(NRF24_REG_05_RF_CH) == RF_CHANNEL);
+    CHECK((simRadioRegister(NRF24_REG_06_RF_SETUP) & (NRF24_RF_DR_LOW | NRF24_RF_DR_HIGH)) == NRF24_RF_DR_HIGH);
+    CHECK((simRadioRegister(NRF24_REG_00_CONFIG) & (NRF24_EN_CRC | NRF24_CRCO)) == (NRF24_EN_CRC | NRF24_CRCO));
+    //with the IRQ line connected no interrupt is masked
+    CHECK((simRadioRegister(NRF24_REG_00_CONFIG) & (NRF24_MASK_RX_DR | NRF24_MASK_TX_DS | NRF24_MASK_MAX_RT)) == 0);
+    uint8_t pipes = (1 << BROADCAST_PIPE) | (1 << PRIVATE_PIPE) | (1 << COMPACT_PIPE);
+    CHECK((simRadioRegister(NRF24_REG_02_EN_RXADDR) & pipes) == pipes);
+    CHECK((simRadioRegister(NRF24_REG_01_EN_AA) & pipes) == pipes);
+    CHECK((simRadioRegister(NRF24_REG_1C_DYNPD) & pipes) == pipes);
+    CHECK(simRadioRegister(NRF24_REG_1D_FEATURE) == (NRF24_EN_DPL | NRF24_EN_ACK_PAY | NRF24_EN_DYN_ACK));
+    uint8_t addr[5];
+    simRadioAddress(NRF24_REG_0B_RX_ADDR_P1, addr);
+    CHECK(memcmp(addr, nodeBytes, 4) == 0);
+    //the compact pipe differs in the least significant byte
+    CHECK(simRadioRegister(NRF24_REG_0C_RX_ADDR_P2) == (nodeBytes[0] ^ COMPACT_ADDR_BIT));
+    //registers are lost without power and written again
+    CHECK(stopRadio());
+    CHECK(simRadioRegister(NRF24_REG_05_RF_CH) == 0);
+    CHECK(start(true));
+    CHECK(simRadioRegister(NRF24_REG_05_RF_CH) == RF_CHANNEL);
+    stopRadio();
+}
+
+static void testSendWithAck() {
+    CHECK(start(true));
+    simRadioAddPeer(peerBytes);
+    byte data[] = {1, 2, 3};
+    unsigned long sent = getSentCounter();
+    CHECK(send(false, PEER_ADDR, TEST_MSG_TYPE, data, 3));
+    CHECK(getSentCounter() == sent + 1);
+    CHECK(simRadioSentCount() == 1);
+    const SimPacket& p = simRadioSent(0);
+    CHECK(p.addressLen == 4);
+    CHECK(memcmp(p.address, peerBytes, 4) == 0);
+    //full header: sender address and message type
+    CHECK(p.len == 9);
+    CHECK(memcmp(p.data, nodeBytes, 4) == 0);
+    CHECK((p.data[4] == TEST_MSG_TYPE) && (p.data[5] == 0));
+    CHECK(memcmp(p.data + 6, data, 3) == 0);
+    CHECK(!p.noack);
+    CHECK(p.retries == 0);
+    CHECK(simRadioAttempts() == 1);
+    CHECK(nRF24.getLastRetries() == 0);
+    stopRadio();
+}
+
+static void testSendWithoutPeer() {
+    CHECK(start(true));
+    byte data[] = {1};
+    unsigned long unsent = getUnsentCounter();
+    unsigned long long before = simNow();
+    CHECK(!send(false, PEER_ADDR, TEST_MSG_TYPE, data, 1));
+    CHECK(getUnsentCounter() == unsent + 1);
+    CHECK(simRadioSentCount() == 0);
+    //the first attempt and 7 retransmissions, 750us apart
+    CHECK(simRadioAttempts() == 8);
+    CHECK(nRF24.getLastRetries() == 7);
+    CHECK((simRadioRegister(NRF24_REG_08_OBSERVE_TX) >> 4) == 1);
+    CHECK(simNow() - before > 8 * 750);
+    CHECK(simNow() - before < 8 * 750 + 2000);
+    //the MAX_RT flag has been cleared, the next transmission works
+    simRadioAddPeer(peerBytes);
+    CHECK(send(false, PEER_ADDR, TEST_MSG_TYPE, data, 1));
+    stopRadio();
+}
+
+static void testBroadcast() {
+    CHECK(start(true));
+    byte data[] = {7};
+    CHECK(send(true, 0, TEST_MSG_TYPE, data, 1));
+    CHECK(simRadioSentCount() == 1);
+    CHECK(simRadioSent(0).noack);
+    CHECK(simRadioAttempts() == 1);
+    stopRadio();
+}
+
+/** Streams packets through the TX FIFO, as fast as it takes them.
+ * @return the number of packets queued
+ */
+static int stream(int n) {
+    byte data[20];
+    int queued = 0;
+    for(int i = 0; i < n; i++) {
+        memset(data, i, sizeof(data));
+        while(!sendAsync(false, PEER_ADDR, TEST_MSG_TYPE, data, sizeof(data)))
+            if(pollSend() != NRF24::NRF24TxPending) return queued;
+        queued++;
+    }
+    drain();
+    return queued;
+}
+
+static void testStreaming(boolean irq) {
+    CHECK(start(irq));
+    simRadioAddPeer(peerBytes);
+    resetResults();
+    setSendCallback(sendDone);
+    CHECK(stream(12) == 12);
+    CHECK(sentOk == 12);
+    CHECK(sentFailed == 0);
+    CHECK(simRadioSentCount() == 12);
+    boolean ordered = true;
+    for(int i = 0; i < simRadioSentCount(); i++)
+        if(simRadioSent(i).data[6] != i) ordered = false;
+    CHECK(ordered);
+    //without the IRQ line one slot of the FIFO is left free
+    CHECK(nRF24.getTxQueueCapacity() == (irq ? 3 : 2));
+    setSendCallback(NULL);
+    stopRadio();
+}
+
+static void testFragmentsUnderLoad() {
+    //without the IRQ line the chip is only polled
+    CHECK(start(false));
+    simRadioAddPeer(peerBytes);
+    //long interrupts let the FIFO drain between a full FIFO and the next poll
+    simSetInterruptLoad(1200, 1000);
+    byte data[FRAGMENT_MAX_LEN];
+    for(int i = 0; i < FRAGMENT_MAX_LEN; i++) data[i] = i;
+    unsigned long unsent = getUnsentCounter();
+    CHECK(send(false, PEER_ADDR, TEST_MSG_TYPE, data, FRAGMENT_MAX_LEN));
+    CHECK(getUnsentCounter() == unsent);
+    int fragments = (FRAGMENT_MAX_LEN + FRAGMENT_PAYLOAD_LEN - 1) / FRAGMENT_PAYLOAD_LEN;
+    CHECK(simRadioSentCount() == fragments);
+    boolean whole = true;
+    for(int i = 0; (i < simRadioSentCount()) && (i < fragments); i++){
+        const SimPacket& p = simRadioSent(i);
+        //header of 6 bytes, sequence and index
+        if((p.data[7] & 0x7F) != i) whole = false;
+        int n = (i == fragments - 1) ? FRAGMENT_MAX_LEN - i * FRAGMENT_PAYLOAD_LEN : FRAGMENT_PAYLOAD_LEN;
+        if((p.len != 8 + n) || memcmp(p.data + 8, data + i * FRAGMENT_PAYLOAD_LEN, n)) whole = false;
+    }
+    CHECK(whole);
+    simSetInterruptLoad(0, 0);
+    stopRadio();
+}
+
+static void testMaxRetriesReload() {
+    CHECK(start(true));
+    simRadioAddPeer(peerBytes);
+    resetResults();
+    setSendCallback(sendDone);
+    //the first packet is lost 8 times, the following ones are reloaded after the flush
+    simRadioSetLoss(1.0);
+    byte data[3] = {0, 0, 0};
+    for(int i = 0; i < 3; i++) {
+        data[0] = i;
+        CHECK(sendAsync(false, PEER_ADDR, TEST_MSG_TYPE, data, 3));
+    }
+    while((sentFailed == 0) && (pollSend() == NRF24::NRF24TxPending))
+        simRun(100);
+    simRadioSetLoss(0);
+    drain();
+    CHECK(sentFailed == 1);
+    CHECK(sentOk == 2);
+    CHECK(!results[0] && results[1] && results[2]);
+    CHECK(simRadioSentCount() == 2);
+    if(simRadioSentCount() == 2) {
+        CHECK(simRadioSent(0).data[6] == 1);
+        CHECK(simRadioSent(1).data[6] == 2);
+    }
+    setSendCallback(NULL);
+    stopRadio();
+}
+
+//Last message passed to the handler
+static long rxSender;
+static unsigned int rxType;
+static int rxLen;
+static byte rxData[32];
+static int rxCount;
+
+static void onReceive(boolean broadcast, long sender, unsigned int msgType, byte* data, int len) {
+    rxSender = sender;
+    rxType = msgType;
+    rxLen = len;
+    memcpy(rxData, data, len);
+    rxCount++;
+}
+
+/** Builds a packet with the full header, as sent by the peer.
+ */
+static int peerPacket(unsigned int msgType, const byte* data, int len, byte* pkt) {
+    memcpy(pkt, peerBytes, 4);
+    pkt[4] = msgType & 0xFF;
+    pkt[5] = msgType >> 8;
+    memcpy(pkt + 6, data, len);
+    return len + 6;
+}
+
+static void testReceive(boolean irq) {
+    CHECK(start(irq));
+    rxCount = 0;
+    byte data[] = {5, 6};
+    byte pkt[32];
+    int len = peerPacket(TEST_MSG_TYPE, data, 2, pkt);
+    nRF24.powerUpRx();
+    simRadioSend(nodeBytes, pkt, len, false, simNow() + 1000);
+    CHECK(receive(100, onReceive));
+    CHECK(rxCount == 1);
+    CHECK(rxSender == PEER_ADDR);
+    CHECK(rxType == TEST_MSG_TYPE);
+    CHECK((rxLen == 2) && (rxData[0] == 5) && (rxData[1] == 6));
+    //acknowledged, without payload
+    CHECK(simRadioAckedCount() == 1);
+    CHECK(simRadioAckPayload(0).len == 0);
+    //packets to other addresses are ignored
+    simRadioSend(peerBytes, pkt, len, false, simNow() + 1000);
+    CHECK(!receive(50, onReceive));
+    CHECK(simRadioAckedCount() == 1);
+    //more packets than the FIFO holds, the IRQ moves them to the ring buffer
+    for(int i = 0; i < 5; i++) {
+        pkt[6] = i;
+        simRadioSend(nodeBytes, pkt, len, false, simNow() + 1000 + i * 300);
+    }
+    simRun(5000);
+    rxCount = 0;
+    while(receive(0, onReceive))
+        ;
+    CHECK(rxCount == (irq ? 5 : 3));
+    stopRadio();
+}
+
+static void testReceiveCompact() {
+    CHECK(start(true));
+    rxCount = 0;
+    nRF24.powerUpRx();
+    //the peer asks for an identifier, the reply comes with the ack of its next packet
+    byte pkt[32];
+    int len = peerPacket(NODE_ID_MSG_TYPE, NULL, 0, pkt);
+    simRadioSend(nodeBytes, pkt, len, false, simNow() + 1000);
+    receive(100, onReceive);
+    byte data[] = {5, 6};
+    len = peerPacket(TEST_MSG_TYPE, data, 2, pkt);
+    simRadioSend(nodeBytes, pkt, len, false, simNow() + 1000);
+    CHECK(receive(100, onReceive));
+    CHECK(simRadioAckedCount() == 2);
+    const SimPacket& reply = simRadioAckPayload(1);
+    CHECK(reply.len == 7);
+    CHECK((reply.data[4] == (NODE_ID_MSG_TYPE & 0xFF)) && (reply.data[5] == (NODE_ID_MSG_TYPE >> 8)));
+    byte id = reply.data[6];
+    CHECK((id != BASE_NODE_ID) && (id != NO_NODE_ID));
+
+    //compact header on pipe 2: node identifier and varint type
+    byte compactBytes[5];
+    memcpy(compactBytes, nodeBytes, 5);
+    compactBytes[0] ^= COMPACT_ADDR_BIT;
+    byte compact[] = {id, 0x80 | (200 & 0x7F), 200 >> 7, 7, 8, 9};
+    rxCount = 0;
+    simRadioSend(compactBytes, compact, sizeof(compact), false, simNow() + 1000);
+    CHECK(receive(100, onReceive));
+    CHECK(rxCount == 1);
+    CHECK(rxSender == PEER_ADDR);
+    CHECK(rxType == 200);
+    CHECK((rxLen == 3) && (rxData[0] == 7) && (rxData[2] == 9));
+    //an identifier that has not been assigned is dropped
+    compact[0] = id + 1;
+    simRadioSend(compactBytes, compact, sizeof(compact), false, simNow() + 1000);
+    CHECK(!receive(50, onReceive));
+    CHECK(rxCount == 1);
+    stopRadio();
+}
+
+static void testAckPayloadDownlink() {
+    CHECK(start(true));
+    nRF24.powerUpRx();
+    byte reply[] = {9, 9, 9};
+    CHECK(nRF24.writeAckPayload(PRIVATE_PIPE, reply, 3));
+    CHECK(nRF24.getAckPayloadsPending() == 1);
+    byte data[] = {1};
+    byte pkt[32];
+    int len = peerPacket(TEST_MSG_TYPE, data, 1, pkt);
+    simRadioSend(nodeBytes, pkt, len, false, simNow() + 500);
+    rxCount = 0;
+    CHECK(receive(100, onReceive));
+    CHECK(rxCount == 1);
+    CHECK(simRadioAckedCount() == 1);
+    CHECK((simRadioAckPayload(0).len == 3) && (simRadioAckPayload(0).data[0] == 9));
+    CHECK(nRF24.getAckPayloadsPending() == 0);
+    CHECK(nRF24.getAckPayloadsSent() >= 1);
+    stopRadio();
+}
+
+static void testAckPayloadUplink() {
+    CHECK(start(true));
+    simRadioAddPeer(peerBytes);
+    rxCount = 0;
+    setAckMessageHandler(onReceive);
+    //a message for the node, which starts with its address
+    byte reply[8];
+    memcpy(reply, nodeBytes, 4);
+    reply[4] = TEST_MSG_TYPE;
+    reply[5] = 0;
+    reply[6] = 4;
+    reply[7] = 2;
+    simRadioSetAckPayload(peerBytes, reply, 8);
+    byte data[] = {1};
+    CHECK(send(false, PEER_ADDR, TEST_MSG_TYPE, data, 1));
+    CHECK(rxCount == 1);
+    CHECK(rxSender == PEER_ADDR);
+    CHECK(rxType == TEST_MSG_TYPE);
+    CHECK((rxLen == 2) && (rxData[0] == 4) && (rxData[1] == 2));
+    //consumed by the first ack
+    CHECK(send(false, PEER_ADDR, TEST_MSG_TYPE, data, 1));
+    CHECK(rxCount == 1);
+    setAckMessageHandler(NULL);
+    stopRadio();
+}
+
+static void testBatch() {
+    CHECK(start(true));
+    simRadioAddPeer(peerBytes);
+    byte data[] = {1, 2};
+    //the type of batches is reserved
+    CHECK(!send(false, PEER_ADDR, BATCH_MSG_TYPE, data, 2));
+    CHECK(!sendAsync(false, PEER_ADDR, BATCH_MSG_TYPE, data, 2));
+    CHECK(!postMessage(PEER_ADDR, BATCH_MSG_TYPE, data, 2, 1000));
+    CHECK(!onMessage(BATCH_MSG_TYPE, ANY_LEN, onReceive));
+    CHECK(!addToBatch(BATCH_MSG_TYPE, data, 2));
+    CHECK(simRadioSentCount() == 0);
+    //two records of length, type and data in a packet
+    beginBatch(false, PEER_ADDR);
+    CHECK(addToBatch(TEST_MSG_TYPE, data, 2));
+    CHECK(addToBatch(TEST_MSG_TYPE + 1, data, 1));
+    CHECK(flushBatch());
+    CHECK(simRadioSentCount() == 1);
+    const SimPacket& p = simRadioSent(0);
+    CHECK((p.data[4] == BATCH_MSG_TYPE) && (p.data[5] == 0));
+    CHECK(p.len == 6 + 4 + 3);
+    CHECK((p.data[6] == 2) && (p.data[7] == TEST_MSG_TYPE) && (p.data[10] == 1));
+    stopRadio();
+}
+
+/** Sends packets over a lossy link.
+ * @return the number of attempts
+ */
+static unsigned long lossyRun(unsigned long seed, int* delivered) {
+    start(true);
+    resetLinkStats();
+    simRadioAddPeer(peerBytes);
+    simRadioSetLoss(0.3, seed);
+    byte data[] = {1, 2};
+    *delivered = 0;
+    for(int i = 0; i < 20; i++)
+        if(send(false, PEER_ADDR, TEST_MSG_TYPE, data, 2)) (*delivered)++;
+    unsigned long attempts = simRadioAttempts();
+    CHECK(simRadioSentCount() >= *delivered);
+    //every packet is in the statistics of the link
+    LinkStats stats;
+    CHECK(getLinkStats(PEER_ADDR, &stats));
+    CHECK(stats.address == PEER_ADDR);
+    int counted = stats.lost;
+    for(int i = 0; i < LINK_RETRIES_BUCKETS; i++) counted += stats.retries[i];
+    CHECK(counted == 20);
+    CHECK(stats.lost == 20 - *delivered);
+    CHECK(!getLinkStats(NODE_ADDR, &stats));
+    stopRadio();
+    return attempts;
+}
+
+static void testLoss() {
+    int delivered1, delivered2, delivered3;
+    unsigned long a1 = lossyRun(7, &delivered1);
+    unsigned long a2 = lossyRun(7, &delivered2);
+    unsigned long a3 = lossyRun(8, &delivered3);
+    //retransmissions recover most losses, the same seed gives the same run
+    CHECK(a1 > 20);
+    CHECK(delivered1 >= 18);
+    CHECK((a1 == a2) && (delivered1 == delivered2));
+    CHECK(a3 != a1);
+}
+
+static void testCollision() {
+    CHECK(start(true));
+    simRadioAddPeer(peerBytes);
+    //another node transmits while the node does, both packets are lost, the node retransmits
+    byte other[20];
+    memset(other, 0, sizeof(other));
+    simRadioSend(peerBytes, other, sizeof(other), true, simNow() + 200);
+    byte data[] = {1};
+    CHECK(send(false, PEER_ADDR, TEST_MSG_TYPE, data, 1));
+    CHECK(simRadioCollisions() == 2);
+    CHECK(simRadioSentCount() == 1);
+    CHECK(simRadioSent(0).retries == 1);
+    stopRadio();
+}
+
+int main() {
+    testConfiguration();
+    testSendWithAck();
+    testBatch();
+    testSendWithoutPeer();
+    testBroadcast();
+    testStreaming(true);
+    testStreaming(false);
+    testFragmentsUnderLoad();
+    testMaxRetriesReload();
+    testReceive(true);
+    testReceive(false);
+    testReceiveCompact();
+    testAckPayloadDownlink();
+    testAckPayloadUplink();
+    testLoss();
+    testCollision();
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+/** Host replacement of the Arduino core, for the simulator in sim.h.
+ * Time, pins, interrupts and the registers used by pIoT are emulated,
+ * the library is compiled unchanged against this header.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <ctype.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define MOSI 11
+#define MISO 12
+#define SCK 13
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+#define DEC 10
+#define HEX 16
+
+#define bit(b) (1UL << (b))
+#define _BV(b) (1 << (b))
+#define bit_is_set(r, b) ((r) & _BV(b))
+
+#define NOT_AN_INTERRUPT -1
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : NOT_AN_INTERRUPT))
+
+/** The status register, only the global interrupt flag is emulated.
+ * Setting the flag runs the interrupts that are pending.
+ */
+class SimSREG {
+public:
+    operator uint8_t() const;
+    SimSREG& operator=(uint8_t value);
+};
+extern SimSREG SREG;
+
+void cli();
+void sei();
+#define noInterrupts() cli()
+#define interrupts() sei()
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t level);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t interrupt, void (*f)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+class Print {
+public:
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+    size_t write(const char* buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+    size_t print(const char* s) { return write(s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(double n, int digits = 2);
+    size_t println() { return write("\r\n"); }
+    template<typename T> size_t println(T value) { return print(value) + println(); }
+    template<typename T> size_t println(T value, int format) { return print(value, format) + println(); }
+};
+
+/** The serial port: what is written is kept by the simulator, what is read is given by it.
+ */
+class HardwareSerial : public Print {
+public:
+    void begin(unsigned long baud) {}
+    int available();
+    int read();
+    int peek();
+    void flush() {}
+    size_t write(uint8_t b);
+    using Print::write;
+};
+extern HardwareSerial Serial;
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#endif
@@ -0,0 +1,27 @@
+/** Host replacement of the Arduino SPI library, transfers go to the emulated nRF24L01+.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#ifndef SIM_SPI_H
+#define SIM_SPI_H
+
+#include <Arduino.h>
+
+#define SPI_MODE0 0x00
+#define MSBFIRST 1
+#define SPI_CLOCK_DIV2 0x04
+
+class SPIClass {
+public:
+    static void begin() {}
+    static void end() {}
+    static uint8_t transfer(uint8_t data);
+    static void setDataMode(uint8_t mode) {}
+    static void setBitOrder(uint8_t order) {}
+    static void setClockDivider(uint8_t divider) {}
+};
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,16 @@
+/** Interrupt routines: ISR() defines a function that the simulator calls.
+ */
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+extern "C" {
+void WDT_vect(void);
+void ADC_vect(void);
+void PCINT0_vect(void);
+void PCINT1_vect(void);
+void PCINT2_vect(void);
+}
+
+#define ISR(vector, ...) extern "C" void vector(void)
+
+#endif
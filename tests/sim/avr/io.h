@@ -0,0 +1,73 @@
+/** Registers of the ATmega328P used by pIoT, emulated by the simulator.
+ * Reading and writing them goes through the simulator, so that the watchdog,
+ * the ADC and the pin change interrupts behave as on the chip.
+ */
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+
+extern "C" {
+
+/** An 8 bit register.
+ */
+class SimReg {
+public:
+    uint8_t value;
+    operator uint8_t() const;
+    SimReg& operator=(uint8_t v);
+    //int, as masks like ~(1<<ADEN) are on the chip
+    SimReg& operator|=(int v) { return *this = (uint8_t)(*this | v); }
+    SimReg& operator&=(int v) { return *this = (uint8_t)(*this & v); }
+};
+
+extern SimReg ADMUX, ADCSRA, PCIFR, PCICR, PCMSK0, PCMSK1, PCMSK2;
+extern SimReg MCUSR, MCUCR, WDTCSR, SMCR, UCSR0A, UCSR0B;
+extern SimReg PINB, PINC, PIND;
+extern volatile uint16_t ADCW;
+
+}
+
+//ADMUX
+#define REFS1 7
+#define REFS0 6
+#define MUX3 3
+#define MUX2 2
+#define MUX1 1
+#define MUX0 0
+//ADCSRA
+#define ADEN 7
+#define ADSC 6
+#define ADIF 4
+#define ADIE 3
+//PCIFR, PCICR
+#define PCIF2 2
+#define PCIF1 1
+#define PCIF0 0
+#define PCIE2 2
+#define PCIE1 1
+#define PCIE0 0
+//PCMSK2, PCMSK1, PCMSK0: bit n is the pin n of the port
+#define PCINT16 0
+#define PCINT8 0
+#define PCINT0 0
+//MCUSR
+#define WDRF 3
+//MCUCR
+#define BODS 6
+#define BODSE 5
+//WDTCSR
+#define WDIF 7
+#define WDIE 6
+#define WDP3 5
+#define WDCE 4
+#define WDE 3
+#define WDP2 2
+#define WDP1 1
+#define WDP0 0
+//UCSR0A, UCSR0B
+#define TXC0 6
+#define UDRIE0 5
+#define RXEN0 4
+
+#endif
@@ -0,0 +1,12 @@
+/** Power reduction, nothing to do in the simulator.
+ */
+#ifndef SIM_AVR_POWER_H
+#define SIM_AVR_POWER_H
+
+#include <avr/io.h>
+
+extern "C" {
+inline void power_all_enable(void) {}
+}
+
+#endif
@@ -0,0 +1,13 @@
+/** Watchdog, emulated by the simulator through WDTCSR.
+ */
+#ifndef SIM_AVR_WDT_H
+#define SIM_AVR_WDT_H
+
+#include <avr/io.h>
+
+extern "C" {
+void wdt_reset(void);
+void wdt_disable(void);
+}
+
+#endif
@@ -0,0 +1,173 @@
+/** Simulator of a pIoT node on the host.
+ * The library is compiled unchanged against the headers of this directory, which replace
+ * the Arduino core, SPI and the AVR registers it uses. The simulator emulates:
+ * - time: micros() and millis() follow the awake time of the MCU, as Timer0 does, and stop
+ *   in power-down, while simNow() is the real time; SPI transfers, delays and calls to micros()
+ *   take time, so that busy loops progress
+ * - interrupts: the global flag, pending interrupts run when it is set, and the watchdog,
+ *   pin change, external and ADC interrupts, with the sleep modes that each of them wakes up
+ * - the watchdog oscillator, with a configurable error, and the ADC
+ * - the nRF24L01+: register file, SPI commands, TX and RX FIFOs, IRQ line, and Enhanced
+ *   ShockBurst with auto acks, ack payloads, retransmissions and their timing
+ * - the air: peers that acknowledge packets, packets sent by other nodes at given times,
+ *   losses drawn from a seeded generator, and collisions between overlapping packets
+ *
+ * Only one node runs in a process, as NRF24 and the protocol keep their state in static
+ * members: other nodes exist only as the peers and packets of the air model.
+ * Everything is deterministic, the same test always gives the same result.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#ifndef SIM_H
+#define SIM_H
+
+#include <Arduino.h>
+#include <string>
+
+/** Resets pins, registers, watchdog, ADC, serial port, radio and air.
+ * The time keeps running, as the library measures intervals with it.
+ */
+void simReset();
+
+/** Gives the real time since start, sleep included.
+ * @return the time in microseconds
+ */
+unsigned long long simNow();
+
+/** Gives the time spent by the MCU in power-down.
+ * @return the time in microseconds
+ */
+unsigned long long simSleepTime();
+
+/** Lets time pass with the MCU awake, as if it was running some code.
+ * Interrupts are served if enabled.
+ * @param us the time in microseconds
+ */
+void simRun(unsigned long long us);
+
+/** Sets the error of the watchdog oscillator.
+ * @param factor the real period divided by the nominal one, 1 by default
+ */
+void simSetWatchdogError(double factor);
+
+/** Gives the number of watchdog interrupts since simReset().
+ */
+unsigned long simWatchdogInterrupts();
+
+/** Changes the level of an input pin at a given time, as an external circuit would.
+ * @param pin the pin, 0 to 19
+ * @param level HIGH or LOW
+ * @param at the real time of the change, in microseconds, now if in the past
+ */
+void simSetPin(uint8_t pin, uint8_t level, unsigned long long at = 0);
+
+/** Sets the value converted by the ADC for an input.
+ * @param admux the value of ADMUX, reference and input
+ * @param value 0 to 1023
+ */
+void simSetADC(uint8_t admux, uint16_t value);
+
+/** Emulates the interrupts of other peripherals (timers, serial port) while the MCU is awake.
+ * @param periodUS time between two interrupts, 0 to disable
+ * @param durationUS time spent in each interrupt
+ */
+void simSetInterruptLoad(unsigned long periodUS, unsigned long durationUS);
+
+/** Gives what has been written on the serial port.
+ */
+std::string& simSerialOutput();
+
+/** Adds bytes to those that can be read from the serial port.
+ */
+void simSerialInput(const char* data, int len);
+
+/** A packet on the air.
+ */
+typedef struct {
+    unsigned long long time; //end of the transmission
+    uint8_t address[5];
+    uint8_t addressLen;
+    uint8_t data[32];
+    uint8_t len;
+    boolean noack;
+    uint8_t retries; //retransmissions before the ack, for packets sent by the node
+} SimPacket;
+
+/** Connects the radio to the pins of the MCU.
+ * @param chipEnablePin CE
+ * @param chipSelectPin CSN
+ * @param irqPin IRQ, driven by the radio, NRF24_NO_PIN if not connected
+ * @param powerPin the pin that powers the radio, NRF24_NO_PIN if always powered
+ */
+void simRadioConnect(uint8_t chipEnablePin, uint8_t chipSelectPin, uint8_t irqPin, uint8_t powerPin);
+
+/** Adds a node that listens on an address and acknowledges the packets sent to it.
+ * @param address the address, least significant byte first, as long as SETUP_AW says
+ * @param ackDelayUS time between the end of a packet and the start of its ack, 130us on the chip
+ */
+void simRadioAddPeer(const uint8_t* address, unsigned int ackDelayUS = 130);
+
+/** Sets the payload sent by a peer with its next ack.
+ * @param address the address of the peer
+ */
+void simRadioSetAckPayload(const uint8_t* address, const uint8_t* data, uint8_t len);
+
+/** Sets the probability that a packet, or an ack, is lost.
+ * @param probability 0 to 1
+ * @param seed the seed of the generator
+ */
+void simRadioSetLoss(double probability, unsigned long seed = 1);
+
+/** Sends a packet from another node, it starts at a given time.
+ * If it overlaps another packet on the air both are lost.
+ * @param address the destination address
+ * @param noack true if the sender does not ask for an ack
+ * @param at the real time of the start, in microseconds, now if in the past
+ */
+void simRadioSend(const uint8_t* address, const uint8_t* data, uint8_t len, boolean noack, unsigned long long at = 0);
+
+/** Gives the packets sent by the node and received by a peer, retransmissions excluded,
+ * or sent without ack.
+ */
+int simRadioSentCount();
+const SimPacket& simRadioSent(int i);
+
+/** Gives the packets sent with simRadioSend() that the node has acknowledged,
+ * and the ack payloads it sent with them.
+ */
+int simRadioAckedCount();
+const SimPacket& simRadioAckPayload(int i);
+
+/** Gives the number of packets transmitted by the node, retransmissions included.
+ */
+unsigned long simRadioAttempts();
+
+/** Gives the number of packets, of the node or of other nodes, lost in collisions.
+ */
+unsigned long simRadioCollisions();
+
+/** Reads a register of the radio without SPI.
+ * @param reg the register, addresses give their least significant byte
+ */
+uint8_t simRadioRegister(uint8_t reg);
+
+/** Reads an address of the radio without SPI.
+ * @param reg NRF24_REG_0A_RX_ADDR_P0, NRF24_REG_0B_RX_ADDR_P1 or NRF24_REG_10_TX_ADDR
+ * @param address where the 5 bytes are copied
+ */
+void simRadioAddress(uint8_t reg, uint8_t* address);
+
+//Used between the parts of the simulator
+void simDrivePin(uint8_t pin, uint8_t level);
+void simRadioReset();
+void simRadioSelect(boolean selected);
+uint8_t simRadioTransfer(uint8_t data);
+void simRadioEnable(boolean enabled);
+void simRadioPower(boolean powered);
+unsigned long long simRadioNextEvent();
+void simRadioProcess(unsigned long long now);
+extern uint8_t simRadioCE, simRadioCSN, simRadioIRQ, simRadioPowerPin;
+
+#endif
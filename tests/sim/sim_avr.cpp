@@ -0,0 +1,596 @@
+/** Simulator of the ATmega328P parts used by pIoT: time, interrupts, sleep modes,
+ * watchdog, ADC, pins and serial port. See sim.h.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#include "sim.h"
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <SPI.h>
+#include <map>
+
+typedef unsigned long long ull;
+static const ull NEVER = ~0ULL;
+
+//Nominal period of the watchdog with prescaler 0, and time of an ADC conversion at 125kHz
+#define SIM_WDT_BASE_US 16000
+#define SIM_ADC_CONVERSION_US 104
+
+SimSREG SREG;
+HardwareSerial Serial;
+SPIClass SPI;
+SimReg ADMUX, ADCSRA, PCIFR, PCICR, PCMSK0, PCMSK1, PCMSK2;
+SimReg MCUSR, MCUCR, WDTCSR, SMCR, UCSR0A, UCSR0B;
+SimReg PINB, PINC, PIND;
+volatile uint16_t ADCW;
+
+//The vectors that the library does not define are null
+#pragma weak WDT_vect
+#pragma weak ADC_vect
+#pragma weak PCINT0_vect
+#pragma weak PCINT1_vect
+#pragma weak PCINT2_vect
+
+//Interrupt sources, in the priority order of the vectors
+enum { IRQ_INT0, IRQ_INT1, IRQ_PCINT0, IRQ_PCINT1, IRQ_PCINT2, IRQ_WDT, IRQ_LOAD, IRQ_ADC, IRQ_N };
+
+//Real time, time with the clock running (Timer0), time in power-down
+static ull now = 0;
+static ull awake = 0;
+static ull slept = 0;
+
+static boolean iflag = true;
+static unsigned int pending = 0;
+//Calls to the simulator, an interrupt served by sei() wakes up the sleep_cpu() right after it
+static unsigned long calls = 0;
+static unsigned long seiServedCall = 0;
+static boolean seiServed = false;
+
+static boolean sleepBit = false;
+static uint8_t sleepMode = SLEEP_MODE_IDLE;
+static boolean sleeping = false;
+
+//Watchdog
+static double wdtError = 1;
+static boolean wdtRunning = false;
+static ull wdtStart;
+static ull wdtPeriod;
+static unsigned long wdtInterrupts = 0;
+
+//ADC
+static std::map<uint8_t, uint16_t> adcValues;
+static ull adcDoneAt = NEVER;
+
+//Pins: level driven by the MCU, level driven from outside, and whether it is
+static uint8_t pinModes[20];
+static uint8_t outLevels[20];
+static uint8_t extLevels[20];
+static boolean extDriven[20];
+static std::multimap<ull, std::pair<uint8_t, uint8_t> > pinEvents;
+static void (*extHandlers[2])(void);
+static int extModes[2];
+
+//Interrupt load
+static unsigned long loadPeriod = 0;
+static unsigned long loadDuration = 0;
+static ull loadNextAwake = NEVER;
+
+//Serial port
+static std::string serialOut;
+static std::string serialIn;
+static size_t serialInPos = 0;
+
+static void touch() {
+    calls++;
+}
+
+static boolean clockRuns() {
+    return !sleeping || (sleepMode == SLEEP_MODE_IDLE);
+}
+
+static void moveTo(ull t) {
+    if(t <= now) return;
+    if(clockRuns()) awake += t - now;
+    else if(sleepMode == SLEEP_MODE_PWR_DOWN) slept += t - now;
+    now = t;
+}
+
+static uint8_t level(uint8_t pin) {
+    return extDriven[pin] ? extLevels[pin] : outLevels[pin];
+}
+
+static uint8_t portLevels(uint8_t first, uint8_t n) {
+    uint8_t v = 0;
+    for(uint8_t i = 0; i < n; i++)
+        if(level(first + i)) v |= 1 << i;
+    return v;
+}
+
+static boolean enabled(int source) {
+    switch(source) {
+    case IRQ_INT0: return extHandlers[0] != NULL;
+    case IRQ_INT1: return extHandlers[1] != NULL;
+    case IRQ_PCINT0: return PCICR.value & _BV(PCIE0);
+    case IRQ_PCINT1: return PCICR.value & _BV(PCIE1);
+    case IRQ_PCINT2: return PCICR.value & _BV(PCIE2);
+    case IRQ_WDT: return WDTCSR.value & _BV(WDIE);
+    case IRQ_ADC: return ADCSRA.value & _BV(ADIE);
+    case IRQ_LOAD: return true;
+    }
+    return false;
+}
+
+static boolean wakeable() {
+    for(int s = 0; s < IRQ_N; s++)
+        if((pending & (1 << s)) && enabled(s)) return true;
+    return false;
+}
+
+static void advance(ull t);
+
+static void serve(int source) {
+    switch(source) {
+    case IRQ_INT0: extHandlers[0](); break;
+    case IRQ_INT1: extHandlers[1](); break;
+    case IRQ_PCINT0: if(PCINT0_vect) PCINT0_vect(); break;
+    case IRQ_PCINT1: if(PCINT1_vect) PCINT1_vect(); break;
+    case IRQ_PCINT2: if(PCINT2_vect) PCINT2_vect(); break;
+    case IRQ_WDT: wdtInterrupts++; if(WDT_vect) WDT_vect(); break;
+    case IRQ_ADC: if(ADC_vect) ADC_vect(); break;
+    case IRQ_LOAD: advance(now + loadDuration); break;
+    }
+}
+
+/** Serves the pending interrupts, if enabled, one at a time with the global flag cleared.
+ * @return true if an interrupt has been served
+ */
+static boolean dispatch() {
+    boolean served = false;
+    while(iflag) {
+        int source = -1;
+        for(int s = 0; s < IRQ_N; s++)
+            if((pending & (1 << s)) && enabled(s)) { source = s; break; }
+        if(source < 0) break;
+        pending &= ~(1 << source);
+        //the MCU wakes up, then runs the ISR
+        sleeping = false;
+        iflag = false;
+        serve(source);
+        iflag = true;
+        served = true;
+    }
+    return served;
+}
+
+static void pinChanged(uint8_t pin, uint8_t old) {
+    //pin change interrupts are asynchronous, they are detected in every sleep mode
+    if(pin <= 7) {
+        if(PCMSK2.value & _BV(pin)) pending |= 1 << IRQ_PCINT2;
+    }
+    else if(pin <= 13) {
+        if(PCMSK0.value & _BV(pin - 8)) pending |= 1 << IRQ_PCINT0;
+    }
+    else if(PCMSK1.value & _BV(pin - 14)) pending |= 1 << IRQ_PCINT1;
+    //edges on INT0 and INT1 need the I/O clock, only levels wake up from the deeper modes
+    int n = digitalPinToInterrupt(pin);
+    if((n == NOT_AN_INTERRUPT) || (extHandlers[n] == NULL) || !clockRuns()) return;
+    uint8_t l = level(pin);
+    if((extModes[n] == CHANGE) || ((extModes[n] == FALLING) && !l) || ((extModes[n] == RISING) && l))
+        pending |= 1 << (IRQ_INT0 + n);
+}
+
+static void setExternal(uint8_t pin, uint8_t l) {
+    uint8_t old = level(pin);
+    extDriven[pin] = true;
+    extLevels[pin] = l ? HIGH : LOW;
+    if(level(pin) != old) pinChanged(pin, old);
+}
+
+static ull nextEvent() {
+    ull next = NEVER;
+    if(wdtRunning) next = wdtStart + wdtPeriod;
+    if(adcDoneAt < next) next = adcDoneAt;
+    if(!pinEvents.empty() && (pinEvents.begin()->first < next)) next = pinEvents.begin()->first;
+    if(loadPeriod && clockRuns() && (loadNextAwake != NEVER)) {
+        ull t = now + ((loadNextAwake > awake) ? loadNextAwake - awake : 0);
+        if(t < next) next = t;
+    }
+    ull radio = simRadioNextEvent();
+    if(radio < next) next = radio;
+    return next;
+}
+
+static void processEvents() {
+    if(wdtRunning && (wdtStart + wdtPeriod <= now)) {
+        wdtStart += wdtPeriod;
+        if(WDTCSR.value & _BV(WDIE)) pending |= 1 << IRQ_WDT;
+        else if(WDTCSR.value & _BV(WDE)) {
+            fprintf(stderr, "sim: watchdog reset\n");
+            abort();
+        }
+    }
+    if(adcDoneAt <= now) {
+        adcDoneAt = NEVER;
+        std::map<uint8_t, uint16_t>::iterator v = adcValues.find(ADMUX.value);
+        ADCW = (v != adcValues.end()) ? v->second : 512;
+        pending |= 1 << IRQ_ADC;
+    }
+    while(!pinEvents.empty() && (pinEvents.begin()->first <= now)) {
+        std::pair<uint8_t, uint8_t> e = pinEvents.begin()->second;
+        pinEvents.erase(pinEvents.begin());
+        setExternal(e.first, e.second);
+    }
+    if(loadPeriod && clockRuns() && (loadNextAwake <= awake)) {
+        loadNextAwake += loadPeriod;
+        pending |= 1 << IRQ_LOAD;
+    }
+    simRadioProcess(now);
+}
+
+/** Lets time run until t, events raise interrupts that are served if enabled.
+ */
+static void advance(ull t) {
+    while(true) {
+        ull next = nextEvent();
+        if(next > t) break;
+        moveTo(next);
+        processEvents();
+        dispatch();
+    }
+    moveTo(t);
+}
+
+SimSREG::operator uint8_t() const {
+    touch();
+    return iflag ? 0x80 : 0;
+}
+
+SimSREG& SimSREG::operator=(uint8_t value) {
+    if(value & 0x80) sei();
+    else cli();
+    return *this;
+}
+
+void cli() {
+    touch();
+    iflag = false;
+}
+
+void sei() {
+    touch();
+    iflag = true;
+    seiServed = dispatch();
+    seiServedCall = calls;
+}
+
+SimReg::operator uint8_t() const {
+    touch();
+    if(this == &PINB) return portLevels(8, 6);
+    if(this == &PINC) return portLevels(14, 6);
+    if(this == &PIND) return portLevels(0, 8);
+    if(this == &ADCSRA)
+        return value | ((adcDoneAt != NEVER) ? _BV(ADSC) : 0) | ((pending & (1 << IRQ_ADC)) ? _BV(ADIF) : 0);
+    if(this == &PCIFR) {
+        return ((pending & (1 << IRQ_PCINT0)) ? _BV(PCIF0) : 0) | ((pending & (1 << IRQ_PCINT1)) ? _BV(PCIF1) : 0)
+            | ((pending & (1 << IRQ_PCINT2)) ? _BV(PCIF2) : 0);
+    }
+    if(this == &WDTCSR) return value | ((pending & (1 << IRQ_WDT)) ? _BV(WDIF) : 0);
+    return value;
+}
+
+SimReg& SimReg::operator=(uint8_t v) {
+    touch();
+    if(this == &PCIFR) {
+        //flags are cleared by writing 1
+        if(v & _BV(PCIF0)) pending &= ~(1 << IRQ_PCINT0);
+        if(v & _BV(PCIF1)) pending &= ~(1 << IRQ_PCINT1);
+        if(v & _BV(PCIF2)) pending &= ~(1 << IRQ_PCINT2);
+    }
+    else if(this == &WDTCSR) {
+        if(v & _BV(WDIF)) pending &= ~(1 << IRQ_WDT);
+        v &= ~_BV(WDIF);
+        if(v & _BV(WDCE)) {
+            //timed sequence, the next write sets the configuration
+            value = v;
+            return *this;
+        }
+        value = v;
+        if(v & (_BV(WDIE) | _BV(WDE))) {
+            byte prescaler = (v & 0x07) | ((v & _BV(WDP3)) ? 0x08 : 0);
+            wdtPeriod = (ull)((double)((ull)SIM_WDT_BASE_US << prescaler) * wdtError);
+            if(!wdtRunning) wdtStart = now;
+            wdtRunning = true;
+        }
+        else wdtRunning = false;
+    }
+    else if(this == &ADCSRA) {
+        if(v & _BV(ADIF)) pending &= ~(1 << IRQ_ADC);
+        value = v & ~(_BV(ADSC) | _BV(ADIF));
+        if(!(v & _BV(ADEN))) adcDoneAt = NEVER;
+        else if((v & _BV(ADSC)) && (adcDoneAt == NEVER)) adcDoneAt = now + SIM_ADC_CONVERSION_US;
+    }
+    else if((this == &PINB) || (this == &PINC) || (this == &PIND)) {
+        //read only
+    }
+    else value = v;
+    if(iflag) dispatch();
+    return *this;
+}
+
+void wdt_reset() {
+    touch();
+    wdtStart = now;
+}
+
+void wdt_disable() {
+    touch();
+    wdtRunning = false;
+    WDTCSR.value = 0;
+}
+
+void set_sleep_mode(uint8_t mode) {
+    touch();
+    sleepMode = mode;
+}
+
+void sleep_enable() {
+    touch();
+    sleepBit = true;
+}
+
+void sleep_disable() {
+    touch();
+    sleepBit = false;
+}
+
+void sleep_cpu() {
+    //an interrupt served by the sei() just before is served after this instruction on the chip
+    if(seiServed && (seiServedCall == calls)) {
+        touch();
+        return;
+    }
+    touch();
+    if(!sleepBit) return;
+    //interrupts cannot run, but wake up the MCU
+    if(!iflag && wakeable()) return;
+    //a conversion starts when entering the noise reduction mode
+    if((sleepMode == SLEEP_MODE_ADC) && (ADCSRA.value & _BV(ADEN)) && (adcDoneAt == NEVER))
+        adcDoneAt = now + SIM_ADC_CONVERSION_US;
+    sleeping = true;
+    while(sleeping) {
+        ull next = nextEvent();
+        if(next == NEVER) {
+            fprintf(stderr, "sim: sleeping with nothing that can wake the MCU up\n");
+            abort();
+        }
+        moveTo(next);
+        processEvents();
+        if(!iflag && wakeable()) sleeping = false;
+        else dispatch();
+    }
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    touch();
+    if(pin < 20) pinModes[pin] = mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t l) {
+    touch();
+    if(pin == simRadioCSN) simRadioSelect(l == LOW);
+    else if(pin == simRadioCE) simRadioEnable(l == HIGH);
+    else if(pin == simRadioPowerPin) simRadioPower(l == HIGH);
+    if(pin >= 20) return;
+    uint8_t old = level(pin);
+    outLevels[pin] = l ? HIGH : LOW;
+    if(level(pin) != old) pinChanged(pin, old);
+    if(iflag) dispatch();
+}
+
+int digitalRead(uint8_t pin) {
+    touch();
+    return (pin < 20) ? level(pin) : LOW;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*f)(void), int mode) {
+    touch();
+    if(interrupt > 1) return;
+    extHandlers[interrupt] = f;
+    extModes[interrupt] = mode;
+}
+
+void detachInterrupt(uint8_t interrupt) {
+    touch();
+    if(interrupt > 1) return;
+    extHandlers[interrupt] = NULL;
+    pending &= ~(1 << (IRQ_INT0 + interrupt));
+}
+
+//Reading the timer takes a few cycles, so that loops on it progress
+unsigned long micros() {
+    touch();
+    advance(now + 1);
+    return (unsigned long)awake;
+}
+
+unsigned long millis() {
+    touch();
+    advance(now + 1);
+    return (unsigned long)(awake / 1000);
+}
+
+void delay(unsigned long ms) {
+    touch();
+    advance(now + (ull)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    touch();
+    advance(now + us);
+}
+
+//8MHz SPI, a byte and the instructions around it
+uint8_t SPIClass::transfer(uint8_t data) {
+    touch();
+    advance(now + 1);
+    return simRadioTransfer(data);
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+    for(size_t i = 0; i < size; i++)
+        write(buffer[i]);
+    return size;
+}
+
+size_t Print::print(unsigned long n, int base) {
+    char buf[33];
+    int i = sizeof(buf) - 1;
+    buf[i] = 0;
+    do {
+        int d = n % base;
+        buf[--i] = (d < 10) ? '0' + d : 'A' + d - 10;
+        n /= base;
+    } while(n > 0);
+    return write(&buf[i]);
+}
+
+size_t Print::print(long n, int base) {
+    if((n < 0) && (base == DEC))
+        return print('-') + print((unsigned long)-n, base);
+    return print((unsigned long)n, base);
+}
+
+size_t Print::print(double n, int digits) {
+    if(isnan(n)) return print("nan");
+    if(isinf(n)) return print("inf");
+    size_t w = 0;
+    if(n < 0) {
+        w += print('-');
+        n = -n;
+    }
+    double rounding = 0.5;
+    for(int i = 0; i < digits; i++)
+        rounding /= 10.0;
+    n += rounding;
+    unsigned long integer = (unsigned long)n;
+    w += print(integer);
+    double rest = n - (double)integer;
+    if(digits > 0) w += print('.');
+    while(digits-- > 0) {
+        rest *= 10.0;
+        int d = (int)rest;
+        w += print((char)('0' + d));
+        rest -= d;
+    }
+    return w;
+}
+
+int HardwareSerial::available() {
+    touch();
+    return serialIn.size() - serialInPos;
+}
+
+int HardwareSerial::read() {
+    touch();
+    if(serialInPos >= serialIn.size()) return -1;
+    return (uint8_t)serialIn[serialInPos++];
+}
+
+int HardwareSerial::peek() {
+    touch();
+    if(serialInPos >= serialIn.size()) return -1;
+    return (uint8_t)serialIn[serialInPos];
+}
+
+size_t HardwareSerial::write(uint8_t b) {
+    touch();
+    serialOut += (char)b;
+    return 1;
+}
+
+void simReset() {
+    iflag = true;
+    pending = 0;
+    seiServed = false;
+    sleepBit = false;
+    sleepMode = SLEEP_MODE_IDLE;
+    sleeping = false;
+    wdtError = 1;
+    wdtRunning = false;
+    wdtInterrupts = 0;
+    adcValues.clear();
+    adcDoneAt = NEVER;
+    for(int i = 0; i < 20; i++) {
+        pinModes[i] = INPUT;
+        outLevels[i] = LOW;
+        extLevels[i] = LOW;
+        extDriven[i] = false;
+    }
+    pinEvents.clear();
+    extHandlers[0] = extHandlers[1] = NULL;
+    loadPeriod = 0;
+    loadNextAwake = NEVER;
+    SimReg* regs[] = {&ADMUX, &ADCSRA, &PCIFR, &PCICR, &PCMSK0, &PCMSK1, &PCMSK2,
+                      &MCUSR, &MCUCR, &WDTCSR, &SMCR, &UCSR0A, &UCSR0B};
+    for(unsigned int i = 0; i < sizeof(regs) / sizeof(regs[0]); i++)
+        regs[i]->value = 0;
+    //nothing is being sent on the serial port
+    UCSR0A.value = _BV(TXC0);
+    serialOut.clear();
+    serialIn.clear();
+    serialInPos = 0;
+    simRadioReset();
+}
+
+unsigned long long simNow() {
+    return now;
+}
+
+unsigned long long simSleepTime() {
+    return slept;
+}
+
+void simRun(unsigned long long us) {
+    advance(now + us);
+}
+
+void simSetWatchdogError(double factor) {
+    wdtError = factor;
+}
+
+unsigned long simWatchdogInterrupts() {
+    return wdtInterrupts;
+}
+
+void simSetPin(uint8_t pin, uint8_t l, unsigned long long at) {
+    if(pin >= 20) return;
+    if(at <= now) {
+        setExternal(pin, l);
+        if(iflag) dispatch();
+    }
+    else pinEvents.insert(std::make_pair(at, std::make_pair(pin, l)));
+}
+
+void simDrivePin(uint8_t pin, uint8_t l) {
+    if(pin < 20) setExternal(pin, l);
+}
+
+void simSetADC(uint8_t admux, uint16_t value) {
+    adcValues[admux] = value;
+}
+
+void simSetInterruptLoad(unsigned long periodUS, unsigned long durationUS) {
+    loadPeriod = periodUS;
+    loadDuration = durationUS;
+    loadNextAwake = periodUS ? awake + periodUS : NEVER;
+}
+
+std::string& simSerialOutput() {
+    return serialOut;
+}
+
+void simSerialInput(const char* data, int len) {
+    serialIn.append(data, len);
+}
@@ -0,0 +1,632 @@
+/** Simulator of the nRF24L01+ and of the air around it. See sim.h.
+ * The chip is emulated at the level of its SPI commands, as described in the datasheet:
+ * registers with their reset values, 3 level TX and RX FIFOs, status flags cleared by
+ * writing 1, the IRQ line, and the Enhanced ShockBurst state machine of the PTX and PRX.
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#include "sim.h"
+#include <nRF24.h>
+#include <deque>
+#include <vector>
+
+typedef unsigned long long ull;
+static const ull NEVER = ~0ULL;
+
+//Settling of the PLL before a transmission or a reception, in us
+#define SIM_SETTLE_US 130
+//Window in which a packet on the air is seen by RPD, in us
+#define SIM_RPD_WINDOW_US 170
+
+uint8_t simRadioCE = NRF24_NO_PIN;
+uint8_t simRadioCSN = NRF24_NO_PIN;
+uint8_t simRadioIRQ = NRF24_NO_PIN;
+uint8_t simRadioPowerPin = NRF24_NO_PIN;
+
+/** A payload in the TX FIFO, pipe is the pipe of an ack payload */
+typedef struct {
+    uint8_t data[32];
+    uint8_t len;
+    boolean noack;
+    uint8_t pipe;
+    unsigned long id;
+} TxEntry;
+
+/** A payload in the RX FIFO */
+typedef struct {
+    uint8_t data[32];
+    uint8_t len;
+    uint8_t pipe;
+} RxEntry;
+
+/** A node that acknowledges the packets sent to its address */
+typedef struct {
+    uint8_t address[5];
+    unsigned int ackDelay;
+    std::deque<SimPacket> ackPayloads;
+    unsigned long lastId;
+} Peer;
+
+/** A packet sent by another node */
+typedef struct {
+    ull start;
+    ull end;
+    SimPacket packet;
+    boolean collided;
+} AirPacket;
+
+/** A transmission of the node */
+typedef struct {
+    ull start;
+    ull end;
+} Interval;
+
+//Chip
+static boolean powered;
+static boolean selected;
+static boolean ce;
+static uint8_t regs[0x20];
+static uint8_t addrP0[5], addrP1[5], addrTx[5];
+static std::deque<TxEntry> txFifo;
+static std::deque<RxEntry> rxFifo;
+static uint8_t plos;
+static uint8_t arc;
+static unsigned long nextId;
+//SPI transaction
+static uint8_t spiCmd;
+static int spiPos;
+static uint8_t spiBuf[32];
+//PTX state machine
+enum { TX_IDLE, TX_START, TX_END, TX_ACK, TX_RETRY };
+static int txPhase;
+static ull txAt;
+static uint8_t txRetries;
+static Interval txAir;
+static boolean txCollided;
+static SimPacket txAck;
+//PRX: since when the chip listens, after settling
+static ull rxSince;
+
+//Air
+static std::vector<Peer> peers;
+static std::deque<AirPacket> airPackets;
+static std::vector<Interval> nodeAir;
+static double lossProbability;
+static ull lossState;
+static std::vector<SimPacket> sentLog;
+static std::vector<SimPacket> ackLog;
+static unsigned long attempts;
+static unsigned long collisions;
+
+static int addressLen() {
+    int aw = regs[NRF24_REG_03_SETUP_AW] & NRF24_AW;
+    return (aw == 0) ? 5 : aw + 2;
+}
+
+/** Time on the air of a packet: preamble, address, control field, payload and CRC.
+ */
+static ull airtime(uint8_t len) {
+    int crc = (regs[NRF24_REG_00_CONFIG] & NRF24_EN_CRC) ? ((regs[NRF24_REG_00_CONFIG] & NRF24_CRCO) ? 2 : 1) : 0;
+    ull bits = 8 * (1 + addressLen() + len + crc) + 9;
+    uint8_t setup = regs[NRF24_REG_06_RF_SETUP];
+    if(setup & NRF24_RF_DR_LOW) return bits * 4;
+    if(setup & NRF24_RF_DR_HIGH) return (bits + 1) / 2;
+    return bits;
+}
+
+static ull retryDelay() {
+    return 250 * (((regs[NRF24_REG_04_SETUP_RETR] & NRF24_ARD) >> 4) + 1);
+}
+
+static boolean lost() {
+    if(lossProbability <= 0) return false;
+    lossState = lossState * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (double)(lossState >> 11) / 9007199254740992.0 < lossProbability;
+}
+
+enum { MODE_DOWN, MODE_STANDBY, MODE_TX, MODE_RX };
+
+static int mode() {
+    if(!powered || !(regs[NRF24_REG_00_CONFIG] & NRF24_PWR_UP)) return MODE_DOWN;
+    if(!ce) return MODE_STANDBY;
+    return (regs[NRF24_REG_00_CONFIG] & NRF24_PRIM_RX) ? MODE_RX : MODE_TX;
+}
+
+static uint8_t status() {
+    uint8_t s = regs[NRF24_REG_07_STATUS] & (NRF24_RX_DR | NRF24_TX_DS | NRF24_MAX_RT);
+    s |= rxFifo.empty() ? NRF24_RX_P_NO : (rxFifo.front().pipe << 1);
+    if(txFifo.size() == NRF24_TX_FIFO_LEN) s |= NRF24_STATUS_TX_FULL;
+    return s;
+}
+
+static void updateIRQ() {
+    if(simRadioIRQ == NRF24_NO_PIN) return;
+    uint8_t flags = regs[NRF24_REG_07_STATUS] & ~regs[NRF24_REG_00_CONFIG] & (NRF24_RX_DR | NRF24_TX_DS | NRF24_MAX_RT);
+    simDrivePin(simRadioIRQ, (powered && flags) ? LOW : HIGH);
+}
+
+static void resetRegisters() {
+    memset(regs, 0, sizeof(regs));
+    regs[NRF24_REG_00_CONFIG] = NRF24_EN_CRC;
+    regs[NRF24_REG_01_EN_AA] = 0x3f;
+    regs[NRF24_REG_02_EN_RXADDR] = NRF24_ERX_P0 | NRF24_ERX_P1;
+    regs[NRF24_REG_03_SETUP_AW] = NRF24_AW_5_BYTES;
+    regs[NRF24_REG_04_SETUP_RETR] = 0x03;
+    regs[NRF24_REG_05_RF_CH] = 0x02;
+    regs[NRF24_REG_06_RF_SETUP] = 0x0e;
+    regs[NRF24_REG_0C_RX_ADDR_P2] = 0xc3;
+    regs[NRF24_REG_0D_RX_ADDR_P3] = 0xc4;
+    regs[NRF24_REG_0E_RX_ADDR_P4] = 0xc5;
+    regs[NRF24_REG_0F_RX_ADDR_P5] = 0xc6;
+    memset(addrP0, 0xe7, 5);
+    memset(addrP1, 0xc2, 5);
+    memset(addrTx, 0xe7, 5);
+    txFifo.clear();
+    rxFifo.clear();
+    plos = 0;
+    arc = 0;
+    spiPos = 0;
+    txPhase = TX_IDLE;
+    txAt = NEVER;
+    rxSince = NEVER;
+}
+
+/** Starts the next packet of the TX FIFO if the chip can transmit.
+ */
+static void startTx() {
+    if((txPhase != TX_IDLE) || (mode() != MODE_TX) || txFifo.empty()
+       || (regs[NRF24_REG_07_STATUS] & NRF24_MAX_RT))
+        return;
+    txPhase = TX_START;
+    txAt = simNow() + SIM_SETTLE_US;
+    txRetries = 0;
+}
+
+/** Called when the mode may have changed.
+ */
+static void modeChanged(int before) {
+    int after = mode();
+    if(after == before) return;
+    if(after == MODE_RX) rxSince = simNow() + SIM_SETTLE_US;
+    else rxSince = NEVER;
+    //a transmission goes on in standby, it stops without power or when receiving
+    if((txPhase != TX_IDLE) && ((after == MODE_DOWN) || (after == MODE_RX) || (txPhase == TX_START && after != MODE_TX))) {
+        txPhase = TX_IDLE;
+        txAt = NEVER;
+    }
+    startTx();
+}
+
+static boolean overlaps(ull s1, ull e1, ull s2, ull e2) {
+    return (s1 < e2) && (s2 < e1);
+}
+
+static Peer* findPeer(const uint8_t* address) {
+    for(size_t i = 0; i < peers.size(); i++)
+        if(memcmp(peers[i].address, address, addressLen()) == 0) return &peers[i];
+    return NULL;
+}
+
+/** Ends an attempt: the peer may receive it and answer.
+ */
+static void endAttempt() {
+    ull t = txAir.end;
+    nodeAir.push_back(txAir);
+    //packets from other nodes on the air at the same time
+    boolean collided = txCollided;
+    for(size_t i = 0; i < airPackets.size(); i++) {
+        if(overlaps(txAir.start, txAir.end, airPackets[i].start, airPackets[i].end)) {
+            airPackets[i].collided = true;
+            collided = true;
+        }
+    }
+    if(collided) collisions++;
+    TxEntry& p = txFifo.front();
+    boolean received = !collided && !lost();
+    SimPacket log;
+    log.time = t;
+    memcpy(log.address, addrTx, 5);
+    log.addressLen = addressLen();
+    memcpy(log.data, p.data, p.len);
+    log.len = p.len;
+    log.noack = p.noack;
+    log.retries = txRetries;
+    if(p.noack) {
+        if(received) sentLog.push_back(log);
+        txPhase = TX_ACK;
+        txAt = t;
+        txAck.len = 0;
+        return;
+    }
+    Peer* peer = findPeer(addrTx);
+    if(received && (peer != NULL)) {
+        //retransmissions have the same id and are discarded by the peer
+        if(peer->lastId != p.id) sentLog.push_back(log);
+        peer->lastId = p.id;
+        txAck.len = 0;
+        if(!peer->ackPayloads.empty()) txAck = peer->ackPayloads.front();
+        ull ackEnd = peer->ackDelay + airtime(txAck.len);
+        //the PTX listens for the ack during the retransmit delay
+        if(!lost() && (ackEnd <= retryDelay())) {
+            if(txAck.len > 0) peer->ackPayloads.pop_front();
+            txPhase = TX_ACK;
+            txAt = t + ackEnd;
+            return;
+        }
+        //the ack payload stays with the peer, as it was not received
+    }
+    txPhase = TX_RETRY;
+    txAt = t + retryDelay();
+}
+
+static void txEvent() {
+    ull t = txAt;
+    switch(txPhase) {
+    case TX_START:
+        if(txFifo.empty() || (mode() == MODE_DOWN) || (mode() == MODE_RX)) {
+            txPhase = TX_IDLE;
+            txAt = NEVER;
+            return;
+        }
+        attempts++;
+        txAir.start = t;
+        txAir.end = t + airtime(txFifo.front().len);
+        txCollided = false;
+        txPhase = TX_END;
+        txAt = txAir.end;
+        break;
+    case TX_END:
+        endAttempt();
+        break;
+    case TX_ACK:
+        txFifo.pop_front();
+        arc = txRetries;
+        regs[NRF24_REG_07_STATUS] |= NRF24_TX_DS;
+        if((txAck.len > 0) && (regs[NRF24_REG_1D_FEATURE] & NRF24_EN_ACK_PAY) && (rxFifo.size() < 3)) {
+            RxEntry e;
+            memcpy(e.data, txAck.data, txAck.len);
+            e.len = txAck.len;
+            e.pipe = 0;
+            rxFifo.push_back(e);
+            regs[NRF24_REG_07_STATUS] |= NRF24_RX_DR;
+        }
+        txPhase = TX_IDLE;
+        txAt = NEVER;
+        startTx();
+        break;
+    case TX_RETRY:
+        if(txRetries < (regs[NRF24_REG_04_SETUP_RETR] & NRF24_ARC)) {
+            txRetries++;
+            txPhase = TX_START;
+            //the retransmit delay includes the settling
+            txAt = t;
+            break;
+        }
+        //the packet stays in the FIFO and the chip stops until MAX_RT is cleared
+        arc = txRetries;
+        if(plos < 15) plos++;
+        regs[NRF24_REG_07_STATUS] |= NRF24_MAX_RT;
+        txPhase = TX_IDLE;
+        txAt = NEVER;
+        break;
+    }
+}
+
+/** Gives the pipe whose address is that of a packet, -1 if none.
+ */
+static int matchPipe(const uint8_t* address) {
+    int len = addressLen();
+    for(int pipe = 0; pipe < 6; pipe++) {
+        if(!(regs[NRF24_REG_02_EN_RXADDR] & (1 << pipe))) continue;
+        uint8_t a[5];
+        if(pipe == 0) memcpy(a, addrP0, 5);
+        else {
+            memcpy(a, addrP1, 5);
+            if(pipe > 1) a[0] = regs[NRF24_REG_0A_RX_ADDR_P0 + pipe];
+        }
+        if(memcmp(a, address, len) == 0) return pipe;
+    }
+    return -1;
+}
+
+/** A packet from another node has been on the air, the chip may receive it.
+ */
+static void endAirPacket(AirPacket& a) {
+    for(size_t i = 0; i < nodeAir.size(); i++)
+        if(overlaps(nodeAir[i].start, nodeAir[i].end, a.start, a.end)) a.collided = true;
+    if((txPhase == TX_END) && overlaps(txAir.start, txAir.end, a.start, a.end)) {
+        a.collided = true;
+        txCollided = true;
+    }
+    for(size_t i = 0; i < airPackets.size(); i++) {
+        if((&airPackets[i] != &a) && overlaps(airPackets[i].start, airPackets[i].end, a.start, a.end)) {
+            airPackets[i].collided = true;
+            a.collided = true;
+        }
+    }
+    if(a.collided) {
+        collisions++;
+        return;
+    }
+    if((mode() != MODE_RX) || (rxSince > a.start) || lost()) return;
+    int pipe = matchPipe(a.packet.address);
+    if(pipe < 0) return;
+    //without dynamic payloads the length is set by RX_PW
+    boolean dynamic = (regs[NRF24_REG_1D_FEATURE] & NRF24_EN_DPL) && (regs[NRF24_REG_1C_DYNPD] & (1 << pipe));
+    if(!dynamic && (a.packet.len != regs[NRF24_REG_11_RX_PW_P0 + pipe])) return;
+    //a full RX FIFO does not take the packet, nor acknowledges it
+    if(rxFifo.size() == 3) return;
+    RxEntry e;
+    memcpy(e.data, a.packet.data, a.packet.len);
+    e.len = a.packet.len;
+    e.pipe = pipe;
+    rxFifo.push_back(e);
+    regs[NRF24_REG_07_STATUS] |= NRF24_RX_DR;
+    if(a.packet.noack || !(regs[NRF24_REG_01_EN_AA] & (1 << pipe))) return;
+    SimPacket ack = a.packet;
+    ack.time = a.end + SIM_SETTLE_US;
+    ack.len = 0;
+    if(regs[NRF24_REG_1D_FEATURE] & NRF24_EN_ACK_PAY) {
+        for(std::deque<TxEntry>::iterator i = txFifo.begin(); i != txFifo.end(); i++) {
+            if(i->pipe != pipe) continue;
+            memcpy(ack.data, i->data, i->len);
+            ack.len = i->len;
+            txFifo.erase(i);
+            regs[NRF24_REG_07_STATUS] |= NRF24_TX_DS;
+            break;
+        }
+    }
+    if(!lost()) ackLog.push_back(ack);
+}
+
+static void command() {
+    int n = spiPos - 1;
+    uint8_t cmd = spiCmd;
+    int before = mode();
+    if((cmd & 0xe0) == NRF24_COMMAND_W_REGISTER) {
+        uint8_t reg = cmd & NRF24_REGISTER_MASK;
+        if(n == 0) return;
+        switch(reg) {
+        case NRF24_REG_0A_RX_ADDR_P0: memcpy(addrP0, spiBuf, n < 5 ? n : 5); break;
+        case NRF24_REG_0B_RX_ADDR_P1: memcpy(addrP1, spiBuf, n < 5 ? n : 5); break;
+        case NRF24_REG_10_TX_ADDR: memcpy(addrTx, spiBuf, n < 5 ? n : 5); break;
+        case NRF24_REG_07_STATUS:
+            regs[reg] &= ~(spiBuf[0] & (NRF24_RX_DR | NRF24_TX_DS | NRF24_MAX_RT));
+            break;
+        case NRF24_REG_05_RF_CH:
+            regs[reg] = spiBuf[0];
+            plos = 0;
+            break;
+        case NRF24_REG_08_OBSERVE_TX:
+        case NRF24_REG_09_RPD:
+        case NRF24_REG_17_FIFO_STATUS:
+            break;
+        default:
+            regs[reg] = spiBuf[0];
+        }
+    }
+    else if((cmd == NRF24_COMMAND_W_TX_PAYLOAD) || (cmd == NRF24_COMMAND_W_TX_PAYLOAD_NOACK)
+            || ((cmd & 0xf8) == NRF24_COMMAND_W_ACK_PAYLOAD(0))) {
+        if((n == 0) || (txFifo.size() == NRF24_TX_FIFO_LEN)) return;
+        TxEntry e;
+        memcpy(e.data, spiBuf, n);
+        e.len = n;
+        e.noack = (cmd == NRF24_COMMAND_W_TX_PAYLOAD_NOACK);
+        e.pipe = ((cmd & 0xf8) == NRF24_COMMAND_W_ACK_PAYLOAD(0)) ? (cmd & 0x07) : 0xff;
+        e.id = ++nextId;
+        txFifo.push_back(e);
+    }
+    else if(cmd == NRF24_COMMAND_R_RX_PAYLOAD) {
+        if((n > 0) && !rxFifo.empty()) rxFifo.pop_front();
+    }
+    else if(cmd == NRF24_COMMAND_FLUSH_TX) {
+        txFifo.clear();
+        if(txPhase != TX_IDLE) {
+            txPhase = TX_IDLE;
+            txAt = NEVER;
+        }
+    }
+    else if(cmd == NRF24_COMMAND_FLUSH_RX) rxFifo.clear();
+    modeChanged(before);
+    startTx();
+}
+
+static uint8_t readRegister(uint8_t reg, int i) {
+    switch(reg) {
+    case NRF24_REG_0A_RX_ADDR_P0: return (i < 5) ? addrP0[i] : 0;
+    case NRF24_REG_0B_RX_ADDR_P1: return (i < 5) ? addrP1[i] : 0;
+    case NRF24_REG_10_TX_ADDR: return (i < 5) ? addrTx[i] : 0;
+    }
+    if(i > 0) return 0;
+    switch(reg) {
+    case NRF24_REG_07_STATUS: return status();
+    case NRF24_REG_08_OBSERVE_TX: return (plos << 4) | arc;
+    case NRF24_REG_09_RPD:
+        if(mode() != MODE_RX) return 0;
+        for(size_t j = 0; j < airPackets.size(); j++)
+            if(overlaps(airPackets[j].start, airPackets[j].end, simNow() - SIM_RPD_WINDOW_US, simNow() + 1)) return NRF24_RPD;
+        return 0;
+    case NRF24_REG_17_FIFO_STATUS:
+        return (txFifo.empty() ? NRF24_TX_EMPTY : 0) | ((txFifo.size() == NRF24_TX_FIFO_LEN) ? NRF24_TX_FULL : 0)
+            | (rxFifo.empty() ? NRF24_RX_EMPTY : 0) | ((rxFifo.size() == 3) ? NRF24_RX_FULL : 0);
+    }
+    return regs[reg];
+}
+
+void simRadioSelect(boolean s) {
+    if(s == selected) return;
+    selected = s;
+    if(s) spiPos = 0;
+    else if(powered && (spiPos > 0)) {
+        command();
+        updateIRQ();
+    }
+}
+
+uint8_t simRadioTransfer(uint8_t data) {
+    if(!selected || !powered) return 0;
+    if(spiPos == 0) {
+        spiCmd = data;
+        spiPos = 1;
+        return status();
+    }
+    int i = spiPos - 1;
+    spiPos++;
+    if((spiCmd & 0xe0) == NRF24_COMMAND_R_REGISTER) return readRegister(spiCmd & NRF24_REGISTER_MASK, i);
+    if(spiCmd == NRF24_COMMAND_R_RX_PAYLOAD) {
+        if(rxFifo.empty() || (i >= rxFifo.front().len)) return 0;
+        return rxFifo.front().data[i];
+    }
+    if(spiCmd == NRF24_COMMAND_R_RX_PL_WID) return rxFifo.empty() ? 0 : rxFifo.front().len;
+    if(i < 32) spiBuf[i] = data;
+    return 0;
+}
+
+void simRadioEnable(boolean e) {
+    int before = mode();
+    ce = e;
+    modeChanged(before);
+}
+
+void simRadioPower(boolean p) {
+    if(p == powered) return;
+    int before = mode();
+    powered = p;
+    if(p) resetRegisters();
+    else {
+        txFifo.clear();
+        rxFifo.clear();
+    }
+    modeChanged(before);
+    updateIRQ();
+}
+
+unsigned long long simRadioNextEvent() {
+    ull next = txAt;
+    for(size_t i = 0; i < airPackets.size(); i++)
+        if(airPackets[i].end < next) next = airPackets[i].end;
+    return next;
+}
+
+void simRadioProcess(unsigned long long now) {
+    boolean changed = false;
+    while(true) {
+        //the earliest event first
+        size_t first = airPackets.size();
+        for(size_t i = 0; i < airPackets.size(); i++)
+            if((airPackets[i].end <= now) && ((first == airPackets.size()) || (airPackets[i].end < airPackets[first].end))) first = i;
+        ull airAt = (first < airPackets.size()) ? airPackets[first].end : NEVER;
+        if((txAt <= now) && (txAt <= airAt)) txEvent();
+        else if(airAt != NEVER) {
+            endAirPacket(airPackets[first]);
+            airPackets.erase(airPackets.begin() + first);
+        }
+        else break;
+        changed = true;
+    }
+    if(!changed) return;
+    //transmissions older than any packet on the air cannot collide any more
+    while(!nodeAir.empty() && (nodeAir.front().end + 10000 < now)) nodeAir.erase(nodeAir.begin());
+    updateIRQ();
+}
+
+void simRadioReset() {
+    powered = (simRadioPowerPin == NRF24_NO_PIN);
+    selected = false;
+    ce = false;
+    resetRegisters();
+    nextId = 0;
+    peers.clear();
+    airPackets.clear();
+    nodeAir.clear();
+    lossProbability = 0;
+    lossState = 1;
+    sentLog.clear();
+    ackLog.clear();
+    attempts = 0;
+    collisions = 0;
+    updateIRQ();
+}
+
+void simRadioConnect(uint8_t chipEnablePin, uint8_t chipSelectPin, uint8_t irqPin, uint8_t powerPin) {
+    simRadioCE = chipEnablePin;
+    simRadioCSN = chipSelectPin;
+    simRadioIRQ = irqPin;
+    simRadioPowerPin = powerPin;
+    simRadioReset();
+}
+
+void simRadioAddPeer(const uint8_t* address, unsigned int ackDelayUS) {
+    Peer p;
+    memcpy(p.address, address, 5);
+    p.ackDelay = ackDelayUS;
+    p.lastId = 0;
+    peers.push_back(p);
+}
+
+void simRadioSetAckPayload(const uint8_t* address, const uint8_t* data, uint8_t len) {
+    Peer* p = findPeer(address);
+    if(p == NULL) return;
+    SimPacket ack;
+    memset(&ack, 0, sizeof(ack));
+    memcpy(ack.data, data, len);
+    ack.len = len;
+    p->ackPayloads.push_back(ack);
+}
+
+void simRadioSetLoss(double probability, unsigned long seed) {
+    lossProbability = probability;
+    lossState = seed;
+}
+
+void simRadioSend(const uint8_t* address, const uint8_t* data, uint8_t len, boolean noack, unsigned long long at) {
+    AirPacket a;
+    a.start = (at > simNow()) ? at : simNow();
+    a.end = a.start + airtime(len);
+    memcpy(a.packet.address, address, 5);
+    a.packet.addressLen = addressLen();
+    memcpy(a.packet.data, data, len);
+    a.packet.len = len;
+    a.packet.noack = noack;
+    a.packet.retries = 0;
+    a.packet.time = a.end;
+    a.collided = false;
+    airPackets.push_back(a);
+}
+
+int simRadioSentCount() {
+    return sentLog.size();
+}
+
+const SimPacket& simRadioSent(int i) {
+    return sentLog[i];
+}
+
+int simRadioAckedCount() {
+    return ackLog.size();
+}
+
+const SimPacket& simRadioAckPayload(int i) {
+    return ackLog[i];
+}
+
+unsigned long simRadioAttempts() {
+    return attempts;
+}
+
+unsigned long simRadioCollisions() {
+    return collisions;
+}
+
+uint8_t simRadioRegister(uint8_t reg) {
+    if(!powered) return 0;
+    return readRegister(reg & NRF24_REGISTER_MASK, 0);
+}
+
+void simRadioAddress(uint8_t reg, uint8_t* address) {
+    if(reg == NRF24_REG_0A_RX_ADDR_P0) memcpy(address, addrP0, 5);
+    else if(reg == NRF24_REG_0B_RX_ADDR_P1) memcpy(address, addrP1, 5);
+    else memcpy(address, addrTx, 5);
+}
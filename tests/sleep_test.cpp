@@ -0,0 +1,167 @@
+/** Host tests of the sleep of pIoT_Energy against the simulated watchdog and pins of sim.h:
+ * time slept and counted with a drifting watchdog, periods used with and without pins,
+ * and the time counted when pins wake the board up in the middle of a period,
+ * and the timers of the scheduler while pins keep waking the board up.
+ * Build and run with: make -C tests
+ *
+ * Author: Dario Salvi (dariosalvi78 at gmail dot com)
+ *
+ * Licensed under the GPL license http://www.gnu.org/copyleft/gpl.html
+ */
+#include "sim.h"
+#include <pIoT_Energy.h>
+#include <pIoT_Scheduler.h>
+
+static int failures = 0;
+static int checks = 0;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if(!(cond)) { \
+        failures++; \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while(0)
+
+#define WAKE_PIN_N 3
+//the watchdog is 10% slow
+#define WDT_ERROR 1.1
+//longest period when pins are watched, in us
+#define PIN_PERIOD_US ((unsigned long long)(WDT_MIN_PERIOD_MS * 1000.0 * WDT_ERROR) << WDT_PIN_MAX_PRESCALER)
+
+/** Resets the simulator with a slow watchdog and calibrates it.
+ */
+static void start() {
+    simReset();
+    simSetWatchdogError(WDT_ERROR);
+    CHECK(calibrateWatchdog());
+}
+
+/** Schedules short pulses on the wake pin.
+ * @param periodUS time between the pulses
+ * @param count number of pulses
+ */
+static void pulses(unsigned long long periodUS, int count) {
+    unsigned long long t = simNow();
+    for(int i = 1; i <= count; i++){
+        simSetPin(WAKE_PIN_N, HIGH, t + i * periodUS);
+        simSetPin(WAKE_PIN_N, LOW, t + i * periodUS + 100);
+    }
+}
+
+static void testTimerSleep() {
+    start();
+    unsigned long long real = simSleepTime();
+    unsigned long counted = getTotalSleepMillis();
+    unsigned long wakes = simWatchdogInterrupts();
+    CHECK(sleepUntilMillis(10000, 0) == WAKE_TIMER);
+    real = simSleepTime() - real;
+    counted = getTotalSleepMillis() - counted;
+    wakes = simWatchdogInterrupts() - wakes;
+    //the time slept is rounded down to the shortest period
+    CHECK(real <= 10000000ULL);
+    CHECK(real > 10000000ULL - 16 * 1000 * WDT_ERROR);
+    //the calibration corrects the drift
+    CHECK(labs((long)counted - (long)(real / 1000)) <= 2);
+    //the longest periods that fit: 9011, 563, 282 and 141ms
+    CHECK(wakes == 4);
+}
+
+static void testPinCapsPeriod() {
+    start();
+    int pins[] = {WAKE_PIN_N};
+    unsigned long long real = simSleepTime();
+    unsigned long wakes = simWatchdogInterrupts();
+    CHECK(sleepUntilPins(10000, 1, pins) == WAKE_TIMER);
+    real = simSleepTime() - real;
+    wakes = simWatchdogInterrupts() - wakes;
+    CHECK(real <= 10000000ULL);
+    CHECK(real > 10000000ULL - 16 * 1000 * WDT_ERROR);
+    //no period longer than the cap
+    CHECK(wakes >= 10000000ULL / PIN_PERIOD_US);
+}
+
+static void testPinWakeCounted() {
+    start();
+    int pins[] = {WAKE_PIN_N};
+    //pins wake the board up more often than the watchdog
+    pulses(300000, 30);
+    unsigned long long real = simSleepTime();
+    unsigned long counted = getTotalSleepMillis();
+    int pinWakes = 0;
+    unsigned long long end = simNow() + 30 * 300000ULL;
+    while(simNow() < end){
+        if(sleepUntilPins(5000, 1, pins) == WAKE_PIN){
+            CHECK(getWakePins() & (1UL << WAKE_PIN_N));
+            pinWakes++;
+        }
+        //some work after each wake up
+        simRun(2000);
+    }
+    real = simSleepTime() - real;
+    counted = getTotalSleepMillis() - counted;
+    CHECK(pinWakes == 30);
+    //what has been slept before the pins is counted, apart from the period still running
+    CHECK(counted <= real / 1000 + 2);
+    CHECK(counted + PIN_PERIOD_US / 1000 + 2 >= real / 1000);
+}
+
+static void testPinWakeDeadline() {
+    start();
+    int pins[] = {WAKE_PIN_N};
+    pulses(300000, 10);
+    //a deadline 2s away, the time slept between the pins is taken from it
+    unsigned long long deadline = simNow() + 2000000ULL;
+    byte reason;
+    while((reason = sleepUntilPins((deadline - simNow()) / 1000, 1, pins)) == WAKE_PIN)
+        simRun(2000);
+    CHECK(reason == WAKE_TIMER);
+    //the board may wake up early by up to the part of a period slept before a pin
+    CHECK(simNow() <= deadline + 2000);
+    CHECK(simNow() + PIN_PERIOD_US >= deadline);
+}
+
+//Calls of the functions of the scheduler, and real time of the timer calls
+static int pinCalls;
+static int timerCalls;
+static unsigned long long timerTimes[8];
+
+static void onPin(byte pin, boolean level) {
+    pinCalls++;
+}
+
+static void onTimer() {
+    if(timerCalls < 8) timerTimes[timerCalls] = simNow();
+    timerCalls++;
+}
+
+static void testSchedulerPinTraffic() {
+    start();
+    pinMode(WAKE_PIN_N, INPUT);
+    CHECK(onPinChange(WAKE_PIN_N, onPin));
+    //a hello every 10s, as the Actuator does, while a pin changes every 300ms
+    unsigned long long begin = simNow();
+    CHECK(addTimer(10000, 10000, onTimer) != NO_TIMER);
+    pulses(300000, 200);
+    while(simNow() < begin + 60000000ULL + 500000ULL)
+        runScheduler();
+    CHECK(pinCalls >= 200);
+    //the time slept between the pins makes the deadlines come
+    CHECK(timerCalls == 6);
+    for(int i = 0; (i < timerCalls) && (i < 8); i++){
+        unsigned long long due = begin + (i + 1) * 10000000ULL;
+        CHECK(timerTimes[i] + 20000 >= due);
+        CHECK(timerTimes[i] <= due + PIN_PERIOD_US + 20000);
+    }
+}
+
+int main() {
+    testTimerSleep();
+    testPinCapsPeriod();
+    testPinWakeCounted();
+    testPinWakeDeadline();
+    //last, the scheduler cannot be reset
+    testSchedulerPinTraffic();
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}